@@ -0,0 +1,83 @@
+/* This file is part of the yazpp toolkit.
+ * Copyright (C) Index Data 
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Index Data nor the names of its contributors
+ *       may be used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS AND CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef YAZPP_APDU_CAPTURE_INCLUDED
+#define YAZPP_APDU_CAPTURE_INCLUDED
+
+#include <yaz/yconfig.h>
+
+struct timeval;
+
+namespace yazpp_1 {
+/** Binary APDU capture file.
+    Records raw BER packages as they appear on the wire, so that
+    traffic can be replayed later (see yaz-replay). The file starts with
+    the 8 byte magic "YAZPPCAP" and is followed by records, each with a
+    20 byte header in network byte order:
+    <pre>
+    session id (4), seconds (4), microseconds (4),
+    direction (1), reserved (3), length (4)
+    </pre>
+    followed by length bytes of BER. Records are only ever appended.
+    Objects that write the same file name share one stream, so records
+    written by sessions in different threads do not interleave.
+*/
+class YAZ_EXPORT APDUCapture {
+ public:
+    enum {
+        RECV = 0,  ///< package received by this peer
+        SEND = 1   ///< package sent by this peer
+    };
+    APDUCapture();
+    ~APDUCapture();
+    /// Open file for appending. Returns 0 on success; -1 on failure
+    int open_write(const char *fname);
+    /// Open file for reading. Returns 0 on success; -1 on failure
+    int open_read(const char *fname);
+    void close();
+    const char *get_fname();
+    /// Append one package with current time. Returns 0 on success
+    int write(unsigned session, int direction, const char *buf, int len);
+    /// Read next package. Returns 1 if read, 0 on EOF, -1 on bad file
+    int read(unsigned *session, int *direction, struct timeval *tv,
+             const char **buf, int *len);
+ private:
+    class Rep;
+    Rep *m_p;
+};
+};
+
+#endif
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
+
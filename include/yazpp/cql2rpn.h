@@ -29,17 +29,44 @@
 #include <yaz/z-core.h>
 
 namespace yazpp_1 {
+/// CQL to RPN translation. One object may be shared by any number of
+/// threads; the mapping may be replaced while queries are in progress
 class YAZ_EXPORT Yaz_cql2rpn {
  public:
     Yaz_cql2rpn();
     ~Yaz_cql2rpn();
+    /// Read mapping unless one is already loaded
     void set_pqf_file(const char *fname);
+    /// Read mapping and make it current. Queries in progress finish with
+    /// the previous mapping. On failure the previous mapping is kept
     bool parse_spec_file(const char *fname, int *error);
+    /// Re-read the mapping file, in the calling thread, if it has
+    /// changed since it was read. Returns 1 if reloaded, 0 if unchanged,
+    /// -1 if the reload failed
+    int reload_if_modified();
+    /// Check the mapping file every seconds in a background thread and
+    /// reload it if it has changed. Queries keep running with the
+    /// previous mapping while the new one is read. 0 stops checking,
+    /// which is the default. Not to be called by several threads at once
+    void set_reload_interval(int seconds);
+    /// Transform CQL to RPN allocated with o. The search clauses are
+    /// mapped by YAZ as PQF and parsed; a sortby clause is built directly
+    /// as type-7 sort keys. Returns 0 on success; SRU diagnostic otherwise
     int query_transform(const char *cql, Z_RPNQuery **rpnquery, ODR o,
                         char **addinfop);
     int rpn2cql_transform(Z_RPNQuery *q, WRBUF cql, ODR o, char **addinfop);
+    /// Remember the last max_entries translations (and failures) by
+    /// CQL string so that repeated queries are not parsed again.
+    /// Default is 0 (no cache)
+    void set_cache_size(int max_entries);
+    int get_cache_entries();
+    long get_cache_hits();
+    long get_cache_misses();
  private:
-    cql_transform_t m_transform;
+    class Rep;
+    Rep *m_p;
+    Yaz_cql2rpn(const Yaz_cql2rpn &);
+    Yaz_cql2rpn &operator=(const Yaz_cql2rpn &);
 };
 };
 
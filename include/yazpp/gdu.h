@@ -32,21 +32,30 @@
 #include <yaz/proto.h>
 
 namespace yazpp_1 {
+    /// Z39.50/HTTP PDU. Copies share one immutable, reference counted PDU
     class YAZ_EXPORT GDU {
     public:
         GDU(const GDU &);
         GDU(Z_GDU *gdu);
         GDU(Z_APDU *apdu);
+        /// Adopt decoded gdu and the decode ODR holding it (no copy)
+        GDU(ODR decode, Z_GDU *gdu, int len);
         GDU();
         ~GDU();
         GDU &operator=(const GDU &);
+#if __cplusplus >= 201103L
+        GDU(GDU &&);
+        GDU &operator=(GDU &&);
+#endif
+        /// PDU shared by all copies; must not be modified
         Z_GDU *get() const;
         void move_away_gdu(ODR dst, Z_GDU **gdu);
+        /// Encoded size of PDU
         int get_size();
     private:
+        struct Rep;
         void base(Z_GDU *gdu, ODR o);
-        Z_GDU *m_gdu;
-        ODR m_decode;
+        Rep *m_p;
     };
 };
 
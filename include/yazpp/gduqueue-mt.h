@@ -0,0 +1,74 @@
+/* This file is part of the yazpp toolkit.
+ * Copyright (C) Index Data 
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Index Data nor the names of its contributors
+ *       may be used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS AND CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef YAZPP_GDUQUEUE_MT_INCLUDED
+#define YAZPP_GDUQUEUE_MT_INCLUDED
+
+#include <yaz/yconfig.h>
+
+namespace yazpp_1 {
+    class GDU;
+    /// FIFO of GDUs for handing requests between threads.
+    /// enqueue is lock-free and may be called by any number of threads.
+    /// Consumers are serialized by a mutex that producers only take when
+    /// a consumer is waiting
+    class YAZ_EXPORT GDUQueueMT {
+    public:
+        GDUQueueMT();
+        /// deletes remaining GDUs
+        ~GDUQueueMT();
+        /// Append gdu; queue owns it
+        void enqueue(GDU *gdu);
+        /// Remove oldest GDU; returns 0 if empty
+        GDU *dequeue();
+        /// Remove up to max GDUs into gdus; returns number removed
+        int dequeue_batch(GDU **gdus, int max);
+        /// Wait for queue to be non-empty. timeout_ms < 0 waits forever.
+        /// Returns 1 if GDUs are available; 0 on timeout or wakeup
+        int wait(int timeout_ms);
+        /// Make all current waiters return
+        void wakeup();
+        /// Number of queued GDUs (approximate while producers run)
+        int size();
+    private:
+        class Rep;
+        Rep *m_p;
+        GDUQueueMT(const GDUQueueMT &);
+        GDUQueueMT &operator=(const GDUQueueMT &);
+    };
+};
+
+#endif
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
+
@@ -32,23 +32,43 @@
 
 namespace yazpp_1 {
     class GDU;
-    class YAZ_EXPORT GDUQueue_List {
-        friend class GDUQueue;
-    private:
-        GDU *m_item;
-        GDUQueue_List *m_next;
-    };
-
+    /// FIFO of GDUs with optional limits on items and bytes. GDUs may
+    /// be put in priority classes by APDU type; each class is FIFO
     class YAZ_EXPORT GDUQueue {
     public:
+        enum {
+            PRIORITY_HIGH = 0,
+            PRIORITY_NORMAL = 1,
+            PRIORITY_LOW = 2,
+            NO_PRIORITIES = 3
+        };
         GDUQueue();
         ~GDUQueue();
         void clear();
-        void enqueue(GDU *gdu);
+        /// Append gdu; queue owns it. Returns -1 if rejected by a limit
+        /// in which case the caller still owns gdu
+        int enqueue(GDU *gdu);
         GDU *dequeue();
         int size();
+        /// Sum of encoded sizes of queued GDUs
+        int get_bytes();
+        /// Limit number of queued GDUs; 0 for no limit (default)
+        void set_max_items(int max_items);
+        /// Limit total bytes of queued GDUs; 0 for no limit (default)
+        void set_max_bytes(int max_bytes);
+        /// Put GDUs of APDU type (Z_APDU_..) in class prio. All GDUs are
+        /// PRIORITY_NORMAL, i.e. plain FIFO, until this is called
+        int set_priority(int apdu_type, int prio);
+        /// Init, close and resource/access control go in PRIORITY_HIGH
+        void set_default_priorities();
+        /// Serve a non-empty lower class after it has been passed over
+        /// limit times; 0 for strict priority. Default is 8
+        void set_starvation_limit(int limit);
     private:
-        GDUQueue_List *m_list;
+        class Rep;
+        Rep *m_p;
+        GDUQueue(const GDUQueue &);
+        GDUQueue &operator=(const GDUQueue &);
     };
 };
 
@@ -68,6 +68,7 @@ class YAZ_EXPORT PDU_Assoc : public IPDU_Observable, yazpp_1::ISocketObserver {
     void destroy();
     void idleTime(int timeout);
     void close_session();
+    yazpp_1::ISocketObservable *get_socket_observable();
     const char *getpeername();
     void set_cert_fname(const char *fname);
 };
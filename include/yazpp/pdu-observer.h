@@ -33,6 +33,7 @@
 namespace yazpp_1 {
 
 class IPDU_Observer;
+class ISocketObservable;
 
 /** Protocol Data Unit Observable.
     This interface implements a Protocol Data Unit (PDU) network driver.
@@ -60,6 +61,8 @@ class YAZ_EXPORT IPDU_Observable {
     virtual const char *getpeername() = 0;
     /// Close session
     virtual void close_session() = 0;
+    /// Socket event loop that drives this; 0 if unknown (default)
+    virtual ISocketObservable *get_socket_observable();
 
     virtual ~IPDU_Observable();
 };
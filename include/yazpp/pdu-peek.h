@@ -0,0 +1,70 @@
+/* This file is part of the yazpp toolkit.
+ * Copyright (C) Index Data 
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Index Data nor the names of its contributors
+ *       may be used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS AND CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef YAZPP_PDU_PEEK_INCLUDED
+#define YAZPP_PDU_PEEK_INCLUDED
+
+#include <yaz/yconfig.h>
+
+namespace yazpp_1 {
+/** Header-only inspection of an encoded Z39.50 package.
+    Walks the BER of a buffer (as given to recv_PDU) far enough to find
+    the APDU type, the referenceId and, for search and scan requests,
+    the database names. Nothing is decoded or allocated per package;
+    returned strings point into the buffer and are not 0-terminated.
+    The object may be reused for any number of packages.
+*/
+class YAZ_EXPORT PDU_Peek {
+ public:
+    PDU_Peek();
+    ~PDU_Peek();
+    /// Inspect package. 1=Z39.50 APDU, 0=other (HTTP), -1=bad BER
+    int parse(const char *buf, int len);
+    /// APDU type (Z_APDU_..) of last package or -1
+    int get_type();
+    /// referenceId of last package; 0 if absent
+    const char *get_referenceId(int *len);
+    /// Number of database names in last search/scan request
+    int get_num_databaseNames();
+    /// Database name at position idx (0 based)
+    const char *get_databaseName(int idx, int *len);
+ private:
+    class Rep;
+    Rep *m_p;
+};
+};
+
+#endif
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
+
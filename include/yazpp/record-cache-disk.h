@@ -0,0 +1,93 @@
+/* This file is part of the yazpp toolkit.
+ * Copyright (C) Index Data 
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Index Data nor the names of its contributors
+ *       may be used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS AND CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef YAZPP_RECORD_CACHE_DISK_INCLUDED
+#define YAZPP_RECORD_CACHE_DISK_INCLUDED
+
+#include <stddef.h>
+#include <yaz/yconfig.h>
+#include <yaz/proto.h>
+
+namespace yazpp_1 {
+/** Persistent record store; second tier for SharedRecordCache.
+    Records are appended to segment files in a directory and read
+    through memory maps. A background thread compacts segments that
+    are mostly dead without blocking put and get. The index is rebuilt
+    from the segments by open, so the store survives restarts. Records
+    may be tagged (e.g. by database name) and invalidated by tag.
+    Requires mmap(2); open fails without it.
+*/
+class YAZ_EXPORT RecordCacheDisk {
+ public:
+    RecordCacheDisk();
+    ~RecordCacheDisk();
+    /// Open store in directory dir, using at most max_size bytes of
+    /// disk. Segments are a quarter of max_size, at most 16 MB, so no
+    /// record may be larger than that. Returns 0 on success; -1 on failure
+    int open(const char *dir, size_t max_size);
+    /// Close store. Records that get pointed into the maps are invalid
+    void close();
+    /// Seconds between compaction runs. Default is 60
+    void set_compact_interval(int seconds);
+    /// Store record for key and position. Returns 0 on success
+    int put(const char *key, int key_len, int position,
+            int num_tags, const char **tags, Z_NamePlusRecord *rec);
+    /// Fetch record for key and position, allocated with o; 0 if not
+    /// stored. If pinned is a token from pin, octet and SUTRS records
+    /// point into the segment maps instead of being copied
+    Z_NamePlusRecord *get(ODR o, const char *key, int key_len, int position,
+                          int pinned = 0);
+    /// Keep the segment maps that get refers to until unpin, even if
+    /// compaction replaces them. Returns token for get and unpin; 0 if
+    /// the store is not open
+    int pin();
+    void unpin(int token);
+    /// Drop all records with tag (compared case insensitively)
+    void invalidate_tag(const char *tag);
+    /// Drop all records
+    void clear();
+    /// Run one compaction now (normally done by background thread)
+    void compact();
+    size_t get_disk_bytes();
+    int get_num_records();
+ private:
+    class Rep;
+    Rep *m_p;
+    RecordCacheDisk(const RecordCacheDisk &);
+    RecordCacheDisk &operator=(const RecordCacheDisk &);
+};
+};
+#endif
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
+
@@ -31,21 +31,70 @@
 
 namespace yazpp_1 {
 
+/** Cache of records for one session's result set. When built with
+    zlib (configure --with-zlib), octet and SUTRS records that are not
+    small are kept deflated, and inflated into the ODR of lookup.
+*/
 class YAZ_EXPORT RecordCache {
  public:
+    /// Result set positions start .. start + number - 1
+    struct Range {
+        int start;
+        int number;
+    };
     RecordCache ();
     ~RecordCache ();
     void add(ODR o, Z_NamePlusRecordList *npr, int start, int hits);
+    /// Add records npr for offsets start, start+1, .. . Surrogate
+    /// diagnostics are cached for the requested syntax, if given
     void add(ODR o, Z_NamePlusRecordList *npr, int start,
-             Z_RecordComposition *comp);
+             Z_RecordComposition *comp, Odr_oid *syntax = 0);
 
     int lookup(ODR o, Z_NamePlusRecordList **npr, int start, int num,
                Odr_oid *syntax, Z_RecordComposition *comp);
+    /// Like lookup, but returns the records that are cached even if some
+    /// are not. Records not cached are null in npr and are listed in
+    /// missing (allocated with o). Returns number of records found
+    int lookup_partial(ODR o, Z_NamePlusRecordList **npr, int start, int num,
+                       Odr_oid *syntax, Z_RecordComposition *comp,
+                       int *num_missing, Range **missing);
     void clear();
 
     void copy_searchRequest(Z_SearchRequest *sr);
     void copy_presentRequest(Z_PresentRequest *pr);
+    /// Number of windows to read ahead when presentRequests (as passed
+    /// to copy_presentRequest) continue each other. 0 (default) = off
+    void set_prefetch_depth(int windows);
+    /// Next window to read ahead: returns 1 with a presentRequest
+    /// (allocated with o) for the caller to send to the backend while
+    /// the client reads the current window, adding the records with
+    /// the request's composition once they arrive. Returns 0 if
+    /// nothing is to be prefetched, or if the cache is full
+    int get_prefetch(ODR o, Z_PresentRequest **pr);
+    /// Bytes that cached records may use; least recently used records
+    /// are evicted beyond that. Default is 200000
     void set_max_size(size_t sz);
+    /// Seconds a record stays in the cache. Default is 0 (no limit)
+    void set_ttl(int seconds);
+    /// Seconds a surrogate diagnostic stays in the cache; 0 disables
+    /// caching of diagnostics. Default is 30
+    void set_diagnostic_ttl(int seconds);
+    /// Remove expired entries; returns the number removed. Expired
+    /// entries are never returned by lookup and add sweeps now and then,
+    /// so this is only needed to release memory of an idle cache (e.g.
+    /// from a timeout handler)
+    int sweep();
+
+    size_t get_resident_bytes();
+    int get_num_entries();
+    /// Records returned by lookup since creation
+    long get_hits();
+    /// Records looked up but not found since creation
+    long get_misses();
+    /// Records evicted to stay within max size since creation
+    long get_evictions();
+    /// Entries removed because their time to live had passed
+    long get_expirations();
  private:
     struct RecordCache_Entry;
     struct Rep;
@@ -0,0 +1,74 @@
+/* This file is part of the yazpp toolkit.
+ * Copyright (C) Index Data 
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Index Data nor the names of its contributors
+ *       may be used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS AND CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef YAZPP_RPN_NORMALIZE_INCLUDED
+#define YAZPP_RPN_NORMALIZE_INCLUDED
+
+#include <yaz/yconfig.h>
+#include <yaz/proto.h>
+
+namespace yazpp_1 {
+/** Rewrites RPN queries to a canonical form so that queries which
+    differ only in shape give the same encoding (see Yaz_Z_Query).
+    Operands of AND and OR are flattened and sorted, attributes that
+    equal the server defaults of the attribute set are removed, the
+    remaining attributes are sorted and white space in terms is
+    collapsed.
+*/
+class YAZ_EXPORT RPN_Normalizer {
+ public:
+    RPN_Normalizer();
+    ~RPN_Normalizer();
+    /// Attribute set that the default attributes belong to (Bib-1)
+    void set_attribute_set(const Odr_oid *oid);
+    /// Remove type=value where the server would assume it anyway
+    void add_default_attribute(int type, int value);
+    /// Bib-1 with the defaults of its semantics: relation equal (2=3),
+    /// position any (3=3), no truncation (5=100) and incomplete
+    /// subfield (6=1). Structure is left alone; its default varies
+    void use_bib1_defaults();
+    /// Whether to strip and collapse white space in terms (true)
+    void set_normalize_terms(bool enable);
+    /// Normalize q in place; new nodes are allocated with o
+    void normalize(ODR o, Z_RPNQuery *q);
+ private:
+    class Rep;
+    Rep *m_p;
+    RPN_Normalizer(const RPN_Normalizer &);
+    RPN_Normalizer &operator=(const RPN_Normalizer &);
+};
+};
+#endif
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
+
@@ -0,0 +1,92 @@
+/* This file is part of the yazpp toolkit.
+ * Copyright (C) Index Data 
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Index Data nor the names of its contributors
+ *       may be used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS AND CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef YAZPP_SEARCH_CACHE_INCLUDED
+#define YAZPP_SEARCH_CACHE_INCLUDED
+
+#include <stddef.h>
+#include <yaz/yconfig.h>
+#include <yaz/proto.h>
+
+namespace yazpp_1 {
+class RPN_Normalizer;
+/** Cache of search results for servers and proxies. Maps query,
+    database list and result set name to the hit count and a handle
+    for the result set in the backend (e.g. its name there). Database
+    names are compared case insensitively and queries by their
+    canonical form (see Yaz_Z_Query::match). Entries expire after a
+    time to live; least recently used entries are evicted to stay
+    within the memory budget. May be shared by threads.
+*/
+class YAZ_EXPORT SearchCache {
+ public:
+    SearchCache();
+    ~SearchCache();
+    /// Seconds an entry is valid; 0 disables the cache. Default is 60
+    void set_ttl(int seconds);
+    /// Bytes that entries may use. Default is 1000000
+    void set_max_size(size_t sz);
+    /// Normalize queries before comparing them, so that queries that
+    /// differ only in shape share entries. Set before the cache is
+    /// used; normalizer must outlive the cache. Default is 0 (none)
+    void set_normalizer(RPN_Normalizer *normalizer);
+    /// Remember result of search; handle may be 0
+    void add(Z_Query *query, int num_db, const char **db,
+             const char *setname, Odr_int hits, const char *handle);
+    /// Returns 1 with hits and handle (allocated with o) if the search
+    /// is cached; 0 otherwise
+    int lookup(ODR o, Z_Query *query, int num_db, const char **db,
+               const char *setname, Odr_int *hits, char **handle);
+    /// Remove entries for searches that included database db
+    void invalidate_database(const char *db);
+    /// Remove entries that refer to backend result set handle
+    void invalidate_handle(const char *handle);
+    void clear();
+
+    size_t get_resident_bytes();
+    int get_num_entries();
+    long get_hits();
+    long get_misses();
+    long get_evictions();
+    long get_expirations();
+ private:
+    class Rep;
+    Rep *m_p;
+    SearchCache(const SearchCache &);
+    SearchCache &operator=(const SearchCache &);
+};
+};
+#endif
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
+
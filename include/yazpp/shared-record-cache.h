@@ -0,0 +1,100 @@
+/* This file is part of the yazpp toolkit.
+ * Copyright (C) Index Data 
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Index Data nor the names of its contributors
+ *       may be used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS AND CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef YAZPP_SHARED_RECORD_CACHE_INCLUDED
+#define YAZPP_SHARED_RECORD_CACHE_INCLUDED
+
+#include <stddef.h>
+#include <yaz/yconfig.h>
+#include <yaz/proto.h>
+
+namespace yazpp_1 {
+class RecordCacheDisk;
+class RPN_Normalizer;
+/** Record cache shared by all sessions and threads of a process.
+    Records are keyed by query, database list, record syntax, record
+    composition and result set position. Queries are compared by their
+    canonical form (see Yaz_Z_Query::match) and database names case
+    insensitively. Entries are spread over a
+    number of shards, each with its own lock and least recently used
+    eviction within its share of the memory budget. Evicted records
+    may be kept in a persistent disk tier (see set_disk_tier).
+*/
+class YAZ_EXPORT SharedRecordCache {
+ public:
+    SharedRecordCache(int num_shards = 16);
+    ~SharedRecordCache();
+    /// Bytes that all shards together may use. Default is 10 MB
+    void set_max_size(size_t sz);
+    /// Normalize queries before comparing them, so that queries that
+    /// differ only in shape share entries. Set before the cache is
+    /// used; normalizer must outlive the cache. Default is 0 (none)
+    void set_normalizer(RPN_Normalizer *normalizer);
+    /// Add records npr for positions start, start+1, ..
+    void add(Z_Query *query, int num_db, const char **db,
+             Z_NamePlusRecordList *npr, int start,
+             Z_RecordComposition *comp);
+    /// Look up positions start .. start+num-1; returns 1 if all are
+    /// cached with records copied to o; 0 otherwise
+    int lookup(ODR o, Z_NamePlusRecordList **npr,
+               Z_Query *query, int num_db, const char **db,
+               int start, int num,
+               Odr_oid *syntax, Z_RecordComposition *comp);
+    /// Remove all records from searches that included database db
+    void invalidate_database(const char *db);
+    void clear();
+    /// Keep records evicted from memory in store at dir, using at most
+    /// max_size bytes of disk. Records from the store are served by
+    /// lookup when not in memory (see RecordCacheDisk).
+    /// dir=0 disables the tier. Returns 0 on success; -1 on failure
+    int set_disk_tier(const char *dir, size_t max_size);
+    /// Disk tier or 0 if none; valid until set_disk_tier replaces it
+    RecordCacheDisk *get_disk_tier();
+
+    size_t get_resident_bytes();
+    long get_hits();
+    long get_misses();
+    /// Lookups served by disk tier
+    long get_disk_hits();
+    long get_evictions();
+ private:
+    class Rep;
+    Rep *m_p;
+    SharedRecordCache(const SharedRecordCache &);
+    SharedRecordCache &operator=(const SharedRecordCache &);
+};
+};
+#endif
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
+
@@ -55,6 +55,8 @@ class YAZ_EXPORT SocketManager : public ISocketObservable {
     virtual void maskObserver(ISocketObserver *observer, int mask);
     /// Set timeout
     virtual void timeoutObserver(ISocketObserver *observer, int timeout);
+    /// Set timeout in milliseconds from now; -1 for none
+    void timeoutObserverMs(ISocketObserver *observer, int timeout);
     /// Process one event. return > 0 if event could be processed;
     int processEvent();
     int getNumberOfObservers();
@@ -32,6 +32,7 @@
 #include <yaz/proto.h>
 #include <yaz/odr.h>
 #include <yazpp/pdu-observer.h>
+#include <yazpp/gdu.h>
 
 namespace yazpp_1 {
     class Z_Assoc_priv;
@@ -64,11 +65,16 @@ class YAZ_EXPORT Z_Assoc : public IPDU_Observer {
     void close();
     /// Decode Z39.50 PDU.
     Z_GDU *decode_GDU(const char *buf, int len);
+    /// Decode Z39.50 PDU into memory of its own. The result stays
+    /// valid after the next PDU arrives; caller must delete it.
+    GDU *decode_GDU_owned(const char *buf, int len);
     /// Encode Z39.50 PDU.
     int encode_GDU(Z_GDU *apdu, char **buf, int *len);
     /// Send Z39.50 PDU
     int send_Z_PDU(Z_APDU *apdu, int *len);
     int send_GDU(Z_GDU *apdu, int *len);
+    /// Send encoded package as is, e.g. forwarded after PDU_Peek
+    int send_PDU(const char *buf, int len);
     /// Receive Z39.50 PDU
     virtual void recv_GDU(Z_GDU *apdu, int len) = 0;
     /// Create Z39.50 PDU with reasonable defaults
@@ -81,6 +87,10 @@ class YAZ_EXPORT Z_Assoc : public IPDU_Observer {
     void set_APDU_log(const char *fname);
     const char *get_APDU_log();
 
+    /// Binary capture of raw packages for replay (see APDUCapture)
+    void set_APDU_capture(const char *fname);
+    const char *get_APDU_capture();
+
     /// OtherInformation
     void get_otherInfoAPDU(Z_APDU *apdu, Z_OtherInformation ***oip);
     Z_OtherInformationUnit *update_otherInformation (
@@ -98,8 +108,11 @@ class YAZ_EXPORT Z_Assoc : public IPDU_Observer {
     void transfer_referenceId(Z_APDU *from, Z_APDU *to);
 
     const char *get_hostname();
+    /// Event loop of the association; 0 if not known
+    ISocketObservable *get_socket_observable();
 
     int set_APDU_yazlog(int v);
+    int get_APDU_yazlog();
   private:
     Z_Assoc_priv *m_p;
 };
@@ -32,6 +32,7 @@
 #include <yazpp/query.h>
 
 namespace yazpp_1 {
+class RPN_Normalizer;
 /** Z39.50 Query
     RPN, etc.
 */
@@ -47,12 +48,18 @@ class YAZ_EXPORT Yaz_Z_Query : public Yaz_Query {
     int set_rpn (const char *rpn);
     /// Set Z Query
     void set_Z_Query (Z_Query *z_query);
-    /// Get Z Query
+    /// Get Z Query. Decoded once; valid until the query is changed
     Z_Query *get_Z_Query ();
     /// print query
     void print(char *str, size_t len);
-    /// match query
+    /// match query; queries that differ only in encoding match
     int match(const Yaz_Z_Query *other);
+    /// 64-bit hash of canonical form; 0 if there is no query
+    unsigned long long get_hash();
+    /// canonical encoding; equal for queries that match
+    const char *get_canonical(int *len);
+    /// rewrite RPN query to normal form (see RPN_Normalizer)
+    int normalize(RPN_Normalizer *normalizer);
     /// Copy
     Yaz_Z_Query &operator=(const Yaz_Z_Query &);
     /// Assign RPN string to it
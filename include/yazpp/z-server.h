@@ -25,11 +25,69 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <yaz/mutex.h>
 #include <yazpp/z-assoc.h>
 
 namespace yazpp_1 {
 
 class Z_Server;
+class Z_ServerWorkers;
+class Yaz_Facility_Retrieval;
+
+/** Response completed after the handler has returned; see
+    Yaz_Facility_Retrieval::set_async. Holds a copy of the request and
+    the response, which has the referenceId of the request. Responses
+    of a session are sent in the order the requests arrived.
+*/
+class YAZ_EXPORT Z_ServerDeferred {
+ public:
+    /// Request; valid until complete is called
+    Z_APDU *get_request();
+    /// Response to fill in
+    Z_APDU *get_response();
+    /// Memory for what goes in the response
+    ODR odr_encode();
+    /// Response is ready. Must be called once; may be called by any
+    /// thread. The object must not be used afterwards
+    void complete();
+ private:
+    friend class Z_Server;
+    friend class Z_ServerWorkers;
+    friend class Yaz_Facility_Retrieval;
+    class Rep;
+    Rep *m_p;
+    Z_ServerDeferred(Z_Server *s, Z_APDU *request, int response_type,
+                     Yaz_Facility_Retrieval *facility);
+    ~Z_ServerDeferred();
+    bool is_complete();
+    void release();
+    void encode();
+    Z_ServerDeferred(const Z_ServerDeferred &);
+    Z_ServerDeferred &operator=(const Z_ServerDeferred &);
+};
+
+/** Fixed number of threads that run the search and present handlers
+    of Yaz_Facility_Retrieval for sessions given it with
+    Z_Server::set_workers, so that a slow backend does not hold up the
+    event loop. One object may be shared by any number of sessions; it
+    must outlive them. A session has at most one request in a worker
+    at a time, so its responses keep their order.
+*/
+class YAZ_EXPORT Z_ServerWorkers {
+ public:
+    Z_ServerWorkers(int num_threads);
+    /// Waits for queued requests to be handled
+    ~Z_ServerWorkers();
+ private:
+    friend class Z_Server;
+    friend class Yaz_Facility_Retrieval;
+    class Rep;
+    Rep *m_p;
+    void submit(Z_ServerDeferred *deferred);
+    void withdraw(Z_ServerDeferred *deferred);
+    Z_ServerWorkers(const Z_ServerWorkers &);
+    Z_ServerWorkers &operator=(const Z_ServerWorkers &);
+};
 
 class YAZ_EXPORT Z_ServerUtility {
  public:
@@ -56,6 +114,9 @@ class YAZ_EXPORT IServer_Facility {
                      Z_InitRequest *initRequest,
                      Z_InitResponse *initResponse) = 0;
     virtual int recv(Z_Server *server, Z_APDU *apdu) = 0;
+    /// APDU types that recv may take, terminated by -1. Read by
+    /// Z_Server::facility_add. Default is 0 which means any type
+    virtual const int *apdu_types();
 
     virtual ~IServer_Facility() = 0;
 };
@@ -70,6 +131,7 @@ class YAZ_EXPORT Yaz_Facility_ILL : public IServer_Facility {
              Z_InitRequest *initRequest,
              Z_InitResponse *initResponse);
     int recv(Z_Server *server, Z_APDU *apdu);
+    const int *apdu_types();
 };
 
 class YAZ_EXPORT Yaz_Facility_Update : public IServer_Facility {
@@ -86,12 +148,23 @@ class YAZ_EXPORT Yaz_Facility_Update : public IServer_Facility {
              Z_InitRequest *initRequest,
              Z_InitResponse *initResponse);
     int recv(Z_Server *server, Z_APDU *apdu);
+    const int *apdu_types();
 };
 
 
 class YAZ_EXPORT Yaz_Facility_Retrieval : public IServer_Facility,
     public Z_ServerUtility {
+    friend class Z_Server;
  public:
+    Yaz_Facility_Retrieval();
+    /// Must not be deleted while a handler of it runs in a worker;
+    /// see destroy
+    virtual ~Yaz_Facility_Retrieval();
+    /// Delete a facility made with new. If a handler of it is running
+    /// in a worker, the worker deletes it when the handler returns, so
+    /// a session with workers can let go of its facilities without
+    /// waiting
+    void destroy();
 
     virtual int sr_init (Z_InitRequest *initRequest,
                          Z_InitResponse *initResponse) = 0;
@@ -105,14 +178,48 @@ class YAZ_EXPORT Yaz_Facility_Retrieval : public IServer_Facility,
                             Z_RecordComposition *comp,
                             Z_NamePlusRecord *namePlusRecord,
                             Z_Records *diagnostics) = 0;
+    /// Fetch count records from position start in one go. Entries of
+    /// namePlusRecords are set up as for sr_record. Returns the number
+    /// of records set, which is less than count only at the end of the
+    /// result set. A present is fetched in parts: a single record
+    /// first, then as many as are likely to fit in the preferred
+    /// message size. Sizes are judged by what is allocated on
+    /// odr_encode(), split evenly over the records of a batch.
+    /// Default returns -1 so that sr_record is used
+    virtual int sr_records (const char *resultSetName,
+                            int start, int count,
+                            Odr_oid *format,
+                            Z_RecordComposition *comp,
+                            Z_NamePlusRecord **namePlusRecords,
+                            Z_Records *diagnostics);
     int init(Z_Server *server,
              Z_InitRequest *initRequest,
              Z_InitResponse *initResponse);
     int recv(Z_Server *server, Z_APDU *apdu);
+    const int *apdu_types();
+
+    /// Hand search and present to sr_search_async and sr_present_async
+    /// so that they may complete later (default false). Takes
+    /// precedence over Z_Server::set_workers
+    void set_async(bool async);
+    /// Search that completes when deferred->complete is called. If
+    /// no records are set then, sr_record is used to fetch them.
+    /// Default calls sr_search and completes at once
+    virtual void sr_search_async(Z_SearchRequest *searchRequest,
+                                 Z_ServerDeferred *deferred);
+    /// Present that completes when deferred->complete is called.
+    /// Default calls sr_present and completes at once
+    virtual void sr_present_async(Z_PresentRequest *presentRequest,
+                                  Z_ServerDeferred *deferred);
 
     ODR odr_encode();
     ODR odr_decode();
  private:
+    friend class Z_ServerWorkers;
+    void running_add(int delta);
+    void run_deferred(Z_Server *s, Z_ServerDeferred *deferred);
+    void finish_deferred(Z_Server *s, Z_ServerDeferred *deferred);
+
     Z_Records *pack_records (Z_Server *s,
                              const char *resultSetName,
                              int start, int num,
@@ -130,12 +237,17 @@ class YAZ_EXPORT Yaz_Facility_Retrieval : public IServer_Facility,
     int m_maximumRecordSize;
     ODR m_odr_encode;
     ODR m_odr_decode;
+    bool m_async;
+    int m_running;      // handlers running in workers
+    bool m_destroy;     // delete when m_running drops to 0
+    YAZ_MUTEX m_mutex;
 };
 
 class YAZ_EXPORT Z_Server_Facility_Info {
     friend class Z_Server;
     IServer_Facility *m_facility;
     char *m_name;
+    int *m_apdu_types;  // -1 terminated; 0 for any
     Z_Server_Facility_Info *m_next;
 };
 
@@ -145,14 +257,37 @@ class YAZ_EXPORT Z_Server : public Z_Assoc {
 public:
     Z_Server(IPDU_Observable *the_PDU_Observable);
     virtual ~Z_Server();
+    /// Offer APDU to the facilities that handle its type, in the order
+    /// they were added. If none takes it, the association is closed.
+    /// While a deferred response is outstanding, requests are held
+    /// back and handled once it has been sent
     void recv_Z_PDU(Z_APDU *apdu, int len);
     virtual void recv_GDU(Z_GDU *apdu, int len);
     void facility_add(IServer_Facility *facility, const char *name);
+    /// Remove all facilities and drop an outstanding response. A
+    /// handler running in a worker is not waited for; its response is
+    /// dropped when it completes. A subclass that owns its facilities
+    /// should call this in its destructor
     void facility_reset ();
-
+    /// Run search, present and record handlers of retrieval facilities
+    /// in workers rather than in the session's thread. These handlers
+    /// must then not use the session. Without an event loop to wake
+    /// (see IPDU_Observable::get_socket_observable) they are run in
+    /// the session's thread. Default is 0 (none)
+    void set_workers(Z_ServerWorkers *workers);
+    Z_ServerWorkers *get_workers();
 
  private:
+    friend class Yaz_Facility_Retrieval;
+    class Rep;
+    Rep *m_p;
     Z_Server_Facility_Info *m_facilities;
+    int dispatch(Z_APDU *apdu);
+    int wakeup_fd();
+    void defer(Z_ServerDeferred *deferred);
+    void flush_deferred();
+    Z_Server(const Z_Server &);
+    Z_Server &operator=(const Z_Server &);
 };
 
 class YAZ_EXPORT Yaz_USMARC {
@@ -0,0 +1,259 @@
+/* This file is part of the yazpp toolkit.
+ * Copyright (C) Index Data 
+ * See the file LICENSE for details.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#if HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <yaz/log.h>
+#include <yaz/mutex.h>
+#include <yaz/xmalloc.h>
+#include <yaz/gettimeofday.h>
+#include <yazpp/apdu-capture.h>
+
+#define CAPTURE_MAGIC "YAZPPCAP"
+#define CAPTURE_MAGIC_LEN 8
+#define CAPTURE_HEAD_LEN 20
+
+using namespace yazpp_1;
+
+/* A file open for writing is shared by all APDUCapture objects that
+   name it, so that records from sessions in different threads go
+   through one stream and are written whole under its mutex */
+struct APDUCapture_File {
+    char *fname;
+    FILE *file;
+    YAZ_MUTEX mutex;
+    int refcount;
+    APDUCapture_File *next;
+};
+
+class APDUCapture::Rep {
+    friend class APDUCapture;
+    FILE *file;                 // reading
+    APDUCapture_File *out;      // writing
+    char *fname;
+    char *buf;
+    int buf_size;
+    void grow(int sz);
+    static YAZ_MUTEX files_mutex;
+    static APDUCapture_File *files;
+    static int init_flag;
+    static int init_func();
+};
+
+YAZ_MUTEX APDUCapture::Rep::files_mutex = 0;
+APDUCapture_File *APDUCapture::Rep::files = 0;
+
+int APDUCapture::Rep::init_func()
+{
+    yaz_mutex_create(&files_mutex);
+    return 1;
+}
+
+int APDUCapture::Rep::init_flag = APDUCapture::Rep::init_func();
+
+static void put_u32(unsigned char *cp, unsigned long v)
+{
+    cp[0] = (unsigned char) (v >> 24);
+    cp[1] = (unsigned char) (v >> 16);
+    cp[2] = (unsigned char) (v >> 8);
+    cp[3] = (unsigned char) v;
+}
+
+static unsigned long get_u32(const unsigned char *cp)
+{
+    return ((unsigned long) cp[0] << 24) | ((unsigned long) cp[1] << 16) |
+        ((unsigned long) cp[2] << 8) | (unsigned long) cp[3];
+}
+
+void APDUCapture::Rep::grow(int sz)
+{
+    if (sz > buf_size)
+    {
+        buf_size = sz + 1024;
+        buf = (char *) xrealloc(buf, buf_size);
+    }
+}
+
+APDUCapture::APDUCapture()
+{
+    m_p = new Rep;
+    m_p->file = 0;
+    m_p->out = 0;
+    m_p->fname = 0;
+    m_p->buf = 0;
+    m_p->buf_size = 0;
+}
+
+APDUCapture::~APDUCapture()
+{
+    close();
+    xfree(m_p->buf);
+    delete m_p;
+}
+
+void APDUCapture::close()
+{
+    if (m_p->file)
+        fclose(m_p->file);
+    m_p->file = 0;
+    if (m_p->out)
+    {
+        yaz_mutex_enter(Rep::files_mutex);
+        if (--m_p->out->refcount == 0)
+        {
+            APDUCapture_File **fp = &Rep::files;
+            while (*fp != m_p->out)
+                fp = &(*fp)->next;
+            *fp = m_p->out->next;
+            fclose(m_p->out->file);
+            yaz_mutex_destroy(&m_p->out->mutex);
+            xfree(m_p->out->fname);
+            delete m_p->out;
+        }
+        yaz_mutex_leave(Rep::files_mutex);
+        m_p->out = 0;
+    }
+    xfree(m_p->fname);
+    m_p->fname = 0;
+}
+
+const char *APDUCapture::get_fname()
+{
+    return m_p->fname;
+}
+
+int APDUCapture::open_write(const char *fname)
+{
+    close();
+    yaz_mutex_enter(Rep::files_mutex);
+    APDUCapture_File *f = Rep::files;
+    while (f && strcmp(f->fname, fname))
+        f = f->next;
+    if (!f)
+    {
+        FILE *file = fopen(fname, "ab");
+        if (!file)
+        {
+            yaz_mutex_leave(Rep::files_mutex);
+            yaz_log(YLOG_WARN|YLOG_ERRNO, "APDU capture %s", fname);
+            return -1;
+        }
+        fseek(file, 0L, SEEK_END);
+        if (ftell(file) == 0)
+        {
+            fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LEN, file);
+            fflush(file);
+        }
+        f = new APDUCapture_File;
+        f->fname = xstrdup(fname);
+        f->file = file;
+        f->mutex = 0;
+        yaz_mutex_create(&f->mutex);
+        f->refcount = 0;
+        f->next = Rep::files;
+        Rep::files = f;
+    }
+    f->refcount++;
+    yaz_mutex_leave(Rep::files_mutex);
+    m_p->out = f;
+    m_p->fname = xstrdup(fname);
+    return 0;
+}
+
+int APDUCapture::open_read(const char *fname)
+{
+    char magic[CAPTURE_MAGIC_LEN];
+
+    close();
+    m_p->file = fopen(fname, "rb");
+    if (!m_p->file)
+    {
+        yaz_log(YLOG_WARN|YLOG_ERRNO, "APDU capture %s", fname);
+        return -1;
+    }
+    m_p->fname = xstrdup(fname);
+    if (fread(magic, 1, CAPTURE_MAGIC_LEN, m_p->file) != CAPTURE_MAGIC_LEN
+        || memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN))
+    {
+        yaz_log(YLOG_WARN, "APDU capture %s: bad magic", fname);
+        close();
+        return -1;
+    }
+    return 0;
+}
+
+int APDUCapture::write(unsigned session, int direction,
+                       const char *buf, int len)
+{
+    struct timeval tv;
+
+    if (!m_p->out || len < 0)
+        return -1;
+    m_p->grow(CAPTURE_HEAD_LEN + len);
+    yaz_gettimeofday(&tv);
+
+    unsigned char *hp = (unsigned char *) m_p->buf;
+    put_u32(hp, session);
+    put_u32(hp + 4, tv.tv_sec);
+    put_u32(hp + 8, tv.tv_usec);
+    hp[12] = (unsigned char) direction;
+    hp[13] = hp[14] = hp[15] = 0;
+    put_u32(hp + 16, len);
+    memcpy(m_p->buf + CAPTURE_HEAD_LEN, buf, len);
+
+    size_t total = CAPTURE_HEAD_LEN + len;
+    APDUCapture_File *f = m_p->out;
+    yaz_mutex_enter(f->mutex);
+    size_t r = fwrite(m_p->buf, 1, total, f->file);
+    fflush(f->file);
+    yaz_mutex_leave(f->mutex);
+    if (r != total)
+    {
+        yaz_log(YLOG_WARN|YLOG_ERRNO, "APDU capture %s", m_p->fname);
+        return -1;
+    }
+    return 0;
+}
+
+int APDUCapture::read(unsigned *session, int *direction, struct timeval *tv,
+                      const char **buf, int *len)
+{
+    unsigned char hp[CAPTURE_HEAD_LEN];
+
+    if (!m_p->file)
+        return -1;
+    size_t r = fread(hp, 1, CAPTURE_HEAD_LEN, m_p->file);
+    if (r == 0)
+        return 0;
+    if (r != CAPTURE_HEAD_LEN)
+        return -1;
+    unsigned long l = get_u32(hp + 16);
+    if (l > 0x7fffffffUL - CAPTURE_HEAD_LEN)
+        return -1;
+    m_p->grow((int) l);
+    if (fread(m_p->buf, 1, l, m_p->file) != l)
+        return -1;
+    *session = (unsigned) get_u32(hp);
+    tv->tv_sec = get_u32(hp + 4);
+    tv->tv_usec = get_u32(hp + 8);
+    *direction = hp[12];
+    *buf = m_p->buf;
+    *len = (int) l;
+    return 1;
+}
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
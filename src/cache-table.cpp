@@ -0,0 +1,201 @@
+/* This file is part of the yazpp toolkit.
+ * Copyright (C) Index Data 
+ * See the file LICENSE for details.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <ctype.h>
+#include <string.h>
+#include <yaz/xmalloc.h>
+#include <yaz/matchstr.h>
+#include <yazpp/z-query.h>
+#include "cache-table.h"
+
+using namespace yazpp_1;
+
+void yazpp_1::cache_put_int(WRBUF w, int v)
+{
+    char b[4];
+    b[0] = (v >> 24) & 255;
+    b[1] = (v >> 16) & 255;
+    b[2] = (v >> 8) & 255;
+    b[3] = v & 255;
+    wrbuf_write(w, b, 4);
+}
+
+int yazpp_1::cache_get_int(const char *cp)
+{
+    const unsigned char *b = (const unsigned char *) cp;
+    return (b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+}
+
+int yazpp_1::cache_query_key(WRBUF w, Z_Query *query, int num_db,
+                             const char **db, RPN_Normalizer *normalizer)
+{
+    int i, len;
+    cache_put_int(w, num_db);
+    for (i = 0; i < num_db; i++)
+    {
+        const char *cp = db[i] ? db[i] : "Default";
+        for (; *cp; cp++)
+            wrbuf_putc(w, tolower(*(const unsigned char *) cp));
+        wrbuf_putc(w, '\0');
+    }
+    if (!query)
+        return 0;
+    Yaz_Z_Query q;
+    q.set_Z_Query(query);
+    if (normalizer && q.normalize(normalizer))
+        return 0;
+    const char *buf = q.get_canonical(&len);
+    if (!buf)
+        return 0;
+    cache_put_int(w, len);
+    wrbuf_write(w, buf, len);
+    return 1;
+}
+
+int yazpp_1::cache_key_has_database(const char *key, const char *db)
+{
+    int i, num_db = cache_get_int(key);
+    const char *cp = key + 4;
+    for (i = 0; i < num_db; i++)
+    {
+        if (!yaz_matchstr(cp, db))
+            return 1;
+        cp += strlen(cp) + 1;
+    }
+    return 0;
+}
+
+unsigned yazpp_1::cache_hash_bytes(unsigned h, const void *buf, size_t len)
+{
+    const unsigned char *cp = (const unsigned char *) buf;
+    size_t i;
+    for (i = 0; i < len; i++)
+    {
+        h ^= cp[i];
+        h *= 16777619;
+    }
+    return h;
+}
+
+unsigned yazpp_1::cache_hash_int(unsigned h, unsigned v)
+{
+    return (h ^ v) * 16777619;
+}
+
+unsigned long long yazpp_1::cache_hash64(const void *buf, size_t len)
+{
+    const unsigned char *cp = (const unsigned char *) buf;
+    unsigned long long h = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < len; i++)
+    {
+        h ^= cp[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+void CacheTable::init()
+{
+    buckets = 0;
+    num_buckets = 0;
+    num_entries = 0;
+    lru_head = 0;
+    lru_tail = 0;
+}
+
+void CacheTable::destroy()
+{
+    xfree(buckets);
+    init();
+}
+
+CacheNode *CacheTable::chain(unsigned hash)
+{
+    return num_buckets ? buckets[hash & (num_buckets - 1)] : 0;
+}
+
+void CacheTable::insert(CacheNode *node)
+{
+    if (num_entries >= num_buckets)
+    {
+        int i, new_num = num_buckets ? 2 * num_buckets : 64;
+        CacheNode **new_buckets = (CacheNode **)
+            xmalloc(new_num * sizeof(*new_buckets));
+        for (i = 0; i < new_num; i++)
+            new_buckets[i] = 0;
+        for (i = 0; i < num_buckets; i++)
+        {
+            CacheNode *n = buckets[i];
+            while (n)
+            {
+                CacheNode *n_next = n->next;
+                int j = n->hash & (new_num - 1);
+                n->next = new_buckets[j];
+                new_buckets[j] = n;
+                n = n_next;
+            }
+        }
+        xfree(buckets);
+        buckets = new_buckets;
+        num_buckets = new_num;
+    }
+    int j = node->hash & (num_buckets - 1);
+    node->next = buckets[j];
+    buckets[j] = node;
+    num_entries++;
+
+    node->lru_prev = 0;
+    node->lru_next = lru_head;
+    if (lru_head)
+        lru_head->lru_prev = node;
+    else
+        lru_tail = node;
+    lru_head = node;
+}
+
+void CacheTable::remove(CacheNode *node)
+{
+    CacheNode **np = &buckets[node->hash & (num_buckets - 1)];
+    while (*np != node)
+        np = &(*np)->next;
+    *np = node->next;
+    num_entries--;
+
+    if (node->lru_prev)
+        node->lru_prev->lru_next = node->lru_next;
+    else
+        lru_head = node->lru_next;
+    if (node->lru_next)
+        node->lru_next->lru_prev = node->lru_prev;
+    else
+        lru_tail = node->lru_prev;
+}
+
+void CacheTable::touch(CacheNode *node)
+{
+    if (node == lru_head)
+        return;
+    node->lru_prev->lru_next = node->lru_next;
+    if (node->lru_next)
+        node->lru_next->lru_prev = node->lru_prev;
+    else
+        lru_tail = node->lru_prev;
+    node->lru_prev = 0;
+    node->lru_next = lru_head;
+    lru_head->lru_prev = node;
+    lru_head = node;
+}
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
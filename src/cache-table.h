@@ -0,0 +1,78 @@
+/* This file is part of the yazpp toolkit.
+ * Copyright (C) Index Data 
+ * See the file LICENSE for details.
+ */
+
+/* Internal to the library: keys, hashing and the hash table with LRU
+   list shared by the caches */
+
+#ifndef YAZPP_CACHE_TABLE_INCLUDED
+#define YAZPP_CACHE_TABLE_INCLUDED
+
+#include <stddef.h>
+#include <yaz/wrbuf.h>
+#include <yaz/proto.h>
+
+// start value for cache_hash_bytes
+#define CACHE_HASH_INIT 2166136261U
+
+namespace yazpp_1 {
+class RPN_Normalizer;
+
+/// Append v as 4 bytes, most significant first
+void cache_put_int(WRBUF w, int v);
+/// Read integer written by cache_put_int
+int cache_get_int(const char *cp);
+/// Append the query part of a key: number of databases, database names
+/// in lower case (each 0-terminated), length and canonical encoding of
+/// query (see Yaz_Z_Query::get_canonical), normalized first if
+/// normalizer is given. Returns 0 if there is no valid query
+int cache_query_key(WRBUF w, Z_Query *query, int num_db, const char **db,
+                    RPN_Normalizer *normalizer);
+/// Whether key starting with a query part includes database db
+int cache_key_has_database(const char *key, const char *db);
+/// FNV-1a of buf continuing from h
+unsigned cache_hash_bytes(unsigned h, const void *buf, size_t len);
+/// FNV-1a step for an integer
+unsigned cache_hash_int(unsigned h, unsigned v);
+/// FNV-1a, 64 bit
+unsigned long long cache_hash64(const void *buf, size_t len);
+
+/// Base of cache entries. Entries are owned by the cache; the table
+/// only links them
+struct CacheNode {
+    unsigned hash;
+    CacheNode *next;          // in bucket
+    CacheNode *lru_prev;
+    CacheNode *lru_next;
+};
+
+/// Hash table on CacheNode::hash that also keeps entries in least
+/// recently used order. Not thread safe
+struct CacheTable {
+    CacheNode **buckets;
+    int num_buckets;          // power of 2
+    int num_entries;
+    CacheNode *lru_head;      // most recently used
+    CacheNode *lru_tail;
+    void init();
+    /// Free buckets; entries must have been removed or freed already
+    void destroy();
+    /// First node in chain of hash; follow next and compare hash
+    CacheNode *chain(unsigned hash);
+    /// Add as most recently used
+    void insert(CacheNode *node);
+    void remove(CacheNode *node);
+    /// Make most recently used
+    void touch(CacheNode *node);
+};
+};
+#endif
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
@@ -6,10 +6,59 @@
 #if HAVE_CONFIG_H
 #include <config.h>
 #endif
+#ifdef WIN32
+#include <windows.h>
+#endif
 #include <yazpp/gdu.h>
 
 using namespace yazpp_1;
 
+// shared by all copies of a GDU; the PDU is never modified once created
+struct GDU::Rep {
+    Rep(ODR decode, Z_GDU *gdu, int len);
+    ~Rep();
+    void ref();
+    void unref();
+#ifdef WIN32
+    LONG refcount;
+#else
+    int refcount;
+#endif
+    ODR decode;
+    Z_GDU *gdu;
+    int len;
+};
+
+GDU::Rep::Rep(ODR decode, Z_GDU *gdu, int len)
+    : refcount(1), decode(decode), gdu(gdu), len(len)
+{
+}
+
+GDU::Rep::~Rep()
+{
+    odr_destroy(decode);
+}
+
+// handles may be passed between threads, so reference counting is atomic
+void GDU::Rep::ref()
+{
+#ifdef WIN32
+    InterlockedIncrement(&refcount);
+#else
+    __sync_add_and_fetch(&refcount, 1);
+#endif
+}
+
+void GDU::Rep::unref()
+{
+#ifdef WIN32
+    if (InterlockedDecrement(&refcount) == 0)
+#else
+    if (__sync_sub_and_fetch(&refcount, 1) == 0)
+#endif
+        delete this;
+}
+
 GDU::GDU(Z_APDU *apdu)
 {
     ODR encode = odr_createmem(ODR_ENCODE);
@@ -24,72 +73,119 @@ GDU::GDU(Z_GDU *gdu)
     base(gdu, odr_createmem(ODR_ENCODE));
 }
 
+GDU::GDU(ODR decode, Z_GDU *gdu, int len)
+{
+    m_p = new Rep(decode, gdu, len);
+}
+
 GDU::GDU()
 {
-    base(0, odr_createmem(ODR_ENCODE));
+    m_p = 0;
 }
 
 GDU::GDU(const GDU &g)
 {
-    base(g.get(), odr_createmem(ODR_ENCODE));
+    m_p = g.m_p;
+    if (m_p)
+        m_p->ref();
 }
 
+#if __cplusplus >= 201103L
+GDU::GDU(GDU &&g)
+{
+    m_p = g.m_p;
+    g.m_p = 0;
+}
+
+GDU &GDU::operator=(GDU &&g)
+{
+    if (this != &g)
+    {
+        if (m_p)
+            m_p->unref();
+        m_p = g.m_p;
+        g.m_p = 0;
+    }
+    return *this;
+}
+#endif
+
+// the one remaining copy: from memory owned by the caller
 void GDU::base(Z_GDU *gdu, ODR encode)
 {
-    m_decode = odr_createmem(ODR_DECODE);
-    m_gdu = 0;
+    m_p = 0;
     if (gdu && z_GDU(encode, &gdu, 0, "encode"))
     {
         int len;
         char *buf = odr_getbuf(encode, &len, 0);
-
-        odr_setbuf(m_decode, buf, len, 0);
-        if (!z_GDU(m_decode, &m_gdu, 0, 0))
-            m_gdu = 0;
+        ODR decode = odr_createmem(ODR_DECODE);
+        Z_GDU *copy = 0;
+
+        odr_setbuf(decode, buf, len, 0);
+        if (z_GDU(decode, &copy, 0, 0))
+            m_p = new Rep(decode, copy, len);
+        else
+            odr_destroy(decode);
     }
     odr_destroy(encode);
 }
 
 int GDU::get_size()
 {
-    int len = 0;
-    ODR encode = odr_createmem(ODR_ENCODE);
-    if (m_gdu && z_GDU(encode, &m_gdu, 0, "encode"))
-        odr_getbuf(encode, &len, 0);
-    odr_destroy(encode);
-    return len;
+    return m_p ? m_p->len : 0;
 }
 
 GDU &GDU::operator=(const GDU &g)
 {
-    if (this != &g)
+    if (m_p != g.m_p)
     {
-        odr_destroy(m_decode);
-
-        base(g.get(), odr_createmem(ODR_ENCODE));
+        if (g.m_p)
+            g.m_p->ref();
+        if (m_p)
+            m_p->unref();
+        m_p = g.m_p;
     }
     return *this;
 }
 
 GDU::~GDU()
 {
-    odr_destroy(m_decode);
+    if (m_p)
+        m_p->unref();
 }
 
 Z_GDU *GDU::get() const
 {
-    return m_gdu;
+    return m_p ? m_p->gdu : 0;
 }
 
 void GDU::move_away_gdu(ODR dst, Z_GDU **gdu)
 {
-    *gdu = m_gdu;
-    m_gdu = 0;
-    NMEM nmem = odr_extract_mem(m_decode);
+    *gdu = 0;
+    if (!m_p)
+        return;
     if (!dst->mem)
         dst->mem = nmem_create();
-    nmem_transfer(dst->mem, nmem);
-    nmem_destroy(nmem);
+    if (m_p->refcount == 1)
+    {   // sole owner: hand over the memory
+        *gdu = m_p->gdu;
+        NMEM nmem = odr_extract_mem(m_p->decode);
+        nmem_transfer(dst->mem, nmem);
+        nmem_destroy(nmem);
+    }
+    else
+    {   // others still refer to it: give dst a copy of its own
+        GDU g(m_p->gdu);
+        if (g.m_p)
+        {
+            *gdu = g.m_p->gdu;
+            NMEM nmem = odr_extract_mem(g.m_p->decode);
+            nmem_transfer(dst->mem, nmem);
+            nmem_destroy(nmem);
+        }
+    }
+    m_p->unref();
+    m_p = 0;
 }
 
 /*
@@ -100,4 +196,3 @@ void GDU::move_away_gdu(ODR dst, Z_GDU **gdu)
  * End:
  * vim: shiftwidth=4 tabstop=8 expandtab
  */
-
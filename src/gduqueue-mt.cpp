@@ -0,0 +1,181 @@
+/* This file is part of the yazpp toolkit.
+ * Copyright (C) Index Data 
+ * See the file LICENSE for details.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+#ifdef WIN32
+#include <windows.h>
+#endif
+#include <yaz/mutex.h>
+#include <yaz/gettimeofday.h>
+#include <yazpp/gdu.h>
+#include <yazpp/gduqueue-mt.h>
+
+using namespace yazpp_1;
+
+/* Producers link new nodes at head with an atomic exchange; the consumer
+   follows next pointers from tail, which is always a consumed (dummy)
+   node. A node whose predecessor is not yet linked is simply not seen
+   until the producer completes, so no locking is needed on push */
+struct GDUQueueMT_Node {
+    GDUQueueMT_Node *volatile next;
+    GDU *gdu;
+};
+
+#ifdef WIN32
+#define atomic_xchg(p, v) \
+    (GDUQueueMT_Node *) InterlockedExchangePointer((PVOID volatile *) (p), (v))
+#define atomic_add(p, v) InterlockedExchangeAdd((p), (v))
+#define memory_barrier() MemoryBarrier()
+typedef LONG atomic_int;
+#else
+#define atomic_xchg(p, v) \
+    (__sync_synchronize(), __sync_lock_test_and_set((p), (v)))
+#define atomic_add(p, v) __sync_fetch_and_add((p), (v))
+#define memory_barrier() __sync_synchronize()
+typedef int atomic_int;
+#endif
+
+class GDUQueueMT::Rep {
+    friend class GDUQueueMT;
+    GDUQueueMT_Node *volatile head;  // producers
+    GDUQueueMT_Node *tail;           // consumers; guarded by mutex
+    volatile atomic_int no;
+    volatile atomic_int waiters;
+    int wakeups;
+    YAZ_MUTEX mutex;
+    YAZ_COND cond;
+    GDU *pop();
+};
+
+GDUQueueMT::GDUQueueMT()
+{
+    m_p = new Rep;
+    m_p->tail = new GDUQueueMT_Node;
+    m_p->tail->next = 0;
+    m_p->tail->gdu = 0;
+    m_p->head = m_p->tail;
+    m_p->no = 0;
+    m_p->waiters = 0;
+    m_p->wakeups = 0;
+    m_p->mutex = 0;
+    yaz_mutex_create(&m_p->mutex);
+    m_p->cond = 0;
+    yaz_cond_create(&m_p->cond);
+}
+
+GDUQueueMT::~GDUQueueMT()
+{
+    GDU *g;
+    while ((g = m_p->pop()))
+        delete g;
+    delete m_p->tail;
+    yaz_cond_destroy(&m_p->cond);
+    yaz_mutex_destroy(&m_p->mutex);
+    delete m_p;
+}
+
+void GDUQueueMT::enqueue(GDU *gdu)
+{
+    GDUQueueMT_Node *n = new GDUQueueMT_Node;
+    n->next = 0;
+    n->gdu = gdu;
+    atomic_add(&m_p->no, 1);
+    GDUQueueMT_Node *prev = atomic_xchg(&m_p->head, n);
+    prev->next = n;
+    // pairs with the increment of waiters in wait
+    memory_barrier();
+    if (m_p->waiters)
+    {
+        yaz_mutex_enter(m_p->mutex);
+        yaz_cond_signal(m_p->cond);
+        yaz_mutex_leave(m_p->mutex);
+    }
+}
+
+// caller holds mutex
+GDU *GDUQueueMT::Rep::pop()
+{
+    GDUQueueMT_Node *next = tail->next;
+    if (!next)
+        return 0;
+    memory_barrier();
+    GDU *gdu = next->gdu;
+    delete tail;
+    tail = next;
+    atomic_add(&no, -1);
+    return gdu;
+}
+
+GDU *GDUQueueMT::dequeue()
+{
+    yaz_mutex_enter(m_p->mutex);
+    GDU *gdu = m_p->pop();
+    yaz_mutex_leave(m_p->mutex);
+    return gdu;
+}
+
+int GDUQueueMT::dequeue_batch(GDU **gdus, int max)
+{
+    int i;
+    yaz_mutex_enter(m_p->mutex);
+    for (i = 0; i < max; i++)
+        if (!(gdus[i] = m_p->pop()))
+            break;
+    yaz_mutex_leave(m_p->mutex);
+    return i;
+}
+
+int GDUQueueMT::wait(int timeout_ms)
+{
+    struct timeval abstime;
+    if (timeout_ms >= 0)
+    {
+        yaz_gettimeofday(&abstime);
+        abstime.tv_sec += timeout_ms / 1000;
+        abstime.tv_usec += (timeout_ms % 1000) * 1000;
+        if (abstime.tv_usec >= 1000000)
+        {
+            abstime.tv_sec++;
+            abstime.tv_usec -= 1000000;
+        }
+    }
+    yaz_mutex_enter(m_p->mutex);
+    atomic_add(&m_p->waiters, 1);
+    int wakeups = m_p->wakeups;
+    while (!m_p->tail->next && wakeups == m_p->wakeups)
+    {
+        if (yaz_cond_wait(m_p->cond, m_p->mutex,
+                          timeout_ms >= 0 ? &abstime : 0))
+            break;  // timeout
+    }
+    atomic_add(&m_p->waiters, -1);
+    int r = m_p->tail->next ? 1 : 0;
+    yaz_mutex_leave(m_p->mutex);
+    return r;
+}
+
+void GDUQueueMT::wakeup()
+{
+    yaz_mutex_enter(m_p->mutex);
+    m_p->wakeups++;
+    yaz_cond_broadcast(m_p->cond);
+    yaz_mutex_leave(m_p->mutex);
+}
+
+int GDUQueueMT::size()
+{
+    return m_p->no;
+}
+
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
@@ -11,38 +11,174 @@
 
 using namespace yazpp_1;
 
+#define GDUQUEUE_MAX_TYPES 32
+
+struct GDUQueue_Ring {
+    GDU **ring;   // circular buffer of size max (power of 2)
+    int max;
+    int head;     // index of oldest entry
+    int no;
+    int skipped;  // dequeues served from higher classes while non-empty
+    void grow();
+    void push(GDU *gdu);
+    GDU *pop();
+};
+
+class GDUQueue::Rep {
+    friend class GDUQueue;
+    GDUQueue_Ring classes[GDUQueue::NO_PRIORITIES];
+    int prio_type[GDUQUEUE_MAX_TYPES];
+    int prio_enabled;
+    int starvation_limit;
+    int no;
+    int bytes;
+    int max_items;
+    int max_bytes;
+    int get_class(GDU *gdu);
+};
+
+void GDUQueue_Ring::grow()
+{
+    int new_max = max ? 2 * max : 16;
+    GDU **new_ring = new GDU *[new_max];
+    int i;
+    for (i = 0; i < no; i++)
+        new_ring[i] = ring[(head + i) & (max - 1)];
+    delete [] ring;
+    ring = new_ring;
+    max = new_max;
+    head = 0;
+}
+
+void GDUQueue_Ring::push(GDU *gdu)
+{
+    if (no == max)
+        grow();
+    ring[(head + no) & (max - 1)] = gdu;
+    no++;
+}
+
+GDU *GDUQueue_Ring::pop()
+{
+    GDU *m = ring[head];
+    head = (head + 1) & (max - 1);
+    no--;
+    return m;
+}
+
+int GDUQueue::Rep::get_class(GDU *gdu)
+{
+    if (!prio_enabled)
+        return PRIORITY_NORMAL;
+    Z_GDU *z = gdu->get();
+    if (z && z->which == Z_GDU_Z3950 && z->u.z3950
+        && z->u.z3950->which >= 0 && z->u.z3950->which < GDUQUEUE_MAX_TYPES)
+        return prio_type[z->u.z3950->which];
+    return PRIORITY_NORMAL;
+}
+
 GDUQueue::GDUQueue()
 {
-    m_list = 0;
+    int i;
+    m_p = new Rep;
+    for (i = 0; i < NO_PRIORITIES; i++)
+    {
+        m_p->classes[i].ring = 0;
+        m_p->classes[i].max = 0;
+        m_p->classes[i].head = 0;
+        m_p->classes[i].no = 0;
+        m_p->classes[i].skipped = 0;
+    }
+    for (i = 0; i < GDUQUEUE_MAX_TYPES; i++)
+        m_p->prio_type[i] = PRIORITY_NORMAL;
+    m_p->prio_enabled = 0;
+    m_p->starvation_limit = 8;
+    m_p->no = 0;
+    m_p->bytes = 0;
+    m_p->max_items = 0;
+    m_p->max_bytes = 0;
 }
 
 int GDUQueue::size()
 {
-    int no = 0;
-    GDUQueue_List *l;
-    for (l = m_list; l; l = l->m_next)
-        no++;
-    return no;
+    return m_p->no;
+}
+
+int GDUQueue::get_bytes()
+{
+    return m_p->bytes;
+}
+
+void GDUQueue::set_max_items(int max_items)
+{
+    m_p->max_items = max_items;
+}
+
+void GDUQueue::set_max_bytes(int max_bytes)
+{
+    m_p->max_bytes = max_bytes;
+}
+
+int GDUQueue::set_priority(int apdu_type, int prio)
+{
+    if (apdu_type < 0 || apdu_type >= GDUQUEUE_MAX_TYPES
+        || prio < 0 || prio >= NO_PRIORITIES)
+        return -1;
+    m_p->prio_type[apdu_type] = prio;
+    m_p->prio_enabled = 1;
+    return 0;
+}
+
+void GDUQueue::set_default_priorities()
+{
+    set_priority(Z_APDU_initRequest, PRIORITY_HIGH);
+    set_priority(Z_APDU_close, PRIORITY_HIGH);
+    set_priority(Z_APDU_triggerResourceControlRequest, PRIORITY_HIGH);
+    set_priority(Z_APDU_resourceControlResponse, PRIORITY_HIGH);
+    set_priority(Z_APDU_accessControlResponse, PRIORITY_HIGH);
+}
+
+void GDUQueue::set_starvation_limit(int limit)
+{
+    m_p->starvation_limit = limit;
 }
 
-void GDUQueue::enqueue(GDU *gdu)
+int GDUQueue::enqueue(GDU *gdu)
 {
-    GDUQueue_List *l = new GDUQueue_List;
-    l->m_next = m_list;
-    l->m_item = gdu;
-    m_list = l;
+    int len = gdu->get_size();
+    if (m_p->max_items > 0 && m_p->no >= m_p->max_items)
+        return -1;
+    if (m_p->max_bytes > 0 && m_p->bytes + len > m_p->max_bytes)
+        return -1;
+    m_p->classes[m_p->get_class(gdu)].push(gdu);
+    m_p->no++;
+    m_p->bytes += len;
+    return 0;
 }
 
 GDU *GDUQueue::dequeue()
 {
-    GDUQueue_List **l = &m_list;
-    if (!*l)
+    if (m_p->no == 0)
         return 0;
-    while ((*l)->m_next)
-        l = &(*l)->m_next;
-    GDU *m = (*l)->m_item;
-    delete *l;
-    *l = 0;
+    int i, c = -1;
+    // a class that has waited too long goes first; lowest first
+    if (m_p->starvation_limit > 0)
+        for (i = NO_PRIORITIES; --i > 0; )
+            if (m_p->classes[i].skipped >= m_p->starvation_limit)
+            {
+                c = i;
+                break;
+            }
+    if (c == -1)
+        for (c = 0; !m_p->classes[c].no; c++)
+            ;
+    m_p->classes[c].skipped = 0;
+    for (i = c + 1; i < NO_PRIORITIES; i++)
+        if (m_p->classes[i].no)
+            m_p->classes[i].skipped++;
+    GDU *m = m_p->classes[c].pop();
+    m_p->no--;
+    m_p->bytes -= m->get_size();
     return m;
 }
 
@@ -56,6 +192,10 @@ void GDUQueue::clear()
 GDUQueue::~GDUQueue()
 {
     clear();
+    int i;
+    for (i = 0; i < NO_PRIORITIES; i++)
+        delete [] m_p->classes[i].ring;
+    delete m_p;
 }
 /*
  * Local variables:
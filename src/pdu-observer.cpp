@@ -15,6 +15,11 @@ IPDU_Observable::~IPDU_Observable()
 
 }
 
+ISocketObservable *IPDU_Observable::get_socket_observable()
+{
+    return 0;
+}
+
 IPDU_Observer::~IPDU_Observer()
 {
 
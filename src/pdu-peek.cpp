@@ -0,0 +1,289 @@
+/* This file is part of the yazpp toolkit.
+ * Copyright (C) Index Data 
+ * See the file LICENSE for details.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <yaz/proto.h>
+#include <yaz/xmalloc.h>
+#include <yazpp/pdu-peek.h>
+
+#define BER_CONTEXT 2
+
+/* context tags of the APDU CHOICE, starting with initRequest [20] */
+#define APDU_TAG_FIRST 20
+static const int apdu_tags[] = {
+    Z_APDU_initRequest,
+    Z_APDU_initResponse,
+    Z_APDU_searchRequest,
+    Z_APDU_searchResponse,
+    Z_APDU_presentRequest,
+    Z_APDU_presentResponse,
+    Z_APDU_deleteResultSetRequest,
+    Z_APDU_deleteResultSetResponse,
+    Z_APDU_accessControlRequest,
+    Z_APDU_accessControlResponse,
+    Z_APDU_resourceControlRequest,
+    Z_APDU_resourceControlResponse,
+    Z_APDU_triggerResourceControlRequest,
+    Z_APDU_resourceReportRequest,
+    Z_APDU_resourceReportResponse,
+    Z_APDU_scanRequest,
+    Z_APDU_scanResponse,
+    -1, -1, -1, -1, -1, -1,     // 37-42 not assigned
+    Z_APDU_sortRequest,
+    Z_APDU_sortResponse,
+    Z_APDU_segmentRequest,
+    Z_APDU_extendedServicesRequest,
+    Z_APDU_extendedServicesResponse,
+    Z_APDU_close,
+    Z_APDU_duplicateDetectionRequest,
+    Z_APDU_duplicateDetectionResponse
+};
+
+#define TAG_REFERENCE_ID 2
+#define TAG_SEARCH_DATABASES 18
+#define TAG_SCAN_DATABASES 3
+#define TAG_DATABASE_NAME 105
+
+using namespace yazpp_1;
+
+class PDU_Peek::Rep {
+    friend class PDU_Peek;
+    int type;
+    const char *refid;
+    int refid_len;
+    int num_db;
+    int max_db;
+    const char **db;
+    int *db_len;
+    void add_db(const char *name, int len);
+};
+
+#define BER_MAX_DEPTH 64
+
+struct BER_Elem {
+    int zclass;
+    int constructed;
+    int tag;
+    const unsigned char *content;
+    const unsigned char *end;   // 0 for indefinite length
+};
+
+/* Decode identifier and length at cp. Returns 0 on success; -1 if the
+   element is malformed or extends beyond end */
+static int ber_elem(const unsigned char *cp, const unsigned char *end,
+                    BER_Elem *e)
+{
+    if (cp >= end)
+        return -1;
+    e->zclass = *cp >> 6;
+    e->constructed = (*cp >> 5) & 1;
+    e->tag = *cp & 31;
+    cp++;
+    if (e->tag == 31)
+    {
+        e->tag = 0;
+        do
+        {
+            if (cp >= end || e->tag > 0xffffff)
+                return -1;
+            e->tag = (e->tag << 7) | (*cp & 127);
+        } while (*cp++ & 128);
+    }
+    if (cp >= end)
+        return -1;
+    if (*cp == 0x80)
+    {
+        if (!e->constructed)
+            return -1;
+        e->content = cp + 1;
+        e->end = 0;
+        return 0;
+    }
+    long len;
+    if (*cp & 128)
+    {
+        int n = *cp++ & 127;
+        if (n > 4)
+            return -1;
+        len = 0;
+        while (--n >= 0)
+        {
+            if (cp >= end)
+                return -1;
+            len = (len << 8) | *cp++;
+        }
+    }
+    else
+        len = *cp++;
+    if (len < 0 || len > end - cp)
+        return -1;
+    e->content = cp;
+    e->end = cp + len;
+    return 0;
+}
+
+/* Returns position just after element e or 0 if malformed */
+static const unsigned char *ber_skip(const BER_Elem *e,
+                                     const unsigned char *end, int depth = 0)
+{
+    if (e->end)
+        return e->end;
+    if (depth > BER_MAX_DEPTH)
+        return 0;
+    const unsigned char *cp = e->content;
+    while (1)
+    {
+        if (end - cp >= 2 && cp[0] == 0 && cp[1] == 0)
+            return cp + 2;
+        BER_Elem c;
+        if (ber_elem(cp, end, &c))
+            return 0;
+        cp = ber_skip(&c, end, depth + 1);
+        if (!cp)
+            return 0;
+    }
+}
+
+/* Iterates children of a constructed element. Returns 1 with child in c,
+   0 at end of contents, -1 on error */
+static int ber_next(const BER_Elem *parent, const unsigned char **cp,
+                    const unsigned char *end, BER_Elem *c)
+{
+    const unsigned char *limit = parent->end ? parent->end : end;
+    if (*cp >= limit)
+        return parent->end ? 0 : -1;
+    if (!parent->end && limit - *cp >= 2 && (*cp)[0] == 0 && (*cp)[1] == 0)
+        return 0;
+    if (ber_elem(*cp, limit, c))
+        return -1;
+    *cp = ber_skip(c, limit);
+    return *cp ? 1 : -1;
+}
+
+void PDU_Peek::Rep::add_db(const char *name, int len)
+{
+    if (num_db == max_db)
+    {
+        max_db = max_db ? 2 * max_db : 8;
+        db = (const char **) xrealloc(db, max_db * sizeof(*db));
+        db_len = (int *) xrealloc(db_len, max_db * sizeof(*db_len));
+    }
+    db[num_db] = name;
+    db_len[num_db] = len;
+    num_db++;
+}
+
+PDU_Peek::PDU_Peek()
+{
+    m_p = new Rep;
+    m_p->type = -1;
+    m_p->refid = 0;
+    m_p->refid_len = 0;
+    m_p->num_db = 0;
+    m_p->max_db = 0;
+    m_p->db = 0;
+    m_p->db_len = 0;
+}
+
+PDU_Peek::~PDU_Peek()
+{
+    xfree(m_p->db);
+    xfree(m_p->db_len);
+    delete m_p;
+}
+
+int PDU_Peek::parse(const char *buf, int len)
+{
+    const unsigned char *cp = (const unsigned char *) buf;
+    const unsigned char *end = cp + len;
+    BER_Elem apdu, c;
+
+    m_p->type = -1;
+    m_p->refid = 0;
+    m_p->refid_len = 0;
+    m_p->num_db = 0;
+
+    if (len <= 0 || (*cp >> 6) != BER_CONTEXT)
+        return 0;  // not Z39.50; HTTP starts with a plain letter
+    if (ber_elem(cp, end, &apdu) || !apdu.constructed)
+        return -1;
+    int idx = apdu.tag - APDU_TAG_FIRST;
+    if (idx < 0 || idx >= (int) (sizeof(apdu_tags) / sizeof(*apdu_tags))
+        || apdu_tags[idx] == -1)
+        return -1;
+    m_p->type = apdu_tags[idx];
+
+    int db_tag = 0;
+    if (m_p->type == Z_APDU_searchRequest)
+        db_tag = TAG_SEARCH_DATABASES;
+    else if (m_p->type == Z_APDU_scanRequest)
+        db_tag = TAG_SCAN_DATABASES;
+
+    // members are in ascending tag order; stop as soon as we are past
+    // the ones of interest so that queries, records etc. are not walked
+    cp = apdu.content;
+    int r;
+    while ((r = ber_next(&apdu, &cp, end, &c)) == 1)
+    {
+        if (c.zclass != BER_CONTEXT)
+            break;
+        if (c.tag == TAG_REFERENCE_ID && !c.constructed)
+        {
+            m_p->refid = (const char *) c.content;
+            m_p->refid_len = c.end - c.content;
+        }
+        else if (c.tag == db_tag && c.constructed)
+        {
+            const unsigned char *dp = c.content;
+            BER_Elem d;
+            while ((r = ber_next(&c, &dp, end, &d)) == 1)
+                if (d.tag == TAG_DATABASE_NAME && !d.constructed && d.end)
+                    m_p->add_db((const char *) d.content, d.end - d.content);
+            if (r < 0)
+                return -1;
+            break;
+        }
+        if (c.tag >= db_tag)
+            break;
+    }
+    return r < 0 ? -1 : 1;
+}
+
+int PDU_Peek::get_type()
+{
+    return m_p->type;
+}
+
+const char *PDU_Peek::get_referenceId(int *len)
+{
+    *len = m_p->refid_len;
+    return m_p->refid;
+}
+
+int PDU_Peek::get_num_databaseNames()
+{
+    return m_p->num_db;
+}
+
+const char *PDU_Peek::get_databaseName(int idx, int *len)
+{
+    if (idx < 0 || idx >= m_p->num_db)
+    {
+        *len = 0;
+        return 0;
+    }
+    *len = m_p->db_len[idx];
+    return m_p->db[idx];
+}
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
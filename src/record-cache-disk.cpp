@@ -0,0 +1,1080 @@
+/* This file is part of the yazpp toolkit.
+ * Copyright (C) Index Data 
+ * See the file LICENSE for details.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#if HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#if HAVE_DIRENT_H
+#include <dirent.h>
+#endif
+#include <yaz/log.h>
+#include <yaz/mutex.h>
+#include <yaz/thread_create.h>
+#include <yaz/gettimeofday.h>
+#include <yaz/wrbuf.h>
+#include <yaz/xmalloc.h>
+#include <yaz/matchstr.h>
+#include <yazpp/record-cache-disk.h>
+#include "cache-table.h"
+
+#if HAVE_UNISTD_H && HAVE_FCNTL_H && HAVE_SYS_MMAN_H && HAVE_DIRENT_H
+#define DISK_TIER 1
+#else
+#define DISK_TIER 0
+#endif
+
+using namespace yazpp_1;
+
+/* Segment file: 8 byte magic followed by records. Each record is a
+   header of 8 big-endian 32-bit integers: kind, total length (padded to
+   a multiple of 4), position, key length, tags length, database name
+   length, number of syntax OID components, data length. Then follow
+   key, tags (each 0-terminated), database name (0-terminated),
+   syntax OID components (32-bit each) and data. A tombstone has the
+   tag to invalidate as its only tag. */
+#define SEG_MAGIC "YAZPPRC1"
+#define SEG_MAGIC_LEN 8
+#define SEG_MAX (16 * 1024 * 1024)
+#define SEG_MIN (64 * 1024)
+#define REC_HDR 32
+
+#define REC_OCTET 1      // data is octet_aligned of databaseRecord
+#define REC_SUTRS 2      // data is sutrs of databaseRecord
+#define REC_BER 3        // data is BER encoded NamePlusRecord
+#define REC_TOMBSTONE 4
+
+struct RecordCacheDisk_Segment {
+    int no;
+    int fd;
+    char *map;
+    size_t size;     // bytes in file
+    size_t live;     // bytes of records still indexed
+    int epoch;       // when retired; see RecordCacheDisk_Pin
+    RecordCacheDisk_Segment *next;
+};
+
+/* Pins taken while epoch was current. A segment retired in epoch e
+   stays mapped while there are pins of epoch e or older, as records
+   from get may point into it */
+struct RecordCacheDisk_Pin {
+    int epoch;
+    int count;
+    RecordCacheDisk_Pin *next;
+};
+
+struct RecordCacheDisk_Entry : CacheNode {
+    int position;
+    RecordCacheDisk_Segment *seg;
+    unsigned offset;
+};
+
+class RecordCacheDisk::Rep {
+    friend class RecordCacheDisk;
+    char *dir;
+    size_t max_size;
+    size_t seg_max;                    // active segment is full at this
+    size_t total;
+    int interval;
+    RecordCacheDisk_Segment *segs;     // oldest first
+    RecordCacheDisk_Segment *active;   // last of segs; appended to
+    RecordCacheDisk_Segment *retired;  // unmapped by next compaction
+    int epoch;                         // incremented by each retire
+    RecordCacheDisk_Pin *pins;         // oldest first
+    CacheTable index;
+    YAZ_MUTEX mutex;
+    YAZ_COND cond;
+    yaz_thread_t thread;
+    int stop;
+    int compacting;                    // compact_segment in progress
+#if DISK_TIER
+    static void *thread_main(void *p);
+    RecordCacheDisk_Segment *open_segment(int no, int create);
+    void unmap_segment(RecordCacheDisk_Segment *seg);
+    int load_segment(RecordCacheDisk_Segment *seg);
+    void drop_segment(RecordCacheDisk_Segment *seg);
+    void retire(RecordCacheDisk_Segment *seg);
+    void free_retired();
+    int is_pinned(int token);
+    int new_active();
+    long append(WRBUF rec);
+    RecordCacheDisk_Entry *find(unsigned hash, const char *key, int key_len,
+                                int position);
+    void index_insert(unsigned hash, int position,
+                      RecordCacheDisk_Segment *seg, unsigned offset);
+    void index_remove(RecordCacheDisk_Entry *entry);
+    void invalidate(const char *tag);
+    void compact_segment();
+    void close_locked();
+#endif
+};
+
+#if DISK_TIER
+static void put_u32(WRBUF w, unsigned v)
+{
+    char b[4];
+    b[0] = (v >> 24) & 255;
+    b[1] = (v >> 16) & 255;
+    b[2] = (v >> 8) & 255;
+    b[3] = v & 255;
+    wrbuf_write(w, b, 4);
+}
+
+static unsigned get_u32(const char *cp)
+{
+    const unsigned char *b = (const unsigned char *) cp;
+    return ((unsigned) b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+}
+
+static unsigned hash_key(const char *key, int key_len, int position)
+{
+    return cache_hash_int(cache_hash_bytes(CACHE_HASH_INIT, key, key_len),
+                          (unsigned) position);
+}
+
+struct RecordCacheDisk_Rec {
+    unsigned kind;
+    unsigned len;
+    int position;
+    const char *key;
+    unsigned key_len;
+    const char *tags;
+    unsigned tags_len;
+    const char *name;
+    unsigned name_len;
+    const char *syntax;
+    unsigned syntax_len;
+    const char *data;
+    unsigned data_len;
+};
+
+// parse record at offset; returns 0 if it is not complete and valid
+static int parse_rec(const char *map, size_t size, size_t off,
+                     RecordCacheDisk_Rec *r)
+{
+    if (off + REC_HDR > size)
+        return 0;
+    const char *cp = map + off;
+    r->kind = get_u32(cp);
+    r->len = get_u32(cp + 4);
+    r->position = (int) get_u32(cp + 8);
+    r->key_len = get_u32(cp + 12);
+    r->tags_len = get_u32(cp + 16);
+    r->name_len = get_u32(cp + 20);
+    r->syntax_len = get_u32(cp + 24);
+    r->data_len = get_u32(cp + 28);
+    if (r->kind < REC_OCTET || r->kind > REC_TOMBSTONE)
+        return 0;
+    if (r->len < REC_HDR || r->len > size - off)
+        return 0;
+    // each length bounded by record length, so the sum can not overflow
+    if (r->key_len > r->len || r->tags_len > r->len ||
+        r->name_len > r->len || r->syntax_len > r->len / 4 ||
+        r->data_len > r->len)
+        return 0;
+    if ((size_t) REC_HDR + r->key_len + r->tags_len + r->name_len
+        + 4 * (size_t) r->syntax_len + r->data_len > r->len)
+        return 0;
+    if (r->tags_len && cp[REC_HDR + r->key_len + r->tags_len - 1])
+        return 0;
+    r->key = cp + REC_HDR;
+    r->tags = r->key + r->key_len;
+    r->name = r->tags + r->tags_len;
+    if (r->name_len && r->name[r->name_len - 1])
+        return 0;
+    r->syntax = r->name + r->name_len;
+    r->data = r->syntax + 4 * r->syntax_len;
+    return 1;
+}
+
+static int has_tag(const RecordCacheDisk_Rec *r, const char *tag)
+{
+    const char *cp = r->tags;
+    while (cp < r->tags + r->tags_len)
+    {
+        if (!yaz_matchstr(cp, tag))
+            return 1;
+        cp += strlen(cp) + 1;
+    }
+    return 0;
+}
+
+static void mk_rec(WRBUF w, unsigned kind, int position,
+                   const char *key, int key_len,
+                   int num_tags, const char **tags,
+                   const char *name, const Odr_oid *syntax,
+                   const char *data, int data_len)
+{
+    int i, tags_len = 0, name_len = name ? strlen(name) + 1 : 0;
+    int syntax_len = 0;
+    for (i = 0; i < num_tags; i++)
+        tags_len += strlen(tags[i]) + 1;
+    if (syntax)
+        while (syntax[syntax_len] != -1)
+            syntax_len++;
+    unsigned len = REC_HDR + key_len + tags_len + name_len
+        + 4 * syntax_len + data_len;
+    len = (len + 3) & ~3U;
+
+    wrbuf_rewind(w);
+    put_u32(w, kind);
+    put_u32(w, len);
+    put_u32(w, (unsigned) position);
+    put_u32(w, key_len);
+    put_u32(w, tags_len);
+    put_u32(w, name_len);
+    put_u32(w, syntax_len);
+    put_u32(w, data_len);
+    if (key_len)
+        wrbuf_write(w, key, key_len);
+    for (i = 0; i < num_tags; i++)
+        wrbuf_write(w, tags[i], strlen(tags[i]) + 1);
+    if (name_len)
+        wrbuf_write(w, name, name_len);
+    for (i = 0; i < syntax_len; i++)
+        put_u32(w, (unsigned) syntax[i]);
+    if (data_len)
+        wrbuf_write(w, data, data_len);
+    while (wrbuf_len(w) < len)
+        wrbuf_putc(w, 0);
+}
+
+RecordCacheDisk_Segment *RecordCacheDisk::Rep::open_segment(int no,
+                                                            int create)
+{
+    char fname[1024];
+    if (strlen(dir) > sizeof(fname) - 20)
+        return 0;
+    sprintf(fname, "%s/seg-%06d.dat", dir, no);
+    int fd = ::open(fname, create ? O_RDWR|O_CREAT|O_EXCL : O_RDWR, 0666);
+    if (fd == -1)
+    {
+        yaz_log(YLOG_WARN|YLOG_ERRNO, "record cache: open %s", fname);
+        return 0;
+    }
+    off_t size = create ? 0 : lseek(fd, 0, SEEK_END);
+    if (create && write(fd, SEG_MAGIC, SEG_MAGIC_LEN) == SEG_MAGIC_LEN)
+        size = SEG_MAGIC_LEN;
+    void *map = mmap(0, SEG_MAX, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED || size < SEG_MAGIC_LEN || size > SEG_MAX ||
+        memcmp(map, SEG_MAGIC, SEG_MAGIC_LEN))
+    {
+        yaz_log(YLOG_WARN, "record cache: bad segment %s", fname);
+        if (map != MAP_FAILED)
+            munmap(map, SEG_MAX);
+        ::close(fd);
+        return 0;
+    }
+    RecordCacheDisk_Segment *seg = new RecordCacheDisk_Segment;
+    seg->no = no;
+    seg->fd = fd;
+    seg->map = (char *) map;
+    seg->size = size;
+    seg->live = 0;
+    seg->epoch = 0;
+    seg->next = 0;
+    return seg;
+}
+
+void RecordCacheDisk::Rep::unmap_segment(RecordCacheDisk_Segment *seg)
+{
+    munmap(seg->map, SEG_MAX);
+    if (seg->fd != -1)
+        ::close(seg->fd);
+    delete seg;
+}
+
+RecordCacheDisk_Entry *RecordCacheDisk::Rep::find(unsigned hash,
+                                                  const char *key,
+                                                  int key_len, int position)
+{
+    RecordCacheDisk_Entry *e =
+        static_cast<RecordCacheDisk_Entry *>(index.chain(hash));
+    for (; e; e = static_cast<RecordCacheDisk_Entry *>(e->next))
+        if (e->hash == hash && e->position == position &&
+            get_u32(e->seg->map + e->offset + 12) == (unsigned) key_len &&
+            !memcmp(e->seg->map + e->offset + REC_HDR, key, key_len))
+            break;
+    return e;
+}
+
+void RecordCacheDisk::Rep::index_insert(unsigned hash, int position,
+                                        RecordCacheDisk_Segment *seg,
+                                        unsigned offset)
+{
+    RecordCacheDisk_Entry *e = new RecordCacheDisk_Entry;
+    e->hash = hash;
+    e->position = position;
+    e->seg = seg;
+    e->offset = offset;
+    index.insert(e);
+    seg->live += get_u32(seg->map + offset + 4);
+}
+
+void RecordCacheDisk::Rep::index_remove(RecordCacheDisk_Entry *entry)
+{
+    index.remove(entry);
+    entry->seg->live -= get_u32(entry->seg->map + entry->offset + 4);
+    delete entry;
+}
+
+int RecordCacheDisk::Rep::load_segment(RecordCacheDisk_Segment *seg)
+{
+    size_t off = SEG_MAGIC_LEN;
+    RecordCacheDisk_Rec r;
+    while (off < seg->size)
+    {
+        if (!parse_rec(seg->map, seg->size, off, &r))
+        {
+            yaz_log(YLOG_WARN, "record cache: segment %d truncated at %ld",
+                    seg->no, (long) off);
+            break;
+        }
+        if (r.kind == REC_TOMBSTONE)
+            invalidate(r.tags);
+        else
+        {
+            unsigned h = hash_key(r.key, r.key_len, r.position);
+            RecordCacheDisk_Entry *e = find(h, r.key, r.key_len, r.position);
+            if (e)
+                index_remove(e);
+            index_insert(h, r.position, seg, off);
+        }
+        off += r.len;
+    }
+    // ignore trailing garbage from a crash; new records go elsewhere
+    seg->size = off;
+    return 0;
+}
+
+// forget segment and its records; mapping kept until next compaction
+void RecordCacheDisk::Rep::drop_segment(RecordCacheDisk_Segment *seg)
+{
+    RecordCacheDisk_Entry *e =
+        static_cast<RecordCacheDisk_Entry *>(index.lru_head);
+    while (e)
+    {
+        RecordCacheDisk_Entry *e_next =
+            static_cast<RecordCacheDisk_Entry *>(e->lru_next);
+        if (e->seg == seg)
+            index_remove(e);
+        e = e_next;
+    }
+    RecordCacheDisk_Segment **sp = &segs;
+    while (*sp != seg)
+        sp = &(*sp)->next;
+    *sp = seg->next;
+    if (active == seg)
+        active = 0;
+    total -= seg->size;
+
+    char fname[1024];
+    sprintf(fname, "%s/seg-%06d.dat", dir, seg->no);
+    unlink(fname);
+    retire(seg);
+}
+
+// close segment no longer in segs; mapped while pins may refer to it
+void RecordCacheDisk::Rep::retire(RecordCacheDisk_Segment *seg)
+{
+    ::close(seg->fd);
+    seg->fd = -1;
+    seg->epoch = epoch++;
+    seg->next = retired;
+    retired = seg;
+}
+
+void RecordCacheDisk::Rep::free_retired()
+{
+    RecordCacheDisk_Segment **sp = &retired;
+    while (*sp)
+    {
+        RecordCacheDisk_Segment *seg = *sp;
+        if (pins && pins->epoch <= seg->epoch)
+            sp = &seg->next;
+        else
+        {
+            *sp = seg->next;
+            unmap_segment(seg);
+        }
+    }
+}
+
+int RecordCacheDisk::Rep::is_pinned(int token)
+{
+    RecordCacheDisk_Pin *pin;
+    for (pin = pins; pin; pin = pin->next)
+        if (pin->epoch == token)
+            return 1;
+    return 0;
+}
+
+int RecordCacheDisk::Rep::new_active()
+{
+    int no = 1;
+    RecordCacheDisk_Segment *seg;
+    for (seg = segs; seg; seg = seg->next)
+        if (seg->no >= no)
+            no = seg->no + 1;
+    for (seg = retired; seg; seg = seg->next)
+        if (seg->no >= no)
+            no = seg->no + 1;
+    seg = open_segment(no, 1);
+    if (!seg)
+        return -1;
+    RecordCacheDisk_Segment **sp = &segs;
+    while (*sp)
+        sp = &(*sp)->next;
+    *sp = seg;
+    active = seg;
+    total += seg->size;
+    return 0;
+}
+
+// append record to active segment; returns offset or -1
+long RecordCacheDisk::Rep::append(WRBUF rec)
+{
+    size_t len = wrbuf_len(rec);
+    if (len > seg_max - SEG_MAGIC_LEN)
+        return -1;
+    if (!active || active->size + len > seg_max)
+    {
+        if (new_active())
+            return -1;
+    }
+    if (lseek(active->fd, active->size, SEEK_SET) == (off_t) -1 ||
+        write(active->fd, wrbuf_buf(rec), len) != (ssize_t) len)
+    {
+        yaz_log(YLOG_WARN|YLOG_ERRNO, "record cache: write segment %d",
+                active->no);
+        // start over in a new segment; this one ends with a bad record
+        active = 0;
+        return -1;
+    }
+    long off = active->size;
+    active->size += len;
+    total += len;
+    // keep within budget by dropping oldest segments
+    while (total > max_size && segs && segs != active)
+        drop_segment(segs);
+    return off;
+}
+
+void RecordCacheDisk::Rep::invalidate(const char *tag)
+{
+    RecordCacheDisk_Entry *e =
+        static_cast<RecordCacheDisk_Entry *>(index.lru_head);
+    while (e)
+    {
+        RecordCacheDisk_Entry *e_next =
+            static_cast<RecordCacheDisk_Entry *>(e->lru_next);
+        RecordCacheDisk_Rec r;
+        if (parse_rec(e->seg->map, e->seg->size, e->offset, &r) &&
+            has_tag(&r, tag))
+            index_remove(e);
+        e = e_next;
+    }
+}
+
+static int cmp_unsigned(const void *a, const void *b)
+{
+    unsigned x = *(const unsigned *) a, y = *(const unsigned *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Rewrite the oldest mostly-dead segment with only its live records,
+   and its tombstones unless it is the oldest segment, and put the new
+   file in its place under the same number, so that load sees records
+   and tombstones in the order they were written. The file is written
+   without holding the mutex; index entries are moved to it afterwards
+   if they still refer to the old segment. The old mapping stays until
+   the next compaction, as only compaction unmaps retired segments */
+void RecordCacheDisk::Rep::compact_segment()
+{
+    yaz_mutex_enter(mutex);
+    RecordCacheDisk_Segment *victim = 0;
+    if (dir && !compacting)
+    {
+        free_retired();
+        for (victim = segs; victim && victim != active; victim = victim->next)
+            if (victim->live < (victim->size - SEG_MAGIC_LEN) / 2)
+                break;
+        if (victim == active)
+            victim = 0;
+    }
+    if (!victim)
+    {
+        yaz_mutex_leave(mutex);
+        return;
+    }
+    yaz_log(YLOG_DEBUG, "record cache: compact segment %d live=%ld size=%ld",
+            victim->no, (long) victim->live, (long) victim->size);
+    // offsets of live records, in file order
+    int i, num = 0, max = 0;
+    unsigned *offs = 0;
+    RecordCacheDisk_Entry *e =
+        static_cast<RecordCacheDisk_Entry *>(index.lru_head);
+    for (; e; e = static_cast<RecordCacheDisk_Entry *>(e->lru_next))
+        if (e->seg == victim)
+        {
+            if (num == max)
+            {
+                max = max ? 2 * max : 64;
+                offs = (unsigned *) xrealloc(offs, max * sizeof(*offs));
+            }
+            offs[num++] = e->offset;
+        }
+    if (num)
+        qsort(offs, num, sizeof(*offs), cmp_unsigned);
+    // only older segments can hold records a tombstone applies to
+    int keep_tombstones = victim != segs;
+    char fname[1024], tmp_fname[1024];
+    sprintf(fname, "%s/seg-%06d.dat", dir, victim->no);
+    sprintf(tmp_fname, "%s/seg-%06d.tmp", dir, victim->no);
+    compacting = 1;
+    yaz_mutex_leave(mutex);
+
+    unsigned *new_offs = (unsigned *) xmalloc((num + 1) * sizeof(*new_offs));
+    WRBUF w = wrbuf_alloc();
+    wrbuf_write(w, SEG_MAGIC, SEG_MAGIC_LEN);
+    size_t off = SEG_MAGIC_LEN;
+    RecordCacheDisk_Rec r;
+    i = 0;
+    while (off < victim->size && parse_rec(victim->map, victim->size,
+                                           off, &r))
+    {
+        if (i < num && offs[i] == off)
+        {
+            new_offs[i++] = wrbuf_len(w);
+            wrbuf_write(w, victim->map + off, r.len);
+        }
+        else if (r.kind == REC_TOMBSTONE && keep_tombstones)
+            wrbuf_write(w, victim->map + off, r.len);
+        off += r.len;
+    }
+    num = i;
+    int empty = wrbuf_len(w) == SEG_MAGIC_LEN;
+    int written = 0;
+    if (!empty)
+    {
+        int fd = ::open(tmp_fname, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+        if (fd == -1)
+            yaz_log(YLOG_WARN|YLOG_ERRNO, "record cache: open %s", tmp_fname);
+        else
+        {
+            if (write(fd, wrbuf_buf(w), wrbuf_len(w)) ==
+                (ssize_t) wrbuf_len(w))
+                written = 1;
+            else
+                yaz_log(YLOG_WARN|YLOG_ERRNO, "record cache: write %s",
+                        tmp_fname);
+            ::close(fd);
+        }
+    }
+    wrbuf_destroy(w);
+
+    yaz_mutex_enter(mutex);
+    compacting = 0;
+    // append or clear may have dropped it meanwhile
+    RecordCacheDisk_Segment **sp = &segs;
+    while (*sp && *sp != victim)
+        sp = &(*sp)->next;
+    RecordCacheDisk_Segment *seg = 0;
+    if (*sp && written && rename(tmp_fname, fname) == 0)
+        seg = open_segment(victim->no, 0);
+    if (written && !seg)
+        unlink(tmp_fname);
+    if (seg)
+    {
+        for (i = 0; i < num; i++)
+        {
+            parse_rec(victim->map, victim->size, offs[i], &r);
+            e = find(hash_key(r.key, r.key_len, r.position),
+                     r.key, r.key_len, r.position);
+            if (e && e->seg == victim && e->offset == offs[i])
+            {
+                victim->live -= r.len;
+                e->seg = seg;
+                e->offset = new_offs[i];
+                seg->live += r.len;
+            }
+        }
+        seg->next = victim->next;
+        *sp = seg;
+        total += seg->size;
+        total -= victim->size;
+        // file already replaced, so not unlinked as drop_segment would
+        retire(victim);
+    }
+    else if (*sp && empty)
+        drop_segment(victim);
+    yaz_mutex_leave(mutex);
+    xfree(new_offs);
+    xfree(offs);
+}
+
+void *RecordCacheDisk::Rep::thread_main(void *p)
+{
+    Rep *rep = (Rep *) p;
+    yaz_mutex_enter(rep->mutex);
+    while (!rep->stop)
+    {
+        struct timeval abstime;
+        yaz_gettimeofday(&abstime);
+        abstime.tv_sec += rep->interval;
+        yaz_cond_wait(rep->cond, rep->mutex, &abstime);
+        if (!rep->stop)
+        {
+            yaz_mutex_leave(rep->mutex);
+            rep->compact_segment();
+            yaz_mutex_enter(rep->mutex);
+        }
+    }
+    yaz_mutex_leave(rep->mutex);
+    return 0;
+}
+
+void RecordCacheDisk::Rep::close_locked()
+{
+    while (index.lru_head)
+    {
+        RecordCacheDisk_Entry *e =
+            static_cast<RecordCacheDisk_Entry *>(index.lru_head);
+        index.remove(e);
+        delete e;
+    }
+    index.destroy();
+    while (segs)
+    {
+        RecordCacheDisk_Segment *seg = segs;
+        segs = seg->next;
+        unmap_segment(seg);
+    }
+    active = 0;
+    total = 0;
+    while (pins)
+    {
+        RecordCacheDisk_Pin *pin = pins;
+        pins = pin->next;
+        delete pin;
+    }
+    free_retired();
+    xfree(dir);
+    dir = 0;
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+    return *(const int *) a - *(const int *) b;
+}
+#endif
+
+RecordCacheDisk::RecordCacheDisk()
+{
+    m_p = new Rep;
+    m_p->dir = 0;
+    m_p->max_size = 0;
+    m_p->seg_max = SEG_MAX;
+    m_p->total = 0;
+    m_p->interval = 60;
+    m_p->segs = 0;
+    m_p->active = 0;
+    m_p->retired = 0;
+    m_p->epoch = 1;
+    m_p->pins = 0;
+    m_p->index.init();
+    m_p->mutex = 0;
+    yaz_mutex_create(&m_p->mutex);
+    m_p->cond = 0;
+    yaz_cond_create(&m_p->cond);
+    m_p->thread = 0;
+    m_p->stop = 0;
+    m_p->compacting = 0;
+}
+
+RecordCacheDisk::~RecordCacheDisk()
+{
+    close();
+    yaz_cond_destroy(&m_p->cond);
+    yaz_mutex_destroy(&m_p->mutex);
+    delete m_p;
+}
+
+#if DISK_TIER
+int RecordCacheDisk::open(const char *dir, size_t max_size)
+{
+    close();
+    DIR *d = opendir(dir);
+    if (!d)
+    {
+        yaz_log(YLOG_WARN|YLOG_ERRNO, "record cache: opendir %s", dir);
+        return -1;
+    }
+    int *nos = 0, num = 0, max = 0;
+    struct dirent *de;
+    while ((de = readdir(d)))
+    {
+        int no;
+        char dummy;
+        if (sscanf(de->d_name, "seg-%d.tm%c", &no, &dummy) == 2 &&
+            dummy == 'p')
+        {
+            // left by a compaction that did not finish
+            char fname[1024];
+            if (strlen(dir) + strlen(de->d_name) < sizeof(fname) - 2)
+            {
+                sprintf(fname, "%s/%s", dir, de->d_name);
+                unlink(fname);
+            }
+        }
+        else if (sscanf(de->d_name, "seg-%d.da%c", &no, &dummy) == 2 &&
+                 dummy == 't' && no > 0)
+        {
+            if (num == max)
+            {
+                max = max ? 2 * max : 16;
+                nos = (int *) xrealloc(nos, max * sizeof(*nos));
+            }
+            nos[num++] = no;
+        }
+    }
+    closedir(d);
+    if (num)
+        qsort(nos, num, sizeof(*nos), cmp_int);
+
+    yaz_mutex_enter(m_p->mutex);
+    m_p->dir = xstrdup(dir);
+    m_p->max_size = max_size;
+    // several segments within budget, so dropping one does not empty it
+    m_p->seg_max = max_size / 4;
+    if (m_p->seg_max > SEG_MAX)
+        m_p->seg_max = SEG_MAX;
+    if (m_p->seg_max < SEG_MIN)
+        m_p->seg_max = SEG_MIN;
+    RecordCacheDisk_Segment **sp = &m_p->segs;
+    int i;
+    for (i = 0; i < num; i++)
+    {
+        RecordCacheDisk_Segment *seg = m_p->open_segment(nos[i], 0);
+        if (seg)
+        {
+            *sp = seg;
+            sp = &seg->next;
+            m_p->load_segment(seg);
+            m_p->total += seg->size;
+        }
+    }
+    xfree(nos);
+    int r = m_p->new_active();
+    while (r == 0 && m_p->total > m_p->max_size && m_p->segs != m_p->active)
+        m_p->drop_segment(m_p->segs);
+    if (r == 0)
+        yaz_log(YLOG_LOG, "record cache: %s: %d records in %ld bytes",
+                dir, m_p->index.num_entries, (long) m_p->total);
+    yaz_mutex_leave(m_p->mutex);
+    if (r)
+    {
+        close();
+        return -1;
+    }
+    m_p->stop = 0;
+    m_p->thread = yaz_thread_create(Rep::thread_main, m_p);
+    return 0;
+}
+#else
+int RecordCacheDisk::open(const char *, size_t)
+{
+    yaz_log(YLOG_WARN, "record cache: disk tier not supported");
+    return -1;
+}
+#endif
+
+void RecordCacheDisk::close()
+{
+#if DISK_TIER
+    if (m_p->thread)
+    {
+        yaz_mutex_enter(m_p->mutex);
+        m_p->stop = 1;
+        yaz_cond_signal(m_p->cond);
+        yaz_mutex_leave(m_p->mutex);
+        yaz_thread_join(&m_p->thread, 0);
+        m_p->thread = 0;
+    }
+    yaz_mutex_enter(m_p->mutex);
+    m_p->close_locked();
+    yaz_mutex_leave(m_p->mutex);
+#endif
+}
+
+void RecordCacheDisk::set_compact_interval(int seconds)
+{
+    yaz_mutex_enter(m_p->mutex);
+    m_p->interval = seconds > 0 ? seconds : 1;
+    yaz_mutex_leave(m_p->mutex);
+}
+
+#if DISK_TIER
+int RecordCacheDisk::put(const char *key, int key_len, int position,
+                         int num_tags, const char **tags,
+                         Z_NamePlusRecord *rec)
+{
+    WRBUF w = wrbuf_alloc();
+    ODR encode = 0;
+    if (rec->which == Z_NamePlusRecord_databaseRecord &&
+        rec->u.databaseRecord->direct_reference &&
+        rec->u.databaseRecord->which == Z_External_octet)
+    {
+        Odr_oct *oct = rec->u.databaseRecord->u.octet_aligned;
+        mk_rec(w, REC_OCTET, position, key, key_len, num_tags, tags,
+               rec->databaseName, rec->u.databaseRecord->direct_reference,
+               (const char *) oct->buf, oct->len);
+    }
+    else if (rec->which == Z_NamePlusRecord_databaseRecord &&
+             rec->u.databaseRecord->direct_reference &&
+             rec->u.databaseRecord->which == Z_External_sutrs)
+    {
+        Odr_oct *oct = rec->u.databaseRecord->u.sutrs;
+        mk_rec(w, REC_SUTRS, position, key, key_len, num_tags, tags,
+               rec->databaseName, rec->u.databaseRecord->direct_reference,
+               (const char *) oct->buf, oct->len);
+    }
+    else
+    {
+        encode = odr_createmem(ODR_ENCODE);
+        int len = 0;
+        char *buf = 0;
+        if (z_NamePlusRecord(encode, &rec, 0, 0))
+            buf = odr_getbuf(encode, &len, 0);
+        if (buf)
+            mk_rec(w, REC_BER, position, key, key_len, num_tags, tags,
+                   0, 0, buf, len);
+    }
+    long off = -1;
+    yaz_mutex_enter(m_p->mutex);
+    if (m_p->dir && wrbuf_len(w))
+    {
+        off = m_p->append(w);
+        if (off >= 0)
+        {
+            unsigned h = hash_key(key, key_len, position);
+            RecordCacheDisk_Entry *e = m_p->find(h, key, key_len, position);
+            if (e)
+                m_p->index_remove(e);
+            m_p->index_insert(h, position, m_p->active, off);
+        }
+    }
+    yaz_mutex_leave(m_p->mutex);
+    if (encode)
+        odr_destroy(encode);
+    wrbuf_destroy(w);
+    return off >= 0 ? 0 : -1;
+}
+#else
+int RecordCacheDisk::put(const char *, int, int, int, const char **,
+                         Z_NamePlusRecord *)
+{
+    return -1;
+}
+#endif
+
+int RecordCacheDisk::pin()
+{
+    int token = 0;
+#if DISK_TIER
+    yaz_mutex_enter(m_p->mutex);
+    if (m_p->dir)
+    {
+        RecordCacheDisk_Pin **pp = &m_p->pins;
+        while (*pp && (*pp)->epoch != m_p->epoch)
+            pp = &(*pp)->next;
+        if (!*pp)
+        {
+            *pp = new RecordCacheDisk_Pin;
+            (*pp)->epoch = m_p->epoch;
+            (*pp)->count = 0;
+            (*pp)->next = 0;
+        }
+        (*pp)->count++;
+        token = m_p->epoch;
+    }
+    yaz_mutex_leave(m_p->mutex);
+#endif
+    return token;
+}
+
+#if DISK_TIER
+void RecordCacheDisk::unpin(int token)
+{
+    yaz_mutex_enter(m_p->mutex);
+    RecordCacheDisk_Pin **pp = &m_p->pins;
+    while (*pp && (*pp)->epoch != token)
+        pp = &(*pp)->next;
+    if (*pp && --(*pp)->count == 0)
+    {
+        // retired segments are unmapped by the next compaction
+        RecordCacheDisk_Pin *pin = *pp;
+        *pp = pin->next;
+        delete pin;
+    }
+    yaz_mutex_leave(m_p->mutex);
+}
+#else
+void RecordCacheDisk::unpin(int)
+{
+}
+#endif
+
+#if DISK_TIER
+Z_NamePlusRecord *RecordCacheDisk::get(ODR o, const char *key, int key_len,
+                                       int position, int pinned)
+{
+    Z_NamePlusRecord *rec = 0;
+    yaz_mutex_enter(m_p->mutex);
+    RecordCacheDisk_Entry *e = 0;
+    RecordCacheDisk_Rec r;
+    if (m_p->dir)
+        e = m_p->find(hash_key(key, key_len, position), key, key_len,
+                      position);
+    if (e && parse_rec(e->seg->map, e->seg->size, e->offset, &r))
+    {
+        if (r.kind == REC_BER)
+        {
+            ODR decode = odr_createmem(ODR_DECODE);
+            odr_setbuf(decode, (char *) r.data, r.data_len, 0);
+            if (z_NamePlusRecord(decode, &rec, 0, 0))
+                nmem_transfer(o->mem, decode->mem);
+            else
+                rec = 0;
+            odr_destroy(decode);
+        }
+        else
+        {
+            // refer to the mapped segment if pinned; copy otherwise
+            int zero_copy = pinned && m_p->is_pinned(pinned);
+            unsigned i;
+            Odr_oct *oct;
+            if (zero_copy)
+            {
+                oct = (Odr_oct *) odr_malloc(o, sizeof(*oct));
+                oct->buf = (char *) r.data;
+                oct->len = r.data_len;
+            }
+            else
+                oct = odr_create_Odr_oct(o, r.data, r.data_len);
+            Z_External *ext = (Z_External *) odr_malloc(o, sizeof(*ext));
+            memset(ext, 0, sizeof(*ext));
+            ext->direct_reference = (Odr_oid *)
+                odr_malloc(o, (r.syntax_len + 1) * sizeof(Odr_oid));
+            for (i = 0; i < r.syntax_len; i++)
+                ext->direct_reference[i] =
+                    (Odr_oid) get_u32(r.syntax + 4 * i);
+            ext->direct_reference[i] = -1;
+            if (r.kind == REC_OCTET)
+            {
+                ext->which = Z_External_octet;
+                ext->u.octet_aligned = oct;
+            }
+            else
+            {
+                ext->which = Z_External_sutrs;
+                ext->u.sutrs = oct;
+            }
+            rec = (Z_NamePlusRecord *) odr_malloc(o, sizeof(*rec));
+            rec->databaseName = 0;
+            if (r.name_len)
+                rec->databaseName = zero_copy ? (char *) r.name :
+                    odr_strdup(o, r.name);
+            rec->which = Z_NamePlusRecord_databaseRecord;
+            rec->u.databaseRecord = ext;
+        }
+    }
+    yaz_mutex_leave(m_p->mutex);
+    return rec;
+}
+#else
+Z_NamePlusRecord *RecordCacheDisk::get(ODR, const char *, int, int, int)
+{
+    return 0;
+}
+#endif
+
+#if DISK_TIER
+void RecordCacheDisk::invalidate_tag(const char *tag)
+{
+    yaz_mutex_enter(m_p->mutex);
+    if (m_p->dir)
+    {
+        m_p->invalidate(tag);
+        // persist, so that the records stay invalid after a restart
+        WRBUF w = wrbuf_alloc();
+        mk_rec(w, REC_TOMBSTONE, 0, 0, 0, 1, &tag, 0, 0, 0, 0);
+        m_p->append(w);
+        wrbuf_destroy(w);
+    }
+    yaz_mutex_leave(m_p->mutex);
+}
+#else
+void RecordCacheDisk::invalidate_tag(const char *)
+{
+}
+#endif
+
+void RecordCacheDisk::clear()
+{
+#if DISK_TIER
+    yaz_mutex_enter(m_p->mutex);
+    if (m_p->dir)
+    {
+        while (m_p->segs)
+            m_p->drop_segment(m_p->segs);
+        m_p->new_active();
+    }
+    yaz_mutex_leave(m_p->mutex);
+#endif
+}
+
+void RecordCacheDisk::compact()
+{
+#if DISK_TIER
+    m_p->compact_segment();
+#endif
+}
+
+size_t RecordCacheDisk::get_disk_bytes()
+{
+    yaz_mutex_enter(m_p->mutex);
+    size_t total = m_p->total;
+    yaz_mutex_leave(m_p->mutex);
+    return total;
+}
+
+int RecordCacheDisk::get_num_records()
+{
+    yaz_mutex_enter(m_p->mutex);
+    int num = m_p->index.num_entries;
+    yaz_mutex_leave(m_p->mutex);
+    return num;
+}
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
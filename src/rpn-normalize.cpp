@@ -0,0 +1,375 @@
+/* This file is part of the yazpp toolkit.
+ * Copyright (C) Index Data 
+ * See the file LICENSE for details.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <yaz/oid_db.h>
+#include <yaz/xmalloc.h>
+#include <yazpp/rpn-normalize.h>
+
+using namespace yazpp_1;
+
+class RPN_Normalizer::Rep {
+    friend class RPN_Normalizer;
+    NMEM nmem;
+    Odr_oid *attribute_set;
+    int num_defaults;
+    int *default_type;
+    int *default_value;
+    bool normalize_terms;
+    bool is_default(Z_AttributeElement *el);
+    void normalize_apt(Z_AttributesPlusTerm *apt, Odr_oid *query_set,
+                       bool defaults);
+    Z_RPNStructure *normalize_structure(ODR o, Z_RPNStructure *s,
+                                        Odr_oid *query_set, bool defaults);
+};
+
+RPN_Normalizer::RPN_Normalizer()
+{
+    m_p = new Rep;
+    m_p->nmem = nmem_create();
+    m_p->attribute_set = odr_oiddup_nmem(m_p->nmem, yaz_oid_attset_bib_1);
+    m_p->num_defaults = 0;
+    m_p->default_type = 0;
+    m_p->default_value = 0;
+    m_p->normalize_terms = true;
+}
+
+RPN_Normalizer::~RPN_Normalizer()
+{
+    xfree(m_p->default_type);
+    xfree(m_p->default_value);
+    nmem_destroy(m_p->nmem);
+    delete m_p;
+}
+
+void RPN_Normalizer::set_attribute_set(const Odr_oid *oid)
+{
+    m_p->attribute_set = odr_oiddup_nmem(m_p->nmem, oid);
+}
+
+void RPN_Normalizer::add_default_attribute(int type, int value)
+{
+    int n = m_p->num_defaults + 1;
+    m_p->default_type = (int *) xrealloc(m_p->default_type,
+                                         n * sizeof(int));
+    m_p->default_value = (int *) xrealloc(m_p->default_value,
+                                          n * sizeof(int));
+    m_p->default_type[n - 1] = type;
+    m_p->default_value[n - 1] = value;
+    m_p->num_defaults = n;
+}
+
+void RPN_Normalizer::use_bib1_defaults()
+{
+    set_attribute_set(yaz_oid_attset_bib_1);
+    add_default_attribute(2, 3);
+    add_default_attribute(3, 3);
+    add_default_attribute(5, 100);
+    add_default_attribute(6, 1);
+}
+
+void RPN_Normalizer::set_normalize_terms(bool enable)
+{
+    m_p->normalize_terms = enable;
+}
+
+static int cmp_oid(const Odr_oid *a, const Odr_oid *b)
+{
+    if (!a || !b)
+        return (a ? 1 : 0) - (b ? 1 : 0);
+    return oid_oidcmp(a, b);
+}
+
+static int cmp_int(const Odr_int *a, const Odr_int *b)
+{
+    if (!a || !b)
+        return (a ? 1 : 0) - (b ? 1 : 0);
+    return *a < *b ? -1 : *a > *b ? 1 : 0;
+}
+
+static int cmp_str(const char *a, const char *b)
+{
+    if (!a || !b)
+        return (a ? 1 : 0) - (b ? 1 : 0);
+    return strcmp(a, b);
+}
+
+static int cmp_oct(const Odr_oct *a, const Odr_oct *b)
+{
+    if (!a || !b)
+        return (a ? 1 : 0) - (b ? 1 : 0);
+    if (a->len != b->len)
+        return a->len < b->len ? -1 : 1;
+    return a->len ? memcmp(a->buf, b->buf, a->len) : 0;
+}
+
+static int cmp_attr(const Z_AttributeElement *a, const Z_AttributeElement *b)
+{
+    int r = cmp_int(a->attributeType, b->attributeType);
+    if (r)
+        return r;
+    if (a->which != b->which)
+        return a->which - b->which;
+    if (a->which == Z_AttributeValue_numeric)
+        r = cmp_int(a->value.numeric, b->value.numeric);
+    else if (a->which == Z_AttributeValue_complex)
+    {
+        Z_ComplexAttribute *ca = a->value.complex;
+        Z_ComplexAttribute *cb = b->value.complex;
+        if (ca->num_list != cb->num_list)
+            return ca->num_list - cb->num_list;
+        int i;
+        for (i = 0; !r && i < ca->num_list; i++)
+        {
+            Z_StringOrNumeric *sa = ca->list[i];
+            Z_StringOrNumeric *sb = cb->list[i];
+            if (sa->which != sb->which)
+                return sa->which - sb->which;
+            if (sa->which == Z_StringOrNumeric_string)
+                r = cmp_str(sa->u.string, sb->u.string);
+            else
+                r = cmp_int(sa->u.numeric, sb->u.numeric);
+        }
+    }
+    if (r)
+        return r;
+    return cmp_oid(a->attributeSet, b->attributeSet);
+}
+
+static int cmp_attr_p(const void *a, const void *b)
+{
+    return cmp_attr(*(Z_AttributeElement * const *) a,
+                    *(Z_AttributeElement * const *) b);
+}
+
+static int cmp_attributes(const Z_AttributeList *a, const Z_AttributeList *b)
+{
+    int na = a ? a->num_attributes : 0;
+    int nb = b ? b->num_attributes : 0;
+    if (na != nb)
+        return na - nb;
+    int i, r = 0;
+    for (i = 0; !r && i < na; i++)
+        r = cmp_attr(a->attributes[i], b->attributes[i]);
+    return r;
+}
+
+/* Terms of types not listed compare equal; that only affects the
+   order of operands, never which queries are considered the same */
+static int cmp_term(const Z_Term *a, const Z_Term *b)
+{
+    if (a->which != b->which)
+        return a->which - b->which;
+    switch (a->which)
+    {
+    case Z_Term_general:
+        return cmp_oct(a->u.general, b->u.general);
+    case Z_Term_numeric:
+        return cmp_int(a->u.numeric, b->u.numeric);
+    case Z_Term_characterString:
+        return cmp_str(a->u.characterString, b->u.characterString);
+    case Z_Term_oid:
+        return cmp_oid(a->u.oid, b->u.oid);
+    }
+    return 0;
+}
+
+static int cmp_operand(const Z_Operand *a, const Z_Operand *b)
+{
+    if (a->which != b->which)
+        return a->which - b->which;
+    int r = 0;
+    switch (a->which)
+    {
+    case Z_Operand_APT:
+        r = cmp_attributes(a->u.attributesPlusTerm->attributes,
+                           b->u.attributesPlusTerm->attributes);
+        if (!r)
+            r = cmp_term(a->u.attributesPlusTerm->term,
+                         b->u.attributesPlusTerm->term);
+        break;
+    case Z_Operand_resultSetId:
+        r = cmp_str(a->u.resultSetId, b->u.resultSetId);
+        break;
+    case Z_Operand_resultAttr:
+        r = cmp_str(a->u.resultAttr->resultSet, b->u.resultAttr->resultSet);
+        if (!r)
+            r = cmp_attributes(a->u.resultAttr->attributes,
+                               b->u.resultAttr->attributes);
+        break;
+    }
+    return r;
+}
+
+static int cmp_rpn(const Z_RPNStructure *a, const Z_RPNStructure *b)
+{
+    if (a->which != b->which)
+        return a->which - b->which;
+    if (a->which == Z_RPNStructure_simple)
+        return cmp_operand(a->u.simple, b->u.simple);
+    int r = a->u.complex->roperator->which - b->u.complex->roperator->which;
+    if (!r)
+        r = cmp_rpn(a->u.complex->s1, b->u.complex->s1);
+    if (!r)
+        r = cmp_rpn(a->u.complex->s2, b->u.complex->s2);
+    return r;
+}
+
+static int cmp_rpn_p(const void *a, const void *b)
+{
+    return cmp_rpn(*(Z_RPNStructure * const *) a,
+                   *(Z_RPNStructure * const *) b);
+}
+
+// strip and collapse white space in place; returns new length
+static int normalize_space(char *buf, int len)
+{
+    int i, j = 0;
+    for (i = 0; i < len; i++)
+    {
+        if (buf[i] && strchr(" \t\r\n", buf[i]))
+        {
+            if (j > 0 && buf[j - 1] != ' ')
+                buf[j++] = ' ';
+        }
+        else
+            buf[j++] = buf[i];
+    }
+    if (j > 0 && buf[j - 1] == ' ')
+        j--;
+    return j;
+}
+
+bool RPN_Normalizer::Rep::is_default(Z_AttributeElement *el)
+{
+    if (el->attributeSet || el->which != Z_AttributeValue_numeric
+        || !el->attributeType || !el->value.numeric)
+        return false;
+    int i;
+    for (i = 0; i < num_defaults; i++)
+        if (*el->attributeType == default_type[i] &&
+            *el->value.numeric == default_value[i])
+            return true;
+    return false;
+}
+
+void RPN_Normalizer::Rep::normalize_apt(Z_AttributesPlusTerm *apt,
+                                        Odr_oid *query_set, bool defaults)
+{
+    Z_AttributeList *l = apt->attributes;
+    if (l && l->num_attributes > 0)
+    {
+        int i, j = 0;
+        for (i = 0; i < l->num_attributes; i++)
+        {
+            Z_AttributeElement *el = l->attributes[i];
+            // an explicit attribute set equal to the query's is implied
+            if (el->attributeSet && query_set &&
+                !oid_oidcmp(el->attributeSet, query_set))
+                el->attributeSet = 0;
+            if (!defaults || !is_default(el))
+                l->attributes[j++] = el;
+        }
+        l->num_attributes = j;
+        if (j > 1)
+            qsort(l->attributes, j, sizeof(*l->attributes), cmp_attr_p);
+    }
+    Z_Term *term = apt->term;
+    if (!normalize_terms || !term)
+        return;
+    if (term->which == Z_Term_general && term->u.general)
+        term->u.general->len = normalize_space(term->u.general->buf,
+                                               term->u.general->len);
+    else if (term->which == Z_Term_characterString &&
+             term->u.characterString)
+    {
+        char *cp = term->u.characterString;
+        cp[normalize_space(cp, strlen(cp))] = '\0';
+    }
+}
+
+// adds operands of the op tree rooted at s to list
+static void flatten(Z_RPNStructure *s, int op, Z_RPNStructure ***list,
+                    int *num, int *max)
+{
+    if (s->which == Z_RPNStructure_complex &&
+        s->u.complex->roperator->which == op)
+    {
+        flatten(s->u.complex->s1, op, list, num, max);
+        flatten(s->u.complex->s2, op, list, num, max);
+        return;
+    }
+    if (*num == *max)
+    {
+        *max = *max ? 2 * *max : 8;
+        *list = (Z_RPNStructure **) xrealloc(*list, *max * sizeof(**list));
+    }
+    (*list)[(*num)++] = s;
+}
+
+Z_RPNStructure *RPN_Normalizer::Rep::normalize_structure(
+    ODR o, Z_RPNStructure *s, Odr_oid *query_set, bool defaults)
+{
+    if (s->which == Z_RPNStructure_simple)
+    {
+        if (s->u.simple->which == Z_Operand_APT)
+            normalize_apt(s->u.simple->u.attributesPlusTerm, query_set,
+                          defaults);
+        return s;
+    }
+    Z_Operator *op = s->u.complex->roperator;
+    if (op->which != Z_Operator_and && op->which != Z_Operator_or)
+    {
+        s->u.complex->s1 = normalize_structure(o, s->u.complex->s1,
+                                               query_set, defaults);
+        s->u.complex->s2 = normalize_structure(o, s->u.complex->s2,
+                                               query_set, defaults);
+        return s;
+    }
+    // a AND (b AND c) is (a AND b) AND c; order of operands is immaterial
+    Z_RPNStructure **list = 0;
+    int i, num = 0, max = 0;
+    flatten(s, op->which, &list, &num, &max);
+    for (i = 0; i < num; i++)
+        list[i] = normalize_structure(o, list[i], query_set, defaults);
+    qsort(list, num, sizeof(*list), cmp_rpn_p);
+    s = list[0];
+    for (i = 1; i < num; i++)
+    {
+        Z_RPNStructure *n = (Z_RPNStructure *) odr_malloc(o, sizeof(*n));
+        n->which = Z_RPNStructure_complex;
+        n->u.complex = (Z_Complex *) odr_malloc(o, sizeof(Z_Complex));
+        n->u.complex->roperator = op;
+        n->u.complex->s1 = s;
+        n->u.complex->s2 = list[i];
+        s = n;
+    }
+    xfree(list);
+    return s;
+}
+
+void RPN_Normalizer::normalize(ODR o, Z_RPNQuery *q)
+{
+    if (!q || !q->RPNStructure)
+        return;
+    // defaults only known for the profile's attribute set
+    bool defaults = m_p->num_defaults > 0 &&
+        !cmp_oid(q->attributeSetId ? q->attributeSetId
+                 : yaz_oid_attset_bib_1, m_p->attribute_set);
+    q->RPNStructure = m_p->normalize_structure(o, q->RPNStructure,
+                                               q->attributeSetId, defaults);
+}
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
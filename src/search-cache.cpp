@@ -0,0 +1,356 @@
+/* This file is part of the yazpp toolkit.
+ * Copyright (C) Index Data 
+ * See the file LICENSE for details.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <string.h>
+#include <time.h>
+#include <yaz/log.h>
+#include <yaz/mutex.h>
+#include <yaz/wrbuf.h>
+#include <yaz/xmalloc.h>
+#include <yazpp/search-cache.h>
+#include "cache-table.h"
+
+// seconds between sweeps for expired entries done by add
+#define SWEEP_INTERVAL 10
+
+using namespace yazpp_1;
+
+/* Key is the query part made by cache_query_key followed by the
+   result set name (0-terminated). Entry, key and handle are allocated
+   in one block */
+struct SearchCache_Entry : CacheNode {
+    size_t size;
+    time_t expires;
+    Odr_int hits;
+    char *key;
+    int key_len;
+    char *handle;
+};
+
+class SearchCache::Rep {
+    friend class SearchCache;
+    YAZ_MUTEX mutex;
+    CacheTable table;
+    size_t resident;
+    size_t max_size;
+    int ttl;
+    time_t next_sweep;
+    long hits;
+    long misses;
+    long evictions;
+    long expirations;
+    RPN_Normalizer *normalizer;
+    SearchCache_Entry *find(unsigned hash, const char *key, int key_len);
+    void insert(SearchCache_Entry *entry);
+    void remove(SearchCache_Entry *entry);
+    void touch(SearchCache_Entry *entry);
+    SearchCache_Entry *lru_head();
+    SearchCache_Entry *lru_tail();
+    void sweep(time_t now);
+    void clear();
+};
+
+// Returns 0 if query can not be encoded
+static int mk_key(WRBUF w, Z_Query *query, int num_db, const char **db,
+                  const char *setname, RPN_Normalizer *normalizer)
+{
+    wrbuf_rewind(w);
+    if (!cache_query_key(w, query, num_db, db, normalizer))
+        return 0;
+    if (setname)
+        wrbuf_puts(w, setname);
+    wrbuf_putc(w, '\0');
+    return 1;
+}
+
+SearchCache_Entry *SearchCache::Rep::find(unsigned hash, const char *key,
+                                          int key_len)
+{
+    SearchCache_Entry *entry =
+        static_cast<SearchCache_Entry *>(table.chain(hash));
+    for (; entry; entry = static_cast<SearchCache_Entry *>(entry->next))
+        if (entry->hash == hash && entry->key_len == key_len &&
+            !memcmp(entry->key, key, key_len))
+            break;
+    return entry;
+}
+
+void SearchCache::Rep::insert(SearchCache_Entry *entry)
+{
+    table.insert(entry);
+    resident += entry->size;
+}
+
+void SearchCache::Rep::remove(SearchCache_Entry *entry)
+{
+    table.remove(entry);
+    resident -= entry->size;
+    xfree(entry);
+}
+
+void SearchCache::Rep::touch(SearchCache_Entry *entry)
+{
+    table.touch(entry);
+}
+
+SearchCache_Entry *SearchCache::Rep::lru_head()
+{
+    return static_cast<SearchCache_Entry *>(table.lru_head);
+}
+
+SearchCache_Entry *SearchCache::Rep::lru_tail()
+{
+    return static_cast<SearchCache_Entry *>(table.lru_tail);
+}
+
+void SearchCache::Rep::sweep(time_t now)
+{
+    SearchCache_Entry *entry = lru_head();
+    while (entry)
+    {
+        SearchCache_Entry *entry_next =
+            static_cast<SearchCache_Entry *>(entry->lru_next);
+        if (entry->expires <= now)
+        {
+            remove(entry);
+            expirations++;
+        }
+        entry = entry_next;
+    }
+    next_sweep = now + SWEEP_INTERVAL;
+}
+
+void SearchCache::Rep::clear()
+{
+    while (lru_head())
+        remove(lru_head());
+    table.destroy();
+}
+
+SearchCache::SearchCache()
+{
+    m_p = new Rep;
+    m_p->mutex = 0;
+    yaz_mutex_create(&m_p->mutex);
+    m_p->table.init();
+    m_p->resident = 0;
+    m_p->max_size = 1000000;
+    m_p->ttl = 60;
+    m_p->next_sweep = 0;
+    m_p->hits = 0;
+    m_p->misses = 0;
+    m_p->evictions = 0;
+    m_p->expirations = 0;
+    m_p->normalizer = 0;
+}
+
+SearchCache::~SearchCache()
+{
+    m_p->clear();
+    yaz_mutex_destroy(&m_p->mutex);
+    delete m_p;
+}
+
+void SearchCache::set_ttl(int seconds)
+{
+    yaz_mutex_enter(m_p->mutex);
+    m_p->ttl = seconds > 0 ? seconds : 0;
+    yaz_mutex_leave(m_p->mutex);
+}
+
+void SearchCache::set_normalizer(RPN_Normalizer *normalizer)
+{
+    m_p->normalizer = normalizer;
+}
+
+void SearchCache::set_max_size(size_t sz)
+{
+    yaz_mutex_enter(m_p->mutex);
+    m_p->max_size = sz;
+    while (m_p->resident > m_p->max_size)
+    {
+        m_p->remove(m_p->lru_tail());
+        m_p->evictions++;
+    }
+    yaz_mutex_leave(m_p->mutex);
+}
+
+void SearchCache::add(Z_Query *query, int num_db, const char **db,
+                      const char *setname, Odr_int hits, const char *handle)
+{
+    WRBUF key = wrbuf_alloc();
+    if (mk_key(key, query, num_db, db, setname, m_p->normalizer))
+    {
+        int key_len = wrbuf_len(key);
+        int handle_len = handle ? strlen(handle) + 1 : 0;
+        size_t size = sizeof(SearchCache_Entry) + key_len + handle_len;
+        SearchCache_Entry *entry = (SearchCache_Entry *) xmalloc(size);
+        entry->size = size;
+        entry->key = (char *) (entry + 1);
+        entry->key_len = key_len;
+        memcpy(entry->key, wrbuf_buf(key), key_len);
+        entry->handle = 0;
+        if (handle)
+        {
+            entry->handle = entry->key + key_len;
+            memcpy(entry->handle, handle, handle_len);
+        }
+        entry->hash = cache_hash_bytes(CACHE_HASH_INIT, entry->key, key_len);
+        entry->hits = hits;
+
+        time_t now = time(0);
+        yaz_mutex_enter(m_p->mutex);
+        entry->expires = now + m_p->ttl;
+        if (now >= m_p->next_sweep)
+            m_p->sweep(now);
+        if (!m_p->ttl || size > m_p->max_size)
+            xfree(entry);
+        else
+        {
+            SearchCache_Entry *old = m_p->find(entry->hash, entry->key,
+                                               key_len);
+            if (old)
+                m_p->remove(old);
+            while (m_p->resident + size > m_p->max_size)
+            {
+                m_p->remove(m_p->lru_tail());
+                m_p->evictions++;
+            }
+            m_p->insert(entry);
+        }
+        yaz_mutex_leave(m_p->mutex);
+    }
+    wrbuf_destroy(key);
+}
+
+int SearchCache::lookup(ODR o, Z_Query *query, int num_db, const char **db,
+                        const char *setname, Odr_int *hits, char **handle)
+{
+    WRBUF key = wrbuf_alloc();
+    int r = 0;
+    if (mk_key(key, query, num_db, db, setname, m_p->normalizer))
+    {
+        unsigned h = cache_hash_bytes(CACHE_HASH_INIT, wrbuf_buf(key),
+                                      wrbuf_len(key));
+        yaz_mutex_enter(m_p->mutex);
+        SearchCache_Entry *entry = m_p->find(h, wrbuf_buf(key),
+                                             wrbuf_len(key));
+        if (entry && entry->expires <= time(0))
+        {
+            m_p->remove(entry);
+            m_p->expirations++;
+            entry = 0;
+        }
+        if (entry)
+        {
+            *hits = entry->hits;
+            *handle = entry->handle ? odr_strdup(o, entry->handle) : 0;
+            m_p->touch(entry);
+            m_p->hits++;
+            r = 1;
+        }
+        else
+            m_p->misses++;
+        yaz_mutex_leave(m_p->mutex);
+    }
+    wrbuf_destroy(key);
+    return r;
+}
+
+void SearchCache::invalidate_database(const char *db)
+{
+    yaz_mutex_enter(m_p->mutex);
+    SearchCache_Entry *entry = m_p->lru_head();
+    while (entry)
+    {
+        SearchCache_Entry *entry_next =
+            static_cast<SearchCache_Entry *>(entry->lru_next);
+        if (cache_key_has_database(entry->key, db))
+            m_p->remove(entry);
+        entry = entry_next;
+    }
+    yaz_mutex_leave(m_p->mutex);
+}
+
+void SearchCache::invalidate_handle(const char *handle)
+{
+    yaz_mutex_enter(m_p->mutex);
+    SearchCache_Entry *entry = m_p->lru_head();
+    while (entry)
+    {
+        SearchCache_Entry *entry_next =
+            static_cast<SearchCache_Entry *>(entry->lru_next);
+        if (entry->handle && !strcmp(entry->handle, handle))
+            m_p->remove(entry);
+        entry = entry_next;
+    }
+    yaz_mutex_leave(m_p->mutex);
+}
+
+void SearchCache::clear()
+{
+    yaz_mutex_enter(m_p->mutex);
+    m_p->clear();
+    yaz_mutex_leave(m_p->mutex);
+}
+
+size_t SearchCache::get_resident_bytes()
+{
+    yaz_mutex_enter(m_p->mutex);
+    size_t v = m_p->resident;
+    yaz_mutex_leave(m_p->mutex);
+    return v;
+}
+
+int SearchCache::get_num_entries()
+{
+    yaz_mutex_enter(m_p->mutex);
+    int v = m_p->table.num_entries;
+    yaz_mutex_leave(m_p->mutex);
+    return v;
+}
+
+long SearchCache::get_hits()
+{
+    yaz_mutex_enter(m_p->mutex);
+    long v = m_p->hits;
+    yaz_mutex_leave(m_p->mutex);
+    return v;
+}
+
+long SearchCache::get_misses()
+{
+    yaz_mutex_enter(m_p->mutex);
+    long v = m_p->misses;
+    yaz_mutex_leave(m_p->mutex);
+    return v;
+}
+
+long SearchCache::get_evictions()
+{
+    yaz_mutex_enter(m_p->mutex);
+    long v = m_p->evictions;
+    yaz_mutex_leave(m_p->mutex);
+    return v;
+}
+
+long SearchCache::get_expirations()
+{
+    yaz_mutex_enter(m_p->mutex);
+    long v = m_p->expirations;
+    yaz_mutex_leave(m_p->mutex);
+    return v;
+}
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
@@ -0,0 +1,573 @@
+/* This file is part of the yazpp toolkit.
+ * Copyright (C) Index Data 
+ * See the file LICENSE for details.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+#ifdef WIN32
+#include <windows.h>
+#endif
+#include <string.h>
+#include <yaz/log.h>
+#include <yaz/mutex.h>
+#include <yaz/wrbuf.h>
+#include <yaz/xmalloc.h>
+#include <yaz/copy_types.h>
+#include <yazpp/shared-record-cache.h>
+#include <yazpp/record-cache-disk.h>
+#include "cache-table.h"
+
+using namespace yazpp_1;
+
+#ifdef WIN32
+#define atomic_add(p, v) InterlockedExchangeAdd((p), (v))
+typedef LONG atomic_int;
+#else
+#define atomic_add(p, v) __sync_fetch_and_add((p), (v))
+typedef int atomic_int;
+#endif
+#define atomic_read(p) atomic_add((p), 0)
+
+/* Key of an entry is the query part made by cache_query_key followed
+   by the BER encoded record composition (length first) and the record
+   syntax - plus the result set position, which is kept separately */
+struct SharedRecordCache_Entry : CacheNode {
+    NMEM nmem;                // holds this entry, its key and record
+    size_t size;
+    int position;
+    const char *key;
+    int key_len;
+    Z_NamePlusRecord *record;
+    int invalidations;        // Rep::invalidations when evicted
+    SharedRecordCache_Entry *spill_next;
+};
+
+/* Disk tier and the number of threads using it. set_disk_tier drops
+   the reference of the cache; the last user deletes it */
+struct SharedRecordCache_Disk {
+    RecordCacheDisk store;
+    int refcount;
+};
+
+struct SharedRecordCache_Shard {
+    YAZ_MUTEX mutex;
+    CacheTable table;
+    size_t resident;
+    size_t max_size;
+    long hits;
+    long misses;
+    long evictions;
+    long disk_hits;
+    volatile atomic_int *invalidations;
+    SharedRecordCache_Entry *find(unsigned hash, const char *key,
+                                  int key_len, int position);
+    void insert(SharedRecordCache_Entry *entry);
+    void remove(SharedRecordCache_Entry *entry);
+    void touch(SharedRecordCache_Entry *entry);
+    void evict(SharedRecordCache_Entry **spill);
+    void clear();
+};
+
+/* Disk I/O is done without holding a shard mutex: evicted entries are
+   unlinked under it and written by spill afterwards */
+class SharedRecordCache::Rep {
+    friend class SharedRecordCache;
+    int num_shards;
+    SharedRecordCache_Shard *shards;
+    YAZ_MUTEX mutex;              // protects disk
+    SharedRecordCache_Disk *disk;
+    YAZ_MUTEX spill_mutex;        // orders spills and invalidations
+    volatile atomic_int invalidations;
+    RPN_Normalizer *normalizer;
+    SharedRecordCache_Shard *get_shard(unsigned hash);
+    SharedRecordCache_Disk *get_disk();
+    void release_disk(SharedRecordCache_Disk *d);
+    void spill(SharedRecordCache_Entry *list);
+};
+
+// all of the key but the syntax. Returns 0 if query can not be encoded
+static int mk_key_base(WRBUF w, Z_Query *query, int num_db, const char **db,
+                       Z_RecordComposition *comp, RPN_Normalizer *normalizer)
+{
+    wrbuf_rewind(w);
+    if (!cache_query_key(w, query, num_db, db, normalizer))
+        return 0;
+    ODR encode = odr_createmem(ODR_ENCODE);
+    int len = 0;
+    char *buf = 0;
+    if (comp && z_RecordComposition(encode, &comp, 0, 0))
+        buf = odr_getbuf(encode, &len, 0);
+    cache_put_int(w, len);
+    if (len)
+        wrbuf_write(w, buf, len);
+    odr_destroy(encode);
+    return 1;
+}
+
+static void put_syntax(WRBUF w, const Odr_oid *syntax)
+{
+    for (; *syntax != -1; syntax++)
+        cache_put_int(w, *syntax);
+}
+
+SharedRecordCache_Entry *SharedRecordCache_Shard::find(
+    unsigned hash, const char *key, int key_len, int position)
+{
+    SharedRecordCache_Entry *entry =
+        static_cast<SharedRecordCache_Entry *>(table.chain(hash));
+    for (; entry; entry = static_cast<SharedRecordCache_Entry *>(entry->next))
+        if (entry->hash == hash && entry->position == position &&
+            entry->key_len == key_len && !memcmp(entry->key, key, key_len))
+            break;
+    return entry;
+}
+
+void SharedRecordCache_Shard::insert(SharedRecordCache_Entry *entry)
+{
+    table.insert(entry);
+    resident += entry->size;
+}
+
+void SharedRecordCache_Shard::remove(SharedRecordCache_Entry *entry)
+{
+    table.remove(entry);
+    resident -= entry->size;
+    nmem_destroy(entry->nmem);
+}
+
+void SharedRecordCache_Shard::touch(SharedRecordCache_Entry *entry)
+{
+    table.touch(entry);
+}
+
+// store entry in disk tier, tagged with the database names of its key
+// so that invalidate_database reaches it there too
+static void put_disk(RecordCacheDisk *disk, SharedRecordCache_Entry *entry)
+{
+    int i, num_db = cache_get_int(entry->key);
+    const char **tags = (const char **)
+        nmem_malloc(entry->nmem, (num_db + 1) * sizeof(*tags));
+    const char *cp = entry->key + 4;
+    for (i = 0; i < num_db; i++)
+    {
+        tags[i] = cp;
+        cp += strlen(cp) + 1;
+    }
+    disk->put(entry->key, entry->key_len, entry->position,
+              num_db, tags, entry->record);
+}
+
+// unlink least recently used entry and add it to spill
+void SharedRecordCache_Shard::evict(SharedRecordCache_Entry **spill)
+{
+    SharedRecordCache_Entry *entry =
+        static_cast<SharedRecordCache_Entry *>(table.lru_tail);
+    table.remove(entry);
+    resident -= entry->size;
+    entry->invalidations = atomic_read(invalidations);
+    entry->spill_next = *spill;
+    *spill = entry;
+    evictions++;
+}
+
+void SharedRecordCache_Shard::clear()
+{
+    while (table.lru_head)
+        remove(static_cast<SharedRecordCache_Entry *>(table.lru_head));
+    table.destroy();
+}
+
+SharedRecordCache_Shard *SharedRecordCache::Rep::get_shard(unsigned hash)
+{
+    // bucket index uses the low bits
+    return shards + (hash >> 16) % num_shards;
+}
+
+// disk tier with a reference for the caller; 0 if none
+SharedRecordCache_Disk *SharedRecordCache::Rep::get_disk()
+{
+    yaz_mutex_enter(mutex);
+    SharedRecordCache_Disk *d = disk;
+    if (d)
+        d->refcount++;
+    yaz_mutex_leave(mutex);
+    return d;
+}
+
+void SharedRecordCache::Rep::release_disk(SharedRecordCache_Disk *d)
+{
+    if (d)
+    {
+        yaz_mutex_enter(mutex);
+        int refcount = --d->refcount;
+        yaz_mutex_leave(mutex);
+        if (!refcount)
+            delete d;
+    }
+}
+
+/* Write evicted entries to the disk tier, if any, and free them. An
+   entry is skipped if invalidate_database or clear ran since it was
+   evicted, as it could be stale. The check and the write are made under
+   spill_mutex, which those hold while they invalidate the disk tier */
+void SharedRecordCache::Rep::spill(SharedRecordCache_Entry *list)
+{
+    SharedRecordCache_Disk *d = list ? get_disk() : 0;
+    if (d)
+        yaz_mutex_enter(spill_mutex);
+    while (list)
+    {
+        SharedRecordCache_Entry *entry = list;
+        list = entry->spill_next;
+        if (d && entry->invalidations == atomic_read(&invalidations))
+            put_disk(&d->store, entry);
+        nmem_destroy(entry->nmem);
+    }
+    if (d)
+        yaz_mutex_leave(spill_mutex);
+    release_disk(d);
+}
+
+SharedRecordCache::SharedRecordCache(int num_shards)
+{
+    int i;
+    m_p = new Rep;
+    m_p->num_shards = num_shards > 0 ? num_shards : 1;
+    m_p->shards = new SharedRecordCache_Shard[m_p->num_shards];
+    for (i = 0; i < m_p->num_shards; i++)
+    {
+        SharedRecordCache_Shard *s = m_p->shards + i;
+        s->mutex = 0;
+        yaz_mutex_create(&s->mutex);
+        s->table.init();
+        s->resident = 0;
+        s->hits = 0;
+        s->misses = 0;
+        s->evictions = 0;
+        s->disk_hits = 0;
+        s->invalidations = &m_p->invalidations;
+    }
+    m_p->mutex = 0;
+    yaz_mutex_create(&m_p->mutex);
+    m_p->disk = 0;
+    m_p->spill_mutex = 0;
+    yaz_mutex_create(&m_p->spill_mutex);
+    m_p->invalidations = 0;
+    m_p->normalizer = 0;
+    set_max_size(10000000);
+}
+
+SharedRecordCache::~SharedRecordCache()
+{
+    int i;
+    for (i = 0; i < m_p->num_shards; i++)
+    {
+        m_p->shards[i].clear();
+        yaz_mutex_destroy(&m_p->shards[i].mutex);
+    }
+    delete [] m_p->shards;
+    m_p->release_disk(m_p->disk);
+    yaz_mutex_destroy(&m_p->spill_mutex);
+    yaz_mutex_destroy(&m_p->mutex);
+    delete m_p;
+}
+
+void SharedRecordCache::set_max_size(size_t sz)
+{
+    int i;
+    for (i = 0; i < m_p->num_shards; i++)
+    {
+        SharedRecordCache_Shard *s = m_p->shards + i;
+        SharedRecordCache_Entry *spill = 0;
+        yaz_mutex_enter(s->mutex);
+        s->max_size = sz / m_p->num_shards;
+        while (s->resident > s->max_size)
+            s->evict(&spill);
+        yaz_mutex_leave(s->mutex);
+        m_p->spill(spill);
+    }
+}
+
+void SharedRecordCache::set_normalizer(RPN_Normalizer *normalizer)
+{
+    m_p->normalizer = normalizer;
+}
+
+void SharedRecordCache::add(Z_Query *query, int num_db, const char **db,
+                            Z_NamePlusRecordList *npr, int start,
+                            Z_RecordComposition *comp)
+{
+    WRBUF base = wrbuf_alloc();
+    WRBUF key = wrbuf_alloc();
+    SharedRecordCache_Entry *spill = 0;
+    int i;
+
+    if (mk_key_base(base, query, num_db, db, comp, m_p->normalizer))
+    {
+        for (i = 0; i < npr->num_records; i++)
+        {
+            Z_NamePlusRecord *rec = npr->records[i];
+            if (rec->which != Z_NamePlusRecord_databaseRecord ||
+                !rec->u.databaseRecord->direct_reference)
+                continue;
+            wrbuf_rewind(key);
+            wrbuf_write(key, wrbuf_buf(base), wrbuf_len(base));
+            put_syntax(key, rec->u.databaseRecord->direct_reference);
+
+            NMEM nmem = nmem_create();
+            SharedRecordCache_Entry *entry = (SharedRecordCache_Entry *)
+                nmem_malloc(nmem, sizeof(*entry));
+            entry->nmem = nmem;
+            entry->key_len = wrbuf_len(key);
+            char *cp = (char *) nmem_malloc(nmem, entry->key_len);
+            memcpy(cp, wrbuf_buf(key), entry->key_len);
+            entry->key = cp;
+            entry->position = start + i;
+            entry->hash = cache_hash_int(
+                cache_hash_bytes(CACHE_HASH_INIT, entry->key, entry->key_len),
+                entry->position);
+            entry->record = yaz_clone_z_NamePlusRecord(rec, nmem);
+            entry->size = nmem_total(nmem);
+
+            SharedRecordCache_Shard *s = m_p->get_shard(entry->hash);
+            yaz_mutex_enter(s->mutex);
+            if (entry->size > s->max_size)
+            {
+                // too big for memory; straight to disk
+                entry->invalidations = atomic_read(&m_p->invalidations);
+                entry->spill_next = spill;
+                spill = entry;
+            }
+            else
+            {
+                SharedRecordCache_Entry *old = s->find(
+                    entry->hash, entry->key, entry->key_len, entry->position);
+                if (old)
+                    s->remove(old);
+                while (s->resident + entry->size > s->max_size)
+                    s->evict(&spill);
+                s->insert(entry);
+            }
+            yaz_mutex_leave(s->mutex);
+        }
+    }
+    m_p->spill(spill);
+    wrbuf_destroy(key);
+    wrbuf_destroy(base);
+}
+
+int SharedRecordCache::lookup(ODR o, Z_NamePlusRecordList **npr,
+                              Z_Query *query, int num_db, const char **db,
+                              int start, int num,
+                              Odr_oid *syntax, Z_RecordComposition *comp)
+{
+    WRBUF key = wrbuf_alloc();
+    SharedRecordCache_Disk *d = 0;
+    int i, r = 0;
+
+    if (syntax && num > 0 && mk_key_base(key, query, num_db, db, comp,
+                                         m_p->normalizer))
+    {
+        put_syntax(key, syntax);
+        unsigned key_hash = cache_hash_bytes(CACHE_HASH_INIT,
+                                             wrbuf_buf(key), wrbuf_len(key));
+        *npr = (Z_NamePlusRecordList *) odr_malloc(o, sizeof(**npr));
+        (*npr)->num_records = num;
+        (*npr)->records = (Z_NamePlusRecord **)
+            odr_malloc(o, num * sizeof(Z_NamePlusRecord *));
+        r = 1;
+        for (i = 0; i < num; i++)
+        {
+            unsigned h = cache_hash_int(key_hash, start + i);
+            SharedRecordCache_Shard *s = m_p->get_shard(h);
+            yaz_mutex_enter(s->mutex);
+            SharedRecordCache_Entry *entry =
+                s->find(h, wrbuf_buf(key), wrbuf_len(key), start + i);
+            (*npr)->records[i] = 0;
+            if (entry)
+            {
+                // copy as the entry may be evicted once we leave
+                (*npr)->records[i] =
+                    yaz_clone_z_NamePlusRecord(entry->record, o->mem);
+                s->touch(entry);
+                s->hits++;
+            }
+            yaz_mutex_leave(s->mutex);
+            if (!entry)
+            {
+                // disk tier is read without holding the shard mutex
+                if (!d)
+                    d = m_p->get_disk();
+                if (d)
+                    (*npr)->records[i] = d->store.get(
+                        o, wrbuf_buf(key), wrbuf_len(key), start + i);
+                yaz_mutex_enter(s->mutex);
+                if ((*npr)->records[i])
+                    s->disk_hits++;
+                else
+                    s->misses++;
+                yaz_mutex_leave(s->mutex);
+            }
+            if (!(*npr)->records[i])
+            {
+                r = 0;
+                break;
+            }
+        }
+    }
+    m_p->release_disk(d);
+    wrbuf_destroy(key);
+    return r;
+}
+
+void SharedRecordCache::invalidate_database(const char *db)
+{
+    int i;
+    for (i = 0; i < m_p->num_shards; i++)
+    {
+        SharedRecordCache_Shard *s = m_p->shards + i;
+        yaz_mutex_enter(s->mutex);
+        SharedRecordCache_Entry *entry =
+            static_cast<SharedRecordCache_Entry *>(s->table.lru_head);
+        while (entry)
+        {
+            SharedRecordCache_Entry *entry_next =
+                static_cast<SharedRecordCache_Entry *>(entry->lru_next);
+            if (cache_key_has_database(entry->key, db))
+                s->remove(entry);
+            entry = entry_next;
+        }
+        yaz_mutex_leave(s->mutex);
+    }
+    SharedRecordCache_Disk *d = m_p->get_disk();
+    yaz_mutex_enter(m_p->spill_mutex);
+    atomic_add(&m_p->invalidations, 1);
+    if (d)
+        d->store.invalidate_tag(db);
+    yaz_mutex_leave(m_p->spill_mutex);
+    m_p->release_disk(d);
+}
+
+void SharedRecordCache::clear()
+{
+    int i;
+    for (i = 0; i < m_p->num_shards; i++)
+    {
+        SharedRecordCache_Shard *s = m_p->shards + i;
+        yaz_mutex_enter(s->mutex);
+        s->clear();
+        yaz_mutex_leave(s->mutex);
+    }
+    SharedRecordCache_Disk *d = m_p->get_disk();
+    yaz_mutex_enter(m_p->spill_mutex);
+    atomic_add(&m_p->invalidations, 1);
+    if (d)
+        d->store.clear();
+    yaz_mutex_leave(m_p->spill_mutex);
+    m_p->release_disk(d);
+}
+
+int SharedRecordCache::set_disk_tier(const char *dir, size_t max_size)
+{
+    SharedRecordCache_Disk *d = 0;
+    if (dir)
+    {
+        d = new SharedRecordCache_Disk;
+        d->refcount = 1;
+        if (d->store.open(dir, max_size))
+        {
+            delete d;
+            return -1;
+        }
+    }
+    yaz_mutex_enter(m_p->mutex);
+    SharedRecordCache_Disk *old = m_p->disk;
+    m_p->disk = d;
+    yaz_mutex_leave(m_p->mutex);
+    // deleted here unless other threads still use it
+    m_p->release_disk(old);
+    return 0;
+}
+
+RecordCacheDisk *SharedRecordCache::get_disk_tier()
+{
+    yaz_mutex_enter(m_p->mutex);
+    RecordCacheDisk *disk = m_p->disk ? &m_p->disk->store : 0;
+    yaz_mutex_leave(m_p->mutex);
+    return disk;
+}
+
+size_t SharedRecordCache::get_resident_bytes()
+{
+    size_t sum = 0;
+    int i;
+    for (i = 0; i < m_p->num_shards; i++)
+    {
+        yaz_mutex_enter(m_p->shards[i].mutex);
+        sum += m_p->shards[i].resident;
+        yaz_mutex_leave(m_p->shards[i].mutex);
+    }
+    return sum;
+}
+
+long SharedRecordCache::get_hits()
+{
+    long sum = 0;
+    int i;
+    for (i = 0; i < m_p->num_shards; i++)
+    {
+        yaz_mutex_enter(m_p->shards[i].mutex);
+        sum += m_p->shards[i].hits;
+        yaz_mutex_leave(m_p->shards[i].mutex);
+    }
+    return sum;
+}
+
+long SharedRecordCache::get_misses()
+{
+    long sum = 0;
+    int i;
+    for (i = 0; i < m_p->num_shards; i++)
+    {
+        yaz_mutex_enter(m_p->shards[i].mutex);
+        sum += m_p->shards[i].misses;
+        yaz_mutex_leave(m_p->shards[i].mutex);
+    }
+    return sum;
+}
+
+long SharedRecordCache::get_disk_hits()
+{
+    long sum = 0;
+    int i;
+    for (i = 0; i < m_p->num_shards; i++)
+    {
+        yaz_mutex_enter(m_p->shards[i].mutex);
+        sum += m_p->shards[i].disk_hits;
+        yaz_mutex_leave(m_p->shards[i].mutex);
+    }
+    return sum;
+}
+
+long SharedRecordCache::get_evictions()
+{
+    long sum = 0;
+    int i;
+    for (i = 0; i < m_p->num_shards; i++)
+    {
+        yaz_mutex_enter(m_p->shards[i].mutex);
+        sum += m_p->shards[i].evictions;
+        yaz_mutex_leave(m_p->shards[i].mutex);
+    }
+    return sum;
+}
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
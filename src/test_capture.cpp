@@ -0,0 +1,147 @@
+/* This file is part of the yazpp toolkit.
+ * Copyright (C) Index Data 
+ * See the file LICENSE for details.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#if HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <yazpp/apdu-capture.h>
+#include <yaz/thread_create.h>
+#include <yaz/test.h>
+#include <yaz/log.h>
+
+using namespace yazpp_1;
+
+static void tst1(void)
+{
+    const char *fname = "test_capture.cap";
+    remove(fname);
+
+    APDUCapture w;
+    YAZ_CHECK_EQ(w.open_write(fname), 0);
+    YAZ_CHECK_EQ(w.write(1, APDUCapture::RECV, "abc", 3), 0);
+    YAZ_CHECK_EQ(w.write(2, APDUCapture::SEND, "", 0), 0);
+    w.close();
+
+    // appending to an existing file must not repeat the file header
+    YAZ_CHECK_EQ(w.open_write(fname), 0);
+    YAZ_CHECK_EQ(w.write(1, APDUCapture::SEND, "defg", 4), 0);
+    w.close();
+
+    APDUCapture r;
+    unsigned session;
+    int direction, len;
+    struct timeval tv;
+    const char *buf;
+    YAZ_CHECK_EQ(r.open_read(fname), 0);
+
+    YAZ_CHECK_EQ(r.read(&session, &direction, &tv, &buf, &len), 1);
+    YAZ_CHECK_EQ(session, 1);
+    YAZ_CHECK_EQ(direction, APDUCapture::RECV);
+    YAZ_CHECK(len == 3 && !memcmp(buf, "abc", 3));
+
+    YAZ_CHECK_EQ(r.read(&session, &direction, &tv, &buf, &len), 1);
+    YAZ_CHECK_EQ(session, 2);
+    YAZ_CHECK_EQ(len, 0);
+
+    YAZ_CHECK_EQ(r.read(&session, &direction, &tv, &buf, &len), 1);
+    YAZ_CHECK_EQ(session, 1);
+    YAZ_CHECK_EQ(direction, APDUCapture::SEND);
+    YAZ_CHECK(len == 4 && !memcmp(buf, "defg", 4));
+
+    YAZ_CHECK_EQ(r.read(&session, &direction, &tv, &buf, &len), 0);
+    r.close();
+    remove(fname);
+}
+
+#if YAZ_POSIX_THREADS
+#define MT_WRITERS 4
+#define MT_RECORDS 200
+#define MT_LEN 9000
+
+static const char *mt_fname = "test_capture_mt.cap";
+
+// each writer has its own APDUCapture, as sessions have
+static void *mt_write(void *p)
+{
+    unsigned id = *(unsigned *) p;
+    char buf[MT_LEN];
+    APDUCapture w;
+    int i;
+    memset(buf, 'a' + id, sizeof(buf));
+    if (w.open_write(mt_fname))
+        return 0;
+    for (i = 0; i < MT_RECORDS; i++)
+        w.write(id, APDUCapture::RECV, buf, MT_LEN - i);
+    return 0;
+}
+
+static void tst_threads(void)
+{
+    unsigned ids[MT_WRITERS];
+    yaz_thread_t t[MT_WRITERS];
+    int i, count[MT_WRITERS], whole = 1;
+
+    remove(mt_fname);
+    for (i = 0; i < MT_WRITERS; i++)
+    {
+        ids[i] = i;
+        count[i] = 0;
+        t[i] = yaz_thread_create(mt_write, ids + i);
+    }
+    for (i = 0; i < MT_WRITERS; i++)
+        yaz_thread_join(t + i, 0);
+
+    APDUCapture r;
+    unsigned session;
+    int direction, len;
+    struct timeval tv;
+    const char *buf;
+    YAZ_CHECK_EQ(r.open_read(mt_fname), 0);
+    while (r.read(&session, &direction, &tv, &buf, &len) == 1)
+    {
+        if (session >= MT_WRITERS)
+        {
+            whole = 0;
+            break;
+        }
+        // records come out whole and in order per writer
+        if (len != MT_LEN - count[session])
+            whole = 0;
+        for (i = 0; i < len; i++)
+            if (buf[i] != (char) ('a' + session))
+                whole = 0;
+        count[session]++;
+    }
+    YAZ_CHECK(whole);
+    for (i = 0; i < MT_WRITERS; i++)
+        YAZ_CHECK_EQ(count[i], MT_RECORDS);
+    r.close();
+    remove(mt_fname);
+}
+#endif
+
+int main(int argc, char **argv)
+{
+    YAZ_CHECK_INIT(argc, argv);
+    tst1();
+#if YAZ_POSIX_THREADS
+    tst_threads();
+#endif
+    YAZ_CHECK_TERM;
+}
+
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
@@ -0,0 +1,347 @@
+/* This file is part of the yazpp toolkit.
+ * Copyright (C) Index Data 
+ * See the file LICENSE for details.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <yazpp/cql2rpn.h>
+#include <yaz/diagsrw.h>
+#include <yaz/querytowrbuf.h>
+#include <yaz/thread_create.h>
+#include <yaz/test.h>
+
+using namespace yazpp_1;
+
+static const char *properties =
+    "set = info:srw/cql-context-set/1/cql-v1.2\n"
+    "set.cql = info:srw/cql-context-set/1/cql-v1.2\n"
+    "set.dc = info:srw/cql-context-set/1/dc-v1.1\n"
+    "index.cql.serverChoice = 1=1016\n"
+    "index.cql.anywhere = 1=1016\n"
+    "index.dc.date = 1=30\n"
+    "relation.< = 2=1\n"
+    "relation.<= = 2=2\n"
+    "relation.eq = 2=3\n"
+    "relation.= = 2=3\n"
+    "relation.>= = 2=4\n"
+    "relation.> = 2=5\n"
+    "relation.<> = 2=6\n"
+    "relation.all = 2=3\n"
+    "relation.any = 2=3\n"
+    "relation.scr = 2=3\n"
+    "relation.exact = 2=3\n"
+    "position.first = 3=1 6=1\n"
+    "position.any = 3=3 6=1\n"
+    "position.last = 3=4 6=1\n"
+    "position.firstAndLast = 3=3 6=3\n"
+    "structure.exact = 4=108\n"
+    "structure.all = 4=2\n"
+    "structure.any = 4=2\n"
+    "structure.* = 4=1\n"
+    "truncation.right = 5=1\n"
+    "truncation.left = 5=2\n"
+    "truncation.both = 5=3\n"
+    "truncation.none = 5=100\n"
+    "truncation.z3958 = 5=104\n";
+
+static int write_properties(const char *fname, const char *title_attr)
+{
+    FILE *f = fopen(fname, "w");
+    if (!f)
+        return 0;
+    fputs(properties, f);
+    fprintf(f, "index.dc.title = %s\n", title_attr);
+    fclose(f);
+    return 1;
+}
+
+static void rpn_str(WRBUF w, Odr_oid *attributeSetId, Z_RPNStructure *s)
+{
+    Z_RPNQuery q;
+    q.attributeSetId = attributeSetId;
+    q.RPNStructure = s;
+    wrbuf_rewind(w);
+    yaz_rpnquery_to_wrbuf(w, &q);
+}
+
+// is s @attr 1=index @attr 7=relation term
+/* with index 0 the use attribute must be the number use */
+static int check_sort_key(Z_RPNStructure *s, const char *index,
+                          int relation, const char *term, int use = 0)
+{
+    if (s->which != Z_RPNStructure_simple ||
+        s->u.simple->which != Z_Operand_APT)
+        return 0;
+    Z_AttributesPlusTerm *apt = s->u.simple->u.attributesPlusTerm;
+    if (apt->attributes->num_attributes != 2)
+        return 0;
+    Z_AttributeElement *el = apt->attributes->attributes[0];
+    if (*el->attributeType != 1)
+        return 0;
+    if (!index)
+    {
+        if (el->which != Z_AttributeValue_numeric ||
+            *el->value.numeric != use)
+            return 0;
+    }
+    else if (el->which != Z_AttributeValue_complex ||
+             el->value.complex->num_list != 1 ||
+             el->value.complex->list[0]->which != Z_StringOrNumeric_string ||
+             strcmp(el->value.complex->list[0]->u.string, index))
+        return 0;
+    el = apt->attributes->attributes[1];
+    if (*el->attributeType != 7 || el->which != Z_AttributeValue_numeric ||
+        *el->value.numeric != relation)
+        return 0;
+    return apt->term->which == Z_Term_general &&
+        apt->term->u.general->len == (int) strlen(term) &&
+        !memcmp(apt->term->u.general->buf, term, strlen(term));
+}
+
+static void tst_transform(void)
+{
+    const char *fname = "test_cql2rpn.properties";
+    YAZ_CHECK(write_properties(fname, "1=4"));
+
+    ODR odr = odr_createmem(ODR_ENCODE);
+    Yaz_cql2rpn cql2rpn;
+    Z_RPNQuery *q = 0, *q_sort = 0;
+    char *addinfo = 0;
+    int i;
+
+    YAZ_CHECK_EQ(cql2rpn.query_transform("dc.title=house", &q, odr,
+                                         &addinfo), -3);
+    cql2rpn.set_pqf_file(fname);
+    YAZ_CHECK_EQ(cql2rpn.query_transform("dc.title=house", &q, odr,
+                                         &addinfo), 0);
+    YAZ_CHECK_EQ(cql2rpn.query_transform(
+                     "dc.title=house sortby dc.title/sort.descending dc.date",
+                     &q_sort, odr, &addinfo), 0);
+    if (q && q_sort)
+    {
+        // @or @or query key0 key1
+        Z_RPNStructure *s = q_sort->RPNStructure;
+        YAZ_CHECK(s->which == Z_RPNStructure_complex &&
+                  s->u.complex->roperator->which == Z_Operator_or);
+        YAZ_CHECK(check_sort_key(s->u.complex->s2, "dc.date", 1, "1"));
+        s = s->u.complex->s1;
+        YAZ_CHECK(s->which == Z_RPNStructure_complex &&
+                  s->u.complex->roperator->which == Z_Operator_or);
+        YAZ_CHECK(check_sort_key(s->u.complex->s2, "dc.title", 2, "0"));
+
+        WRBUF w1 = wrbuf_alloc();
+        WRBUF w2 = wrbuf_alloc();
+        rpn_str(w1, q->attributeSetId, q->RPNStructure);
+        rpn_str(w2, q_sort->attributeSetId, s->u.complex->s1);
+        YAZ_CHECK(!strcmp(wrbuf_cstr(w1), wrbuf_cstr(w2)));
+        wrbuf_destroy(w1);
+        wrbuf_destroy(w2);
+    }
+    // numeric index gives a numeric use attribute, as in PQF
+    YAZ_CHECK_EQ(cql2rpn.query_transform("dc.title=house sortby 4",
+                                         &q_sort, odr, &addinfo), 0);
+    if (q_sort)
+    {
+        Z_RPNStructure *s = q_sort->RPNStructure;
+        YAZ_CHECK(s->which == Z_RPNStructure_complex &&
+                  check_sort_key(s->u.complex->s2, 0, 1, "0", 4));
+    }
+    YAZ_CHECK_EQ(cql2rpn.query_transform("dc.title=house sortby dc.title/x",
+                                         &q, odr, &addinfo),
+                 YAZ_SRW_UNSUPP_SORT_TYPE);
+    YAZ_CHECK(addinfo);
+    YAZ_CHECK_EQ(cql2rpn.query_transform("dc.title=", &q, odr, &addinfo),
+                 YAZ_SRW_QUERY_SYNTAX_ERROR);
+
+    // parsers are reused between calls
+    int no_ok = 0;
+    for (i = 0; i < 100; i++)
+    {
+        odr_reset(odr);
+        q = 0;
+        if (!cql2rpn.query_transform("dc.title=house", &q, odr, &addinfo)
+            && q)
+            no_ok++;
+    }
+    YAZ_CHECK_EQ(no_ok, 100);
+    YAZ_CHECK_EQ(cql2rpn.get_cache_entries(), 0);
+
+    // memoized translations
+    cql2rpn.set_cache_size(2);
+    const char *queries[] = {
+        "dc.title=house", "dc.title=house sortby dc.date", "dc.title=", 0
+    };
+    WRBUF w_miss[3];
+    for (i = 0; queries[i]; i++)
+    {
+        w_miss[i] = wrbuf_alloc();
+        q = 0;
+        if (!cql2rpn.query_transform(queries[i], &q, odr, &addinfo) && q)
+            rpn_str(w_miss[i], q->attributeSetId, q->RPNStructure);
+    }
+    YAZ_CHECK_EQ(cql2rpn.get_cache_misses(), 3);
+    YAZ_CHECK_EQ(cql2rpn.get_cache_entries(), 2);
+    for (i = 1; queries[i]; i++)
+    {
+        WRBUF w = wrbuf_alloc();
+        odr_reset(odr);
+        q = 0;
+        int r = cql2rpn.query_transform(queries[i], &q, odr, &addinfo);
+        if (i == 2)
+            YAZ_CHECK_EQ(r, YAZ_SRW_QUERY_SYNTAX_ERROR);
+        else if (!r && q)
+        {
+            rpn_str(w, q->attributeSetId, q->RPNStructure);
+            YAZ_CHECK(!strcmp(wrbuf_cstr(w), wrbuf_cstr(w_miss[i])));
+        }
+        wrbuf_destroy(w);
+    }
+    YAZ_CHECK_EQ(cql2rpn.get_cache_hits(), 2);
+    // first query was least recently used and is gone
+    q = 0;
+    YAZ_CHECK_EQ(cql2rpn.query_transform(queries[0], &q, odr, &addinfo), 0);
+    YAZ_CHECK_EQ(cql2rpn.get_cache_misses(), 4);
+    for (i = 0; queries[i]; i++)
+        wrbuf_destroy(w_miss[i]);
+
+    cql2rpn.set_cache_size(0);
+    YAZ_CHECK_EQ(cql2rpn.get_cache_entries(), 0);
+    odr_destroy(odr);
+    remove(fname);
+}
+
+#define MT_THREADS 4
+#define MT_QUERIES 200
+
+struct mt_arg {
+    Yaz_cql2rpn *cql2rpn;
+    int no_ok;
+};
+
+static void *mt_query(void *p)
+{
+    mt_arg *arg = (mt_arg *) p;
+    ODR odr = odr_createmem(ODR_ENCODE);
+    int i;
+    for (i = 0; i < MT_QUERIES; i++)
+    {
+        Z_RPNQuery *q = 0;
+        char *addinfo = 0;
+        odr_reset(odr);
+        if (!arg->cql2rpn->query_transform(
+                i & 1 ? "dc.title=house" : "dc.title=boat and dc.date=2000",
+                &q, odr, &addinfo) && q)
+            arg->no_ok++;
+    }
+    odr_destroy(odr);
+    return 0;
+}
+
+static void tst_reload(void)
+{
+    const char *fname1 = "test_cql2rpn.properties";
+    const char *fname2 = "test_cql2rpn_2.properties";
+    YAZ_CHECK(write_properties(fname1, "1=4"));
+    YAZ_CHECK(write_properties(fname2, "1=5"));
+
+    Yaz_cql2rpn cql2rpn;
+    int error;
+    YAZ_CHECK(cql2rpn.parse_spec_file(fname1, &error));
+    YAZ_CHECK_EQ(cql2rpn.reload_if_modified(), 0);
+    cql2rpn.set_cache_size(10);
+
+    // one object shared by several threads while the mapping is replaced
+    mt_arg args[MT_THREADS];
+    yaz_thread_t t[MT_THREADS];
+    int i;
+    for (i = 0; i < MT_THREADS; i++)
+    {
+        args[i].cql2rpn = &cql2rpn;
+        args[i].no_ok = 0;
+        t[i] = yaz_thread_create(mt_query, args + i);
+    }
+    for (i = 0; i < 20; i++)
+        YAZ_CHECK(cql2rpn.parse_spec_file(i & 1 ? fname1 : fname2, &error));
+    for (i = 0; i < MT_THREADS; i++)
+    {
+        yaz_thread_join(t + i, 0);
+        YAZ_CHECK_EQ(args[i].no_ok, MT_QUERIES);
+    }
+
+    // last one read was fname1; a failed reload keeps it
+    YAZ_CHECK(!cql2rpn.parse_spec_file("test_cql2rpn_none.properties",
+                                       &error));
+    ODR odr = odr_createmem(ODR_ENCODE);
+    Z_RPNQuery *q = 0;
+    char *addinfo = 0;
+    WRBUF w = wrbuf_alloc();
+    YAZ_CHECK_EQ(cql2rpn.query_transform("dc.title=house", &q, odr,
+                                         &addinfo), 0);
+    if (q)
+    {
+        rpn_str(w, q->attributeSetId, q->RPNStructure);
+        YAZ_CHECK(strstr(wrbuf_cstr(w), "1=4"));
+    }
+    // and cached translations of the old mapping are not used
+    YAZ_CHECK(cql2rpn.parse_spec_file(fname2, &error));
+    YAZ_CHECK_EQ(cql2rpn.get_cache_entries(), 0);
+    q = 0;
+    YAZ_CHECK_EQ(cql2rpn.query_transform("dc.title=house", &q, odr,
+                                         &addinfo), 0);
+    if (q)
+    {
+        rpn_str(w, q->attributeSetId, q->RPNStructure);
+        YAZ_CHECK(strstr(wrbuf_cstr(w), "1=5"));
+    }
+
+#if HAVE_UNISTD_H
+    // background reload picks up the changed file
+    YAZ_CHECK(cql2rpn.parse_spec_file(fname1, &error));
+    cql2rpn.set_reload_interval(1);
+    sleep(1);  // so that the modification time differs
+    YAZ_CHECK(write_properties(fname1, "1=6"));
+    bool reloaded = false;
+    for (i = 0; i < 5 && !reloaded; i++)
+    {
+        sleep(1);
+        q = 0;
+        odr_reset(odr);
+        if (!cql2rpn.query_transform("dc.title=house", &q, odr, &addinfo)
+            && q)
+        {
+            rpn_str(w, q->attributeSetId, q->RPNStructure);
+            reloaded = strstr(wrbuf_cstr(w), "1=6") != 0;
+        }
+    }
+    YAZ_CHECK(reloaded);
+    cql2rpn.set_reload_interval(0);
+#endif
+    wrbuf_destroy(w);
+    odr_destroy(odr);
+    remove(fname1);
+    remove(fname2);
+}
+
+int main(int argc, char **argv)
+{
+    YAZ_CHECK_INIT(argc, argv);
+    tst_transform();
+    tst_reload();
+    YAZ_CHECK_TERM;
+}
+
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
@@ -31,10 +31,81 @@ static void tst1(void)
     odr_destroy(odr);
 }
 
+static void tst2(void)
+{
+    ODR odr = odr_createmem(ODR_ENCODE);
+    Z_APDU *apdu = zget_APDU(odr, Z_APDU_presentRequest);
+    *apdu->u.presentRequest->resultSetStartPoint = 11;
+    Z_GDU *gdu_req = (Z_GDU *) odr_malloc(odr, sizeof(*gdu_req));
+    gdu_req->which = Z_GDU_Z3950;
+    gdu_req->u.z3950 = apdu;
+    YAZ_CHECK(z_GDU(odr, &gdu_req, 0, 0));
+    int len;
+    char *buf = odr_getbuf(odr, &len, 0);
+
+    // decoded tree adopted by GDU must not refer to the wire buffer
+    ODR decode = odr_createmem(ODR_DECODE);
+    Z_GDU *gdu_dec = 0;
+    odr_setbuf(decode, buf, len, 0);
+    YAZ_CHECK(z_GDU(decode, &gdu_dec, 0, 0));
+    GDU *a = new GDU(decode, gdu_dec, len);
+    odr_destroy(odr);
+
+    YAZ_CHECK(a->get() == gdu_dec);
+    YAZ_CHECK_EQ(a->get_size(), len);
+    YAZ_CHECK_EQ(*a->get()->u.z3950->u.presentRequest->resultSetStartPoint,
+                 11);
+
+    ODR dst = odr_createmem(ODR_DECODE);
+    Z_GDU *moved;
+    a->move_away_gdu(dst, &moved);
+    delete a;
+    YAZ_CHECK(moved == gdu_dec);
+    YAZ_CHECK_EQ(*moved->u.z3950->u.presentRequest->resultSetStartPoint, 11);
+    odr_destroy(dst);
+}
+
+static void tst3(void)
+{
+    ODR odr = odr_createmem(ODR_ENCODE);
+    Z_APDU *apdu = zget_APDU(odr, Z_APDU_presentRequest);
+    *apdu->u.presentRequest->resultSetStartPoint = 7;
+
+    GDU a(apdu);
+    odr_destroy(odr);
+    YAZ_CHECK(a.get() && a.get()->u.z3950 != apdu);
+    YAZ_CHECK(a.get_size() > 0);
+
+    // copies share the PDU
+    GDU b(a);
+    GDU c;
+    c = b;
+    YAZ_CHECK(b.get() == a.get());
+    YAZ_CHECK(c.get() == a.get());
+    YAZ_CHECK_EQ(c.get_size(), a.get_size());
+
+    // moving away a shared PDU leaves the other copies intact
+    ODR dst = odr_createmem(ODR_DECODE);
+    Z_GDU *moved;
+    c.move_away_gdu(dst, &moved);
+    YAZ_CHECK(c.get() == 0);
+    YAZ_CHECK(moved && moved != a.get());
+    YAZ_CHECK_EQ(*moved->u.z3950->u.presentRequest->resultSetStartPoint, 7);
+    YAZ_CHECK_EQ(*a.get()->u.z3950->u.presentRequest->resultSetStartPoint, 7);
+    odr_destroy(dst);
+
+    b = GDU();
+    YAZ_CHECK(b.get() == 0);
+    YAZ_CHECK_EQ(b.get_size(), 0);
+    YAZ_CHECK(a.get() != 0);
+}
+
 int main(int argc, char **argv)
 {
     YAZ_CHECK_INIT(argc, argv);
     tst1();
+    tst2();
+    tst3();
     YAZ_CHECK_TERM;
 }
 
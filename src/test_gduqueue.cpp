@@ -0,0 +1,261 @@
+/* This file is part of the yazpp toolkit.
+ * Copyright (C) Index Data 
+ * See the file LICENSE for details.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <yazpp/gdu.h>
+#include <yazpp/gduqueue.h>
+#include <yazpp/gduqueue-mt.h>
+#include <yaz/thread_create.h>
+#include <yaz/test.h>
+#include <yaz/log.h>
+
+using namespace yazpp_1;
+
+static GDU *mk_present(int start)
+{
+    ODR odr = odr_createmem(ODR_ENCODE);
+    Z_APDU *apdu = zget_APDU(odr, Z_APDU_presentRequest);
+    *apdu->u.presentRequest->resultSetStartPoint = start;
+    GDU *gdu = new GDU(apdu);
+    odr_destroy(odr);
+    return gdu;
+}
+
+static int get_start(GDU *gdu)
+{
+    return *gdu->get()->u.z3950->u.presentRequest->resultSetStartPoint;
+}
+
+static void tst_fifo(void)
+{
+    GDUQueue q;
+    int i;
+
+    YAZ_CHECK_EQ(q.size(), 0);
+    YAZ_CHECK(q.dequeue() == 0);
+    // interleave so that the ring wraps and grows
+    for (i = 1; i <= 100; i++)
+    {
+        YAZ_CHECK_EQ(q.enqueue(mk_present(i)), 0);
+        if (i % 3 == 0)
+        {
+            GDU *g = q.dequeue();
+            YAZ_CHECK_EQ(get_start(g), i / 3);
+            delete g;
+        }
+    }
+    YAZ_CHECK_EQ(q.size(), 67);
+    for (i = 34; i <= 100; i++)
+    {
+        GDU *g = q.dequeue();
+        YAZ_CHECK(g && get_start(g) == i);
+        delete g;
+    }
+    YAZ_CHECK_EQ(q.size(), 0);
+    YAZ_CHECK_EQ(q.get_bytes(), 0);
+    q.enqueue(mk_present(1));
+    q.enqueue(mk_present(2));
+    // destructor deletes the remaining ones
+}
+
+static void tst_limits(void)
+{
+    GDUQueue q;
+    GDU *g1 = mk_present(1);
+    int len = g1->get_size();
+
+    q.set_max_items(2);
+    YAZ_CHECK_EQ(q.enqueue(g1), 0);
+    YAZ_CHECK_EQ(q.get_bytes(), len);
+    YAZ_CHECK_EQ(q.enqueue(mk_present(2)), 0);
+    GDU *g3 = mk_present(3);
+    YAZ_CHECK_EQ(q.enqueue(g3), -1);
+    YAZ_CHECK_EQ(q.size(), 2);
+
+    q.set_max_items(0);
+    q.set_max_bytes(3 * len);
+    YAZ_CHECK_EQ(q.enqueue(g3), 0);
+    GDU *g4 = mk_present(4);
+    YAZ_CHECK_EQ(q.enqueue(g4), -1);
+    YAZ_CHECK_EQ(q.get_bytes(), 3 * len);
+
+    delete q.dequeue();
+    YAZ_CHECK_EQ(q.get_bytes(), 2 * len);
+    YAZ_CHECK_EQ(q.enqueue(g4), 0);
+    q.clear();
+    YAZ_CHECK_EQ(q.size(), 0);
+    YAZ_CHECK_EQ(q.get_bytes(), 0);
+}
+
+static GDU *mk_close(void)
+{
+    ODR odr = odr_createmem(ODR_ENCODE);
+    GDU *gdu = new GDU(zget_APDU(odr, Z_APDU_close));
+    odr_destroy(odr);
+    return gdu;
+}
+
+static int get_type(GDU *gdu)
+{
+    return gdu->get()->u.z3950->which;
+}
+
+static void tst_priority(void)
+{
+    GDUQueue q;
+    GDU *g;
+    int i;
+
+    // FIFO until priorities are configured
+    q.enqueue(mk_present(1));
+    q.enqueue(mk_close());
+    g = q.dequeue();
+    YAZ_CHECK_EQ(get_type(g), Z_APDU_presentRequest);
+    delete g;
+    q.clear();
+
+    q.set_default_priorities();
+    YAZ_CHECK_EQ(q.set_priority(Z_APDU_presentRequest, 3), -1);
+    YAZ_CHECK_EQ(q.set_priority(Z_APDU_presentRequest,
+                                GDUQueue::PRIORITY_LOW), 0);
+    for (i = 1; i <= 5; i++)
+        q.enqueue(mk_present(i));
+    q.enqueue(mk_close());
+    g = q.dequeue();
+    YAZ_CHECK_EQ(get_type(g), Z_APDU_close);
+    delete g;
+    for (i = 1; i <= 5; i++)
+    {
+        g = q.dequeue();
+        YAZ_CHECK(g && get_start(g) == i);
+        delete g;
+    }
+
+    // starvation protection
+    q.set_starvation_limit(2);
+    q.enqueue(mk_present(1));
+    for (i = 0; i < 4; i++)
+        q.enqueue(mk_close());
+    int seq[5];
+    for (i = 0; i < 5; i++)
+    {
+        g = q.dequeue();
+        seq[i] = get_type(g);
+        delete g;
+    }
+    YAZ_CHECK_EQ(seq[0], Z_APDU_close);
+    YAZ_CHECK_EQ(seq[1], Z_APDU_close);
+    YAZ_CHECK_EQ(seq[2], Z_APDU_presentRequest);
+    YAZ_CHECK_EQ(seq[3], Z_APDU_close);
+    YAZ_CHECK_EQ(q.size(), 0);
+}
+
+static void tst_mt_single(void)
+{
+    GDUQueueMT q;
+    GDU *batch[10];
+    int i;
+
+    YAZ_CHECK(q.dequeue() == 0);
+    YAZ_CHECK_EQ(q.wait(0), 0);
+    for (i = 1; i <= 25; i++)
+        q.enqueue(mk_present(i));
+    YAZ_CHECK_EQ(q.size(), 25);
+    YAZ_CHECK_EQ(q.wait(-1), 1);
+    GDU *g = q.dequeue();
+    YAZ_CHECK(g && get_start(g) == 1);
+    delete g;
+    YAZ_CHECK_EQ(q.dequeue_batch(batch, 10), 10);
+    for (i = 0; i < 10; i++)
+    {
+        YAZ_CHECK_EQ(get_start(batch[i]), i + 2);
+        delete batch[i];
+    }
+    YAZ_CHECK_EQ(q.size(), 14);
+    q.wakeup();
+    // remaining ones deleted by destructor
+}
+
+#if YAZ_POSIX_THREADS
+#define MT_PRODUCERS 4
+#define MT_ITEMS 500
+
+struct mt_producer {
+    GDUQueueMT *q;
+    int id;
+};
+
+static void *mt_produce(void *p)
+{
+    struct mt_producer *m = (struct mt_producer *) p;
+    int i;
+    for (i = 0; i < MT_ITEMS; i++)
+        m->q->enqueue(mk_present(m->id * MT_ITEMS + i));
+    return 0;
+}
+
+static void tst_mt_threads(void)
+{
+    GDUQueueMT q;
+    struct mt_producer p[MT_PRODUCERS];
+    yaz_thread_t t[MT_PRODUCERS];
+    int last[MT_PRODUCERS];
+    int i, got = 0, order_ok = 1;
+
+    for (i = 0; i < MT_PRODUCERS; i++)
+    {
+        p[i].q = &q;
+        p[i].id = i;
+        last[i] = -1;
+        t[i] = yaz_thread_create(mt_produce, p + i);
+    }
+    while (got < MT_PRODUCERS * MT_ITEMS && q.wait(5000))
+    {
+        GDU *batch[16];
+        int n = q.dequeue_batch(batch, 16);
+        for (i = 0; i < n; i++)
+        {
+            int v = get_start(batch[i]);
+            int id = v / MT_ITEMS;
+            // FIFO per producer
+            if (v % MT_ITEMS != last[id] + 1)
+                order_ok = 0;
+            last[id] = v % MT_ITEMS;
+            delete batch[i];
+        }
+        got += n;
+    }
+    for (i = 0; i < MT_PRODUCERS; i++)
+        yaz_thread_join(t + i, 0);
+    YAZ_CHECK_EQ(got, MT_PRODUCERS * MT_ITEMS);
+    YAZ_CHECK(order_ok);
+    YAZ_CHECK_EQ(q.size(), 0);
+}
+#endif
+
+int main(int argc, char **argv)
+{
+    YAZ_CHECK_INIT(argc, argv);
+    tst_fifo();
+    tst_limits();
+    tst_priority();
+    tst_mt_single();
+#if YAZ_POSIX_THREADS
+    tst_mt_threads();
+#endif
+    YAZ_CHECK_TERM;
+}
+
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
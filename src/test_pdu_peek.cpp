@@ -0,0 +1,80 @@
+/* This file is part of the yazpp toolkit.
+ * Copyright (C) Index Data 
+ * See the file LICENSE for details.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <yazpp/pdu-peek.h>
+#include <yaz/proto.h>
+#include <yaz/pquery.h>
+#include <yaz/test.h>
+#include <yaz/log.h>
+
+using namespace yazpp_1;
+
+static void tst1(void)
+{
+    ODR odr = odr_createmem(ODR_ENCODE);
+    Z_APDU *apdu = zget_APDU(odr, Z_APDU_searchRequest);
+    Z_SearchRequest *req = apdu->u.searchRequest;
+    PDU_Peek peek;
+    const char *cp;
+    int len;
+
+    req->referenceId = odr_create_Odr_oct(odr, "ref", 3);
+    req->num_databaseNames = 2;
+    req->databaseNames = (char **) odr_malloc(odr, 2 * sizeof(char *));
+    req->databaseNames[0] = odr_strdup(odr, "Default");
+    req->databaseNames[1] = odr_strdup(odr, "x");
+    req->query = (Z_Query *) odr_malloc(odr, sizeof(*req->query));
+    req->query->which = Z_Query_type_1;
+    req->query->u.type_1 = p_query_rpn(odr, "@and a b");
+    YAZ_CHECK(z_APDU(odr, &apdu, 0, 0));
+    char *buf = odr_getbuf(odr, &len, 0);
+
+    YAZ_CHECK_EQ(peek.parse(buf, len), 1);
+    YAZ_CHECK_EQ(peek.get_type(), Z_APDU_searchRequest);
+    cp = peek.get_referenceId(&len);
+    YAZ_CHECK(cp && len == 3 && !memcmp(cp, "ref", 3));
+    YAZ_CHECK_EQ(peek.get_num_databaseNames(), 2);
+    cp = peek.get_databaseName(0, &len);
+    YAZ_CHECK(cp && len == 7 && !memcmp(cp, "Default", 7));
+    cp = peek.get_databaseName(1, &len);
+    YAZ_CHECK(cp && len == 1 && *cp == 'x');
+
+    odr_getbuf(odr, &len, 0);
+    YAZ_CHECK_EQ(peek.parse(buf, len - 1), -1);
+
+    odr_reset(odr);
+    apdu = zget_APDU(odr, Z_APDU_close);
+    YAZ_CHECK(z_APDU(odr, &apdu, 0, 0));
+    buf = odr_getbuf(odr, &len, 0);
+    YAZ_CHECK_EQ(peek.parse(buf, len), 1);
+    YAZ_CHECK_EQ(peek.get_type(), Z_APDU_close);
+    YAZ_CHECK(!peek.get_referenceId(&len));
+    YAZ_CHECK_EQ(peek.get_num_databaseNames(), 0);
+
+    YAZ_CHECK_EQ(peek.parse("GET / HTTP/1.1\r\n\r\n", 18), 0);
+
+    odr_destroy(odr);
+}
+
+int main(int argc, char **argv)
+{
+    YAZ_CHECK_INIT(argc, argv);
+    tst1();
+    YAZ_CHECK_TERM;
+}
+
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
@@ -8,6 +8,8 @@
 #endif
 #include <stdlib.h>
 #include <yazpp/z-query.h>
+#include <yazpp/rpn-normalize.h>
+#include <yaz/pquery.h>
 #include <yaz/test.h>
 #include <yaz/log.h>
 
@@ -35,12 +37,105 @@ int tst1(const char *query_str_in, const char *query_expected)
     return 1;
 }
 
+void tst_hash()
+{
+    Yaz_Z_Query q1, q2, q3;
+
+    q1 = "@and a b";
+    q2 = "@and a b";
+    q3 = "@and b a";
+    YAZ_CHECK(q1.get_hash());
+    YAZ_CHECK(q1.get_hash() == q2.get_hash());
+    YAZ_CHECK(q1.get_hash() != q3.get_hash());
+    YAZ_CHECK(q1.match(&q2));
+    YAZ_CHECK(!q1.match(&q3));
+
+    // decoded once
+    Z_Query *z = q1.get_Z_Query();
+    YAZ_CHECK(z);
+    YAZ_CHECK(z == q1.get_Z_Query());
+
+    // type-101 is the same query as type-1
+    ODR odr = odr_createmem(ODR_ENCODE);
+    Z_Query *z101 = (Z_Query *) odr_malloc(odr, sizeof(*z101));
+    z101->which = Z_Query_type_101;
+    z101->u.type_101 = p_query_rpn(odr, "@and a b");
+    q3.set_Z_Query(z101);
+    YAZ_CHECK(q3.get_Z_Query()->which == Z_Query_type_101);
+    YAZ_CHECK(q1.match(&q3));
+    YAZ_CHECK(q1.get_hash() == q3.get_hash());
+    odr_destroy(odr);
+
+    q3 = q2;
+    YAZ_CHECK(q3.match(&q1));
+
+    // setting our own decoded query
+    q3.set_Z_Query(q3.get_Z_Query());
+    YAZ_CHECK(q3.get_Z_Query());
+    YAZ_CHECK(q3.match(&q1));
+    Yaz_Z_Query q4;
+    YAZ_CHECK(q4.get_hash() == 0);
+    YAZ_CHECK(!q4.match(&q1));
+}
+
+void tst_normalize()
+{
+    RPN_Normalizer normalizer;
+    normalizer.add_default_attribute(2, 3);
+
+    Yaz_Z_Query q1, q2, q3, q4;
+    q1 = "@and @attr 2=3 @attr 1=4 \" b  c \" @and a @or y x";
+    q2 = "@and @and @or x y @attr 1=4 \"b c\" a";
+    YAZ_CHECK(!q1.match(&q2));
+    YAZ_CHECK_EQ(q1.normalize(&normalizer), 0);
+    YAZ_CHECK_EQ(q2.normalize(&normalizer), 0);
+    YAZ_CHECK(q1.match(&q2));
+    YAZ_CHECK(q1.get_hash() == q2.get_hash());
+
+    // normal form is stable
+    q3 = q1;
+    YAZ_CHECK_EQ(q3.normalize(&normalizer), 0);
+    YAZ_CHECK(q3.match(&q1));
+
+    // AND NOT is not commutative
+    q3 = "@not a b";
+    q4 = "@not b a";
+    YAZ_CHECK_EQ(q3.normalize(&normalizer), 0);
+    YAZ_CHECK_EQ(q4.normalize(&normalizer), 0);
+    YAZ_CHECK(!q3.match(&q4));
+
+    // defaults are for Bib-1 only
+    q3 = "@attrset gils @attr 2=3 a";
+    q4 = "@attrset gils a";
+    YAZ_CHECK_EQ(q3.normalize(&normalizer), 0);
+    YAZ_CHECK_EQ(q4.normalize(&normalizer), 0);
+    YAZ_CHECK(!q3.match(&q4));
+
+    Yaz_Z_Query q5;
+    YAZ_CHECK_EQ(q5.normalize(&normalizer), -1);
+
+    RPN_Normalizer bib1;
+    bib1.use_bib1_defaults();
+    q3 = "@attr 2=3 @attr 3=3 @attr 5=100 @attr 6=1 @attr 1=4 a";
+    q4 = "@attr 1=4 a";
+    YAZ_CHECK_EQ(q3.normalize(&bib1), 0);
+    YAZ_CHECK_EQ(q4.normalize(&bib1), 0);
+    YAZ_CHECK(q3.match(&q4));
+    q3 = "@attr 5=1 a";
+    q4 = "a";
+    YAZ_CHECK_EQ(q3.normalize(&bib1), 0);
+    YAZ_CHECK_EQ(q4.normalize(&bib1), 0);
+    YAZ_CHECK(!q3.match(&q4));
+}
+
 int main(int argc, char **argv)
 {
     YAZ_CHECK_INIT(argc, argv);
     YAZ_CHECK(tst1("", ""));
     YAZ_CHECK(tst1("x", "RPN @attrset Bib-1 x"));
     YAZ_CHECK(tst1("@and a b", "RPN @attrset Bib-1 @and a b"));
+    tst_hash();
+    tst_normalize();
     YAZ_CHECK_TERM;
 }
 
@@ -0,0 +1,671 @@
+/* This file is part of the yazpp toolkit.
+ * Copyright (C) Index Data 
+ * See the file LICENSE for details.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <yazpp/record-cache.h>
+#include <yazpp/shared-record-cache.h>
+#include <yazpp/record-cache-disk.h>
+#include <yaz/proto.h>
+#include <yaz/oid_db.h>
+#include <yaz/test.h>
+#include <yaz/log.h>
+
+using namespace yazpp_1;
+
+static Z_NamePlusRecordList *mk_records(ODR odr, int start, int num,
+                                        const Odr_oid *syntax)
+{
+    Z_NamePlusRecordList *npr = (Z_NamePlusRecordList *)
+        odr_malloc(odr, sizeof(*npr));
+    npr->num_records = num;
+    npr->records = (Z_NamePlusRecord **)
+        odr_malloc(odr, num * sizeof(*npr->records));
+    int i;
+    for (i = 0; i < num; i++)
+    {
+        char rec[40];
+        sprintf(rec, "record %d", start + i);
+        Z_NamePlusRecord *r = (Z_NamePlusRecord *)
+            odr_malloc(odr, sizeof(*r));
+        r->databaseName = odr_strdup(odr, "Default");
+        r->which = Z_NamePlusRecord_databaseRecord;
+        r->u.databaseRecord = z_ext_record_oid(odr, syntax, rec, strlen(rec));
+        npr->records[i] = r;
+    }
+    return npr;
+}
+
+static Z_RecordComposition *mk_comp(ODR odr, const char *esn)
+{
+    Z_RecordComposition *comp = (Z_RecordComposition *)
+        odr_malloc(odr, sizeof(*comp));
+    comp->which = Z_RecordComp_simple;
+    comp->u.simple = (Z_ElementSetNames *)
+        odr_malloc(odr, sizeof(*comp->u.simple));
+    comp->u.simple->which = Z_ElementSetNames_generic;
+    comp->u.simple->u.generic = odr_strdup(odr, esn);
+    return comp;
+}
+
+static int check_record(Z_NamePlusRecord *r, int pos)
+{
+    char rec[40];
+    sprintf(rec, "record %d", pos);
+    Odr_oct *oct = r->u.databaseRecord->u.octet_aligned;
+    return r->which == Z_NamePlusRecord_databaseRecord
+        && (int) strlen(rec) == oct->len
+        && !memcmp(oct->buf, rec, oct->len);
+}
+
+static void tst_lookup(void)
+{
+    ODR odr = odr_createmem(ODR_ENCODE);
+    RecordCache cache;
+    Odr_oid *usmarc = odr_oiddup(odr, yaz_oid_recsyn_usmarc);
+    Odr_oid *xml = odr_oiddup(odr, yaz_oid_recsyn_xml);
+    Z_NamePlusRecordList *npr = 0;
+
+    cache.add(odr, mk_records(odr, 1, 10, usmarc), 1, mk_comp(odr, "F"));
+    cache.add(odr, mk_records(odr, 1, 10, usmarc), 1, mk_comp(odr, "B"));
+    cache.add(odr, mk_records(odr, 1, 5, xml), 1, 0);
+
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, 3, 5, usmarc, mk_comp(odr, "F")),
+                 1);
+    YAZ_CHECK(npr && npr->num_records == 5);
+    if (npr && npr->num_records == 5)
+    {
+        int i;
+        for (i = 0; i < 5; i++)
+            YAZ_CHECK(check_record(npr->records[i], 3 + i));
+    }
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, 1, 10, usmarc, mk_comp(odr, "B")),
+                 1);
+    // beyond what is cached
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, 8, 5, usmarc, mk_comp(odr, "F")),
+                 0);
+    // other element set
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, 1, 1, usmarc, mk_comp(odr, "S")),
+                 0);
+    // other syntax, no composition
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, 1, 5, xml, 0), 1);
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, 1, 5, usmarc, 0), 0);
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, 1, 5, 0, 0), 0);
+
+    cache.clear();
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, 1, 1, xml, 0), 0);
+    odr_destroy(odr);
+}
+
+static void tst_lru(void)
+{
+    ODR odr = odr_createmem(ODR_ENCODE);
+    RecordCache cache;
+    Odr_oid *usmarc = odr_oiddup(odr, yaz_oid_recsyn_usmarc);
+    Z_RecordComposition *comp = mk_comp(odr, "F");
+    Z_NamePlusRecordList *npr = 0;
+
+    cache.add(odr, mk_records(odr, 1, 1, usmarc), 1, comp);
+    size_t sz = cache.get_resident_bytes();
+    YAZ_CHECK(sz > 0);
+    YAZ_CHECK_EQ(cache.get_num_entries(), 1);
+
+    // room for three records
+    cache.set_max_size(3 * sz);
+    cache.add(odr, mk_records(odr, 2, 2, usmarc), 2, comp);
+    YAZ_CHECK_EQ(cache.get_num_entries(), 3);
+    YAZ_CHECK(cache.get_resident_bytes() == 3 * sz);
+
+    // adding the same record again replaces it
+    cache.add(odr, mk_records(odr, 3, 1, usmarc), 3, comp);
+    YAZ_CHECK_EQ(cache.get_num_entries(), 3);
+    YAZ_CHECK_EQ(cache.get_evictions(), 0);
+
+    // use 1, so that 2 is least recently used
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, 1, 1, usmarc, comp), 1);
+    cache.add(odr, mk_records(odr, 4, 1, usmarc), 4, comp);
+    YAZ_CHECK_EQ(cache.get_evictions(), 1);
+    YAZ_CHECK_EQ(cache.get_num_entries(), 3);
+    YAZ_CHECK(cache.get_resident_bytes() <= 3 * sz);
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, 2, 1, usmarc, comp), 0);
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, 3, 2, usmarc, comp), 1);
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, 1, 1, usmarc, comp), 1);
+
+    YAZ_CHECK_EQ(cache.get_hits(), 4);
+    YAZ_CHECK_EQ(cache.get_misses(), 1);
+
+    // shrinking evicts
+    cache.set_max_size(sz);
+    YAZ_CHECK_EQ(cache.get_num_entries(), 1);
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, 1, 1, usmarc, comp), 1);
+
+    cache.clear();
+    YAZ_CHECK_EQ(cache.get_num_entries(), 0);
+    YAZ_CHECK(cache.get_resident_bytes() == 0);
+    odr_destroy(odr);
+}
+
+static void tst_partial(void)
+{
+    ODR odr = odr_createmem(ODR_ENCODE);
+    RecordCache cache;
+    Odr_oid *usmarc = odr_oiddup(odr, yaz_oid_recsyn_usmarc);
+    Z_RecordComposition *comp = mk_comp(odr, "F");
+    Z_NamePlusRecordList *npr = 0;
+    RecordCache::Range *missing = 0;
+    int i, num_missing = -1;
+
+    cache.add(odr, mk_records(odr, 1, 3, usmarc), 1, comp);
+    cache.add(odr, mk_records(odr, 6, 2, usmarc), 6, comp);
+
+    YAZ_CHECK_EQ(cache.lookup_partial(odr, &npr, 1, 10, usmarc, comp,
+                                      &num_missing, &missing), 5);
+    YAZ_CHECK(npr && npr->num_records == 10);
+    YAZ_CHECK_EQ(num_missing, 2);
+    if (num_missing == 2)
+    {
+        YAZ_CHECK_EQ(missing[0].start, 4);
+        YAZ_CHECK_EQ(missing[0].number, 2);
+        YAZ_CHECK_EQ(missing[1].start, 8);
+        YAZ_CHECK_EQ(missing[1].number, 3);
+    }
+    for (i = 0; npr && i < 10; i++)
+    {
+        if (i == 3 || i == 4 || i >= 7)
+            YAZ_CHECK(npr->records[i] == 0);
+        else
+            YAZ_CHECK(npr->records[i] && check_record(npr->records[i], 1 + i));
+    }
+
+    // fetch the gaps; then it is a complete hit
+    for (i = 0; i < num_missing; i++)
+        cache.add(odr, mk_records(odr, missing[i].start, missing[i].number,
+                                  usmarc), missing[i].start, comp);
+    YAZ_CHECK_EQ(cache.lookup_partial(odr, &npr, 1, 10, usmarc, comp,
+                                      &num_missing, &missing), 10);
+    YAZ_CHECK_EQ(num_missing, 0);
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, 1, 10, usmarc, comp), 1);
+
+    // without syntax nothing matches
+    YAZ_CHECK_EQ(cache.lookup_partial(odr, &npr, 2, 4, 0, comp,
+                                      &num_missing, &missing), 0);
+    YAZ_CHECK_EQ(num_missing, 1);
+    YAZ_CHECK(num_missing == 1 && missing[0].start == 2
+              && missing[0].number == 4);
+    odr_destroy(odr);
+}
+
+// records handed out must survive eviction of their entries
+static void tst_evict_after_lookup(void)
+{
+    ODR odr = odr_createmem(ODR_ENCODE);
+    ODR odr_add = odr_createmem(ODR_ENCODE);
+    RecordCache cache;
+    Odr_oid *usmarc = odr_oiddup(odr, yaz_oid_recsyn_usmarc);
+    Z_RecordComposition *comp = mk_comp(odr, "F");
+    Z_NamePlusRecordList *npr = 0, *npr_partial = 0;
+    RecordCache::Range *missing = 0;
+    int i, num_missing = -1;
+
+    cache.add(odr_add, mk_records(odr_add, 1, 1, usmarc), 1, comp);
+    cache.set_max_size(4 * cache.get_resident_bytes());
+    cache.add(odr_add, mk_records(odr_add, 2, 3, usmarc), 2, comp);
+    odr_reset(odr_add);
+
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, 1, 2, usmarc, comp), 1);
+    YAZ_CHECK_EQ(cache.lookup_partial(odr, &npr_partial, 3, 4, usmarc, comp,
+                                      &num_missing, &missing), 2);
+
+    // push out everything looked up
+    cache.add(odr_add, mk_records(odr_add, 20, 8, usmarc), 20, comp);
+    odr_reset(odr_add);
+    YAZ_CHECK_EQ(cache.lookup(odr_add, &npr, 1, 1, usmarc, comp), 0);
+    YAZ_CHECK(cache.get_evictions() >= 4);
+
+    for (i = 0; npr && i < 2; i++)
+        YAZ_CHECK(check_record(npr->records[i], 1 + i));
+    for (i = 0; npr_partial && i < 2; i++)
+        YAZ_CHECK(npr_partial->records[i] &&
+                  check_record(npr_partial->records[i], 3 + i));
+    odr_destroy(odr_add);
+    odr_destroy(odr);
+}
+
+static void tst_ttl(void)
+{
+    ODR odr = odr_createmem(ODR_ENCODE);
+    RecordCache cache;
+    Odr_oid *usmarc = odr_oiddup(odr, yaz_oid_recsyn_usmarc);
+    Odr_oid *xml = odr_oiddup(odr, yaz_oid_recsyn_xml);
+    Z_NamePlusRecordList *npr = 0;
+
+    // position 2 is a diagnostic; cached for the syntax asked for
+    Z_NamePlusRecordList *res = mk_records(odr, 1, 3, usmarc);
+    res->records[1] = zget_surrogateDiagRec(odr, "Default", 14, 0);
+    cache.add(odr, res, 1, 0, usmarc);
+    YAZ_CHECK_EQ(cache.get_num_entries(), 3);
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, 1, 3, usmarc, 0), 1);
+    if (npr)
+    {
+        YAZ_CHECK(check_record(npr->records[0], 1));
+        YAZ_CHECK_EQ(npr->records[1]->which,
+                     Z_NamePlusRecord_surrogateDiagnostic);
+    }
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, 2, 1, xml, 0), 0);
+
+    cache.clear();
+    cache.set_diagnostic_ttl(0);
+    cache.add(odr, res, 1, 0, usmarc);
+    YAZ_CHECK_EQ(cache.get_num_entries(), 2);
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, 1, 3, usmarc, 0), 0);
+
+#if HAVE_UNISTD_H
+    cache.clear();
+    cache.set_ttl(1);
+    cache.set_diagnostic_ttl(1);
+    cache.add(odr, res, 1, 0, usmarc);
+    cache.set_ttl(0);
+    cache.add(odr, mk_records(odr, 10, 1, usmarc), 10,
+              (Z_RecordComposition *) 0);
+    YAZ_CHECK_EQ(cache.get_num_entries(), 4);
+    sleep(2);
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, 1, 1, usmarc, 0), 0);
+    YAZ_CHECK_EQ(cache.get_expirations(), 1);
+    YAZ_CHECK_EQ(cache.sweep(), 2);
+    YAZ_CHECK_EQ(cache.get_num_entries(), 1);
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, 10, 1, usmarc, 0), 1);
+#endif
+    odr_destroy(odr);
+}
+
+static void tst_compress(void)
+{
+    ODR odr = odr_createmem(ODR_ENCODE);
+    RecordCache cache;
+    Odr_oid *usmarc = odr_oiddup(odr, yaz_oid_recsyn_usmarc);
+    Z_NamePlusRecordList *npr = 0;
+    char buf[10000];
+    int i, len = 0;
+
+    for (i = 0; len < (int) sizeof(buf) - 20; i++)
+        len += sprintf(buf + len, "field %d ", i % 50);
+    Z_NamePlusRecordList *big = mk_records(odr, 1, 2, usmarc);
+    big->records[0]->u.databaseRecord =
+        z_ext_record_oid(odr, usmarc, buf, len);
+    cache.add(odr, big, 1, (Z_RecordComposition *) 0);
+#if HAVE_ZLIB
+    YAZ_CHECK(cache.get_resident_bytes() < (size_t) len);
+#endif
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, 1, 2, usmarc, 0), 1);
+    if (npr)
+    {
+        Odr_oct *oct = npr->records[0]->u.databaseRecord->u.octet_aligned;
+        YAZ_CHECK(oct->len == len && !memcmp(oct->buf, buf, len));
+        YAZ_CHECK(check_record(npr->records[1], 2));
+    }
+    odr_destroy(odr);
+}
+
+// num records of len bytes each, compressible or not
+static Z_NamePlusRecordList *mk_big_records(ODR odr, int num, int len,
+                                            bool compressible,
+                                            const Odr_oid *syntax)
+{
+    Z_NamePlusRecordList *npr = mk_records(odr, 1, num, syntax);
+    char *buf = (char *) odr_malloc(odr, len);
+    unsigned v = 1;
+    int i;
+    for (i = 0; i < len; i++)
+    {
+        v = v * 1103515245 + 12345;
+        buf[i] = compressible ? "abcdefgh"[i % 8] : (char) (v >> 16);
+    }
+    for (i = 0; i < num; i++)
+        npr->records[i]->u.databaseRecord =
+            z_ext_record_oid(odr, syntax, buf, len);
+    return npr;
+}
+
+// entries are charged what they take, not a block of memory each
+static void tst_budget(void)
+{
+    ODR odr = odr_createmem(ODR_ENCODE);
+    Odr_oid *usmarc = odr_oiddup(odr, yaz_oid_recsyn_usmarc);
+    RecordCache cache;
+
+    cache.add(odr, mk_records(odr, 1, 500, usmarc), 1,
+              (Z_RecordComposition *) 0);
+    YAZ_CHECK_EQ(cache.get_num_entries(), 500);
+    YAZ_CHECK_EQ(cache.get_evictions(), 0);
+#if HAVE_ZLIB
+    // compressed records take a fraction of the budget
+    RecordCache plain, packed;
+    plain.set_max_size(50000);
+    packed.set_max_size(50000);
+    plain.add(odr, mk_big_records(odr, 100, 2000, false, usmarc), 1,
+              (Z_RecordComposition *) 0);
+    packed.add(odr, mk_big_records(odr, 100, 2000, true, usmarc), 1,
+               (Z_RecordComposition *) 0);
+    YAZ_CHECK(plain.get_num_entries() > 0);
+    YAZ_CHECK(packed.get_num_entries() > 3 * plain.get_num_entries());
+    Z_NamePlusRecordList *npr = 0;
+    YAZ_CHECK_EQ(packed.lookup(odr, &npr, 100, 1, usmarc, 0), 1);
+    if (npr)
+    {
+        Odr_oct *oct = npr->records[0]->u.databaseRecord->u.octet_aligned;
+        YAZ_CHECK(oct->len == 2000 && !memcmp(oct->buf, "abcdefgh", 8));
+    }
+#endif
+    odr_destroy(odr);
+}
+
+static Z_PresentRequest *mk_present(ODR odr, int start, int num,
+                                    Odr_oid *syntax,
+                                    Z_RecordComposition *comp)
+{
+    Z_PresentRequest *pr = (Z_PresentRequest *) odr_malloc(odr, sizeof(*pr));
+    memset(pr, 0, sizeof(*pr));
+    pr->resultSetId = odr_strdup(odr, "default");
+    pr->resultSetStartPoint = odr_intdup(odr, start);
+    pr->numberOfRecordsRequested = odr_intdup(odr, num);
+    pr->recordComposition = comp;
+    pr->preferredRecordSyntax = syntax;
+    return pr;
+}
+
+static void tst_prefetch(void)
+{
+    ODR odr = odr_createmem(ODR_ENCODE);
+    RecordCache cache;
+    Odr_oid *usmarc = odr_oiddup(odr, yaz_oid_recsyn_usmarc);
+    Z_RecordComposition *comp = mk_comp(odr, "F");
+    Z_PresentRequest *pr = 0;
+
+    cache.set_prefetch_depth(2);
+    cache.copy_presentRequest(mk_present(odr, 1, 10, usmarc, comp));
+    YAZ_CHECK_EQ(cache.get_prefetch(odr, &pr), 0);
+    cache.add(odr, mk_records(odr, 1, 10, usmarc), 1, comp);
+
+    // second window continues the first: read two windows ahead
+    cache.copy_presentRequest(mk_present(odr, 11, 10, usmarc, comp));
+    YAZ_CHECK_EQ(cache.get_prefetch(odr, &pr), 1);
+    YAZ_CHECK(pr && *pr->resultSetStartPoint == 21);
+    YAZ_CHECK(pr && *pr->numberOfRecordsRequested == 10);
+    YAZ_CHECK_EQ(cache.get_prefetch(odr, &pr), 1);
+    YAZ_CHECK(pr && *pr->resultSetStartPoint == 31);
+    YAZ_CHECK_EQ(cache.get_prefetch(odr, &pr), 0);
+    cache.add(odr, mk_records(odr, 11, 30, usmarc), 11, comp);
+
+    // next windows partly cached already
+    cache.copy_presentRequest(mk_present(odr, 21, 10, usmarc, comp));
+    YAZ_CHECK_EQ(cache.get_prefetch(odr, &pr), 1);
+    YAZ_CHECK(pr && *pr->resultSetStartPoint == 41);
+    YAZ_CHECK(pr && *pr->numberOfRecordsRequested == 10);
+    YAZ_CHECK_EQ(cache.get_prefetch(odr, &pr), 0);
+
+    // random access
+    cache.copy_presentRequest(mk_present(odr, 5, 10, usmarc, comp));
+    YAZ_CHECK_EQ(cache.get_prefetch(odr, &pr), 0);
+
+    // no room
+    cache.set_max_size(cache.get_resident_bytes());
+    cache.copy_presentRequest(mk_present(odr, 15, 10, usmarc, comp));
+    YAZ_CHECK_EQ(cache.get_prefetch(odr, &pr), 0);
+    odr_destroy(odr);
+}
+
+static Z_Query *mk_query(ODR odr, const char *ccl)
+{
+    Z_Query *q = (Z_Query *) odr_malloc(odr, sizeof(*q));
+    q->which = Z_Query_type_2;
+    q->u.type_2 = odr_create_Odr_oct(odr, ccl, strlen(ccl));
+    return q;
+}
+
+static void tst_shared(void)
+{
+    ODR odr = odr_createmem(ODR_ENCODE);
+    SharedRecordCache cache(4);
+    Odr_oid *usmarc = odr_oiddup(odr, yaz_oid_recsyn_usmarc);
+    Z_RecordComposition *comp = mk_comp(odr, "F");
+    Z_NamePlusRecordList *npr = 0;
+    Z_Query *q1 = mk_query(odr, "ti=house");
+    Z_Query *q2 = mk_query(odr, "ti=mouse");
+    const char *db_ab[2] = { "A", "B" };
+    const char *db_ab_lc[2] = { "a", "b" };
+    const char *db_c[1] = { "C" };
+
+    cache.add(q1, 2, db_ab, mk_records(odr, 1, 10, usmarc), 1, comp);
+    cache.add(q1, 1, db_c, mk_records(odr, 1, 5, usmarc), 1, comp);
+    YAZ_CHECK(cache.get_resident_bytes() > 0);
+
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, q1, 2, db_ab, 4, 7, usmarc, comp), 1);
+    YAZ_CHECK(npr && npr->num_records == 7);
+    if (npr && npr->num_records == 7)
+        YAZ_CHECK(check_record(npr->records[0], 4));
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, q1, 2, db_ab, 4, 8, usmarc, comp), 0);
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, q2, 2, db_ab, 1, 1, usmarc, comp), 0);
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, q1, 1, db_ab, 1, 1, usmarc, comp), 0);
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, q1, 2, db_ab, 1, 1, usmarc, 0), 0);
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, q1, 1, db_c, 1, 5, usmarc, comp), 1);
+    // database names are compared case insensitively
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, q1, 2, db_ab_lc, 1, 3, usmarc, comp),
+                 1);
+
+    cache.invalidate_database("b");
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, q1, 2, db_ab, 1, 1, usmarc, comp), 0);
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, q1, 1, db_c, 1, 5, usmarc, comp), 1);
+
+    cache.clear();
+    YAZ_CHECK(cache.get_resident_bytes() == 0);
+    YAZ_CHECK_EQ(cache.lookup(odr, &npr, q1, 1, db_c, 1, 1, usmarc, comp), 0);
+    odr_destroy(odr);
+}
+
+#if HAVE_SYS_MMAN_H && HAVE_SYS_STAT_H
+static void tst_disk(void)
+{
+    const char *dir = "test_record_cache.dir";
+    ODR odr = odr_createmem(ODR_ENCODE);
+    Odr_oid *usmarc = odr_oiddup(odr, yaz_oid_recsyn_usmarc);
+    Z_NamePlusRecordList *npr = mk_records(odr, 1, 10, usmarc);
+    const char *tags[2] = { "A", "B" };
+    RecordCacheDisk d;
+    int i;
+
+    mkdir(dir, 0777);
+    YAZ_CHECK_EQ(d.open(dir, 1000000), 0);
+    d.clear();
+    for (i = 0; i < 10; i++)
+        YAZ_CHECK_EQ(d.put("k1", 2, i + 1, 2, tags, npr->records[i]), 0);
+    YAZ_CHECK_EQ(d.get_num_records(), 10);
+    Z_NamePlusRecord *r = d.get(odr, "k1", 2, 4);
+    YAZ_CHECK(r && check_record(r, 4));
+    YAZ_CHECK(r && r->databaseName && !strcmp(r->databaseName, "Default"));
+    YAZ_CHECK(!d.get(odr, "k1", 2, 11));
+    YAZ_CHECK(!d.get(odr, "k2", 2, 4));
+
+    // survives reopen
+    d.close();
+    YAZ_CHECK_EQ(d.open(dir, 1000000), 0);
+    YAZ_CHECK_EQ(d.get_num_records(), 10);
+    r = d.get(odr, "k1", 2, 7);
+    YAZ_CHECK(r && check_record(r, 7));
+
+    // replace all records; the old segment has no live records then
+    for (i = 0; i < 10; i++)
+        d.put("k1", 2, i + 1, 1, tags, npr->records[i]);
+    YAZ_CHECK_EQ(d.get_num_records(), 10);
+    size_t before = d.get_disk_bytes();
+    d.compact();
+    YAZ_CHECK(d.get_disk_bytes() < before);
+    r = d.get(odr, "k1", 2, 10);
+    YAZ_CHECK(r && check_record(r, 10));
+
+    // invalidation is persistent
+    d.invalidate_tag("a");
+    YAZ_CHECK_EQ(d.get_num_records(), 0);
+    YAZ_CHECK(!d.get(odr, "k1", 2, 10));
+    d.close();
+    YAZ_CHECK_EQ(d.open(dir, 1000000), 0);
+    YAZ_CHECK_EQ(d.get_num_records(), 0);
+
+    // spill from SharedRecordCache
+    SharedRecordCache cache(1);
+    Z_RecordComposition *comp = mk_comp(odr, "F");
+    Z_Query *q = mk_query(odr, "ti=house");
+    Z_NamePlusRecordList *res = 0;
+    YAZ_CHECK_EQ(cache.set_disk_tier(dir, 1000000), 0);
+    cache.clear();
+    Z_NamePlusRecordList one = *npr;
+    one.num_records = 1;
+    cache.add(q, 2, tags, &one, 1, comp);
+    cache.set_max_size(2 * cache.get_resident_bytes());
+    cache.add(q, 2, tags, npr, 1, comp);
+    YAZ_CHECK(cache.get_evictions() > 0);
+    i = cache.lookup(odr, &res, q, 2, tags, 1, 10, usmarc, comp);
+    YAZ_CHECK_EQ(i, 1);
+    if (i == 1)
+        YAZ_CHECK(check_record(res->records[0], 1));
+    YAZ_CHECK(cache.get_disk_hits() > 0);
+    YAZ_CHECK_EQ(cache.get_hits() + cache.get_disk_hits(), 10);
+    cache.invalidate_database("b");
+    YAZ_CHECK_EQ(cache.lookup(odr, &res, q, 2, tags, 1, 1, usmarc, comp), 0);
+    cache.set_disk_tier(0, 0);
+
+    d.clear();
+    odr_destroy(odr);
+}
+
+static void tst_disk_compact(void)
+{
+    const char *dir = "test_record_cache.dir";
+    ODR odr = odr_createmem(ODR_ENCODE);
+    Odr_oid *usmarc = odr_oiddup(odr, yaz_oid_recsyn_usmarc);
+    Z_NamePlusRecordList *npr = mk_records(odr, 1, 10, usmarc);
+    const char *tag_a = "A", *tag_b = "B", *tag_c = "C";
+    RecordCacheDisk d;
+    int i;
+
+    mkdir(dir, 0777);
+    // each open starts a new segment
+    YAZ_CHECK_EQ(d.open(dir, 1000000), 0);
+    d.clear();
+    d.put("k0", 2, 1, 1, &tag_a, npr->records[0]);
+    for (i = 0; i < 5; i++)
+        d.put("k9", 2, i + 1, 1, &tag_c, npr->records[i]);
+    d.close();
+    YAZ_CHECK_EQ(d.open(dir, 1000000), 0);
+    for (i = 0; i < 10; i++)
+        d.put("k1", 2, i + 1, 1, &tag_b, npr->records[i]);
+    d.put("k3", 2, 1, 1, &tag_b, npr->records[2]);
+    d.invalidate_tag("a");
+    d.close();
+    YAZ_CHECK_EQ(d.open(dir, 1000000), 0);
+    for (i = 0; i < 10; i++)
+        d.put("k1", 2, i + 1, 1, &tag_b, npr->records[i]);
+    d.put("k2", 2, 1, 1, &tag_a, npr->records[1]);
+
+    // second segment is mostly dead; its tombstone must stay behind
+    // k2 and its live record must move
+    size_t before = d.get_disk_bytes();
+    d.compact();
+    YAZ_CHECK(d.get_disk_bytes() < before);
+    Z_NamePlusRecord *r = d.get(odr, "k3", 2, 1);
+    YAZ_CHECK(r && check_record(r, 3));
+    d.close();
+    YAZ_CHECK_EQ(d.open(dir, 1000000), 0);
+    YAZ_CHECK(!d.get(odr, "k0", 2, 1));
+    r = d.get(odr, "k2", 2, 1);
+    YAZ_CHECK(r && check_record(r, 2));
+    r = d.get(odr, "k3", 2, 1);
+    YAZ_CHECK(r && check_record(r, 3));
+    r = d.get(odr, "k9", 2, 5);
+    YAZ_CHECK(r && check_record(r, 5));
+
+    // records from get do not depend on the segment they came from
+    d.clear();
+    d.compact();
+    YAZ_CHECK(r && check_record(r, 5));
+
+    // pinned records point into the segment, which compaction keeps
+    d.put("k4", 2, 1, 1, &tag_a, npr->records[3]);
+    int token = d.pin();
+    YAZ_CHECK(token != 0);
+    r = d.get(odr, "k4", 2, 1, token);
+    YAZ_CHECK(r && check_record(r, 4));
+    d.clear();
+    d.compact();
+    YAZ_CHECK(r && check_record(r, 4));
+    d.unpin(token);
+    d.compact();
+
+    // segments are sized by the budget
+    d.close();
+    YAZ_CHECK_EQ(d.open(dir, 200000), 0);
+    for (i = 0; i < 5000; i++)
+        d.put("k5", 2, i + 1, 1, &tag_a, npr->records[i % 10]);
+    YAZ_CHECK(d.get_disk_bytes() <= 200000);
+    YAZ_CHECK(d.get_num_records() > 0);
+    r = d.get(odr, "k5", 2, 5000);
+    YAZ_CHECK(r && check_record(r, 10));
+    d.clear();
+
+    // records too big for memory go straight to disk, tagged all the same
+    SharedRecordCache cache(1);
+    Z_RecordComposition *comp = mk_comp(odr, "F");
+    Z_Query *q = mk_query(odr, "ti=house");
+    const char *dbs[2] = { "A", "B" };
+    Z_NamePlusRecordList *res = 0;
+    YAZ_CHECK_EQ(cache.set_disk_tier(dir, 1000000), 0);
+    cache.set_max_size(1);
+    cache.add(q, 2, dbs, npr, 1, comp);
+    YAZ_CHECK(cache.get_resident_bytes() == 0);
+    YAZ_CHECK_EQ(cache.lookup(odr, &res, q, 2, dbs, 1, 2, usmarc, comp), 1);
+    cache.invalidate_database("b");
+    YAZ_CHECK_EQ(cache.lookup(odr, &res, q, 2, dbs, 1, 1, usmarc, comp), 0);
+    cache.set_disk_tier(0, 0);
+
+    d.close();
+    odr_destroy(odr);
+}
+#endif
+
+int main(int argc, char **argv)
+{
+    YAZ_CHECK_INIT(argc, argv);
+    tst_lookup();
+    tst_lru();
+    tst_partial();
+    tst_evict_after_lookup();
+    tst_ttl();
+    tst_compress();
+    tst_budget();
+    tst_prefetch();
+    tst_shared();
+#if HAVE_SYS_MMAN_H && HAVE_SYS_STAT_H
+    tst_disk();
+    tst_disk_compact();
+#endif
+    YAZ_CHECK_TERM;
+}
+
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
@@ -0,0 +1,173 @@
+/* This file is part of the yazpp toolkit.
+ * Copyright (C) Index Data 
+ * See the file LICENSE for details.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <yazpp/search-cache.h>
+#include <yazpp/rpn-normalize.h>
+#include <yaz/proto.h>
+#include <yaz/pquery.h>
+#include <yaz/test.h>
+
+using namespace yazpp_1;
+
+static Z_Query *mk_query(ODR odr, const char *ccl)
+{
+    Z_Query *q = (Z_Query *) odr_malloc(odr, sizeof(*q));
+    q->which = Z_Query_type_2;
+    q->u.type_2 = odr_create_Odr_oct(odr, ccl, strlen(ccl));
+    return q;
+}
+
+static void tst_lookup(void)
+{
+    ODR odr = odr_createmem(ODR_ENCODE);
+    SearchCache cache;
+    Z_Query *q1 = mk_query(odr, "ti=house");
+    Z_Query *q2 = mk_query(odr, "ti=mouse");
+    const char *db_ab[2] = { "A", "B" };
+    const char *db_ab_lc[2] = { "a", "b" };
+    const char *db_ba[2] = { "B", "A" };
+    Odr_int hits = 0;
+    char *handle = 0;
+
+    cache.add(q1, 2, db_ab, "default", 42, "backend-1");
+    cache.add(q2, 2, db_ab, "default", 7, 0);
+    YAZ_CHECK_EQ(cache.get_num_entries(), 2);
+
+    YAZ_CHECK_EQ(cache.lookup(odr, q1, 2, db_ab_lc, "default",
+                              &hits, &handle), 1);
+    YAZ_CHECK(hits == 42);
+    YAZ_CHECK(handle && !strcmp(handle, "backend-1"));
+    YAZ_CHECK_EQ(cache.lookup(odr, q2, 2, db_ab, "default",
+                              &hits, &handle), 1);
+    YAZ_CHECK(hits == 7 && handle == 0);
+    YAZ_CHECK_EQ(cache.lookup(odr, q1, 2, db_ba, "default",
+                              &hits, &handle), 0);
+    YAZ_CHECK_EQ(cache.lookup(odr, q1, 2, db_ab, "other",
+                              &hits, &handle), 0);
+    YAZ_CHECK_EQ(cache.lookup(odr, q1, 1, db_ab, "default",
+                              &hits, &handle), 0);
+    YAZ_CHECK_EQ(cache.get_hits(), 2);
+    YAZ_CHECK_EQ(cache.get_misses(), 3);
+
+    // new result replaces old
+    cache.add(q1, 2, db_ab, "default", 43, "backend-2");
+    YAZ_CHECK_EQ(cache.get_num_entries(), 2);
+    YAZ_CHECK_EQ(cache.lookup(odr, q1, 2, db_ab, "default",
+                              &hits, &handle), 1);
+    YAZ_CHECK(hits == 43);
+
+    cache.invalidate_handle("backend-2");
+    YAZ_CHECK_EQ(cache.lookup(odr, q1, 2, db_ab, "default",
+                              &hits, &handle), 0);
+    cache.invalidate_database("b");
+    YAZ_CHECK_EQ(cache.get_num_entries(), 0);
+
+    // memory limit
+    cache.add(q1, 2, db_ab, "default", 1, 0);
+    cache.set_max_size(cache.get_resident_bytes());
+    cache.add(q2, 2, db_ab, "default", 2, 0);
+    YAZ_CHECK_EQ(cache.get_num_entries(), 1);
+    YAZ_CHECK_EQ(cache.get_evictions(), 1);
+    YAZ_CHECK_EQ(cache.lookup(odr, q2, 2, db_ab, "default",
+                              &hits, &handle), 1);
+
+    cache.clear();
+    YAZ_CHECK_EQ(cache.get_num_entries(), 0);
+    YAZ_CHECK(cache.get_resident_bytes() == 0);
+    odr_destroy(odr);
+}
+
+static void tst_ttl(void)
+{
+    ODR odr = odr_createmem(ODR_ENCODE);
+    SearchCache cache;
+    Z_Query *q = mk_query(odr, "ti=house");
+    const char *db[1] = { "Default" };
+
+    cache.set_ttl(0);
+    cache.add(q, 1, db, "default", 1, 0);
+    YAZ_CHECK_EQ(cache.get_num_entries(), 0);
+#if HAVE_UNISTD_H
+    Odr_int hits = 0;
+    char *handle = 0;
+    cache.set_ttl(1);
+    cache.add(q, 1, db, "default", 1, 0);
+    YAZ_CHECK_EQ(cache.lookup(odr, q, 1, db, "default", &hits, &handle), 1);
+    YAZ_CHECK_EQ(hits, 1);
+    sleep(2);
+    YAZ_CHECK_EQ(cache.lookup(odr, q, 1, db, "default", &hits, &handle), 0);
+    YAZ_CHECK_EQ(cache.get_expirations(), 1);
+    YAZ_CHECK_EQ(cache.get_num_entries(), 0);
+#endif
+    odr_destroy(odr);
+}
+
+static Z_Query *mk_rpn(ODR odr, int which, const char *pqf)
+{
+    Z_Query *q = (Z_Query *) odr_malloc(odr, sizeof(*q));
+    q->which = which;
+    if (which == Z_Query_type_101)
+        q->u.type_101 = p_query_rpn(odr, pqf);
+    else
+        q->u.type_1 = p_query_rpn(odr, pqf);
+    return q;
+}
+
+// queries are compared by canonical (optionally normalized) form
+static void tst_canonical(void)
+{
+    ODR odr = odr_createmem(ODR_ENCODE);
+    const char *db[1] = { "Default" };
+    Odr_int hits = 0;
+    char *handle = 0;
+    {
+        SearchCache cache;
+        cache.add(mk_rpn(odr, Z_Query_type_1, "@attr 1=4 house"), 1, db,
+                  "default", 3, 0);
+        YAZ_CHECK_EQ(cache.lookup(odr, mk_rpn(odr, Z_Query_type_101,
+                                              "@attr 1=4 house"),
+                                  1, db, "default", &hits, &handle), 1);
+        YAZ_CHECK_EQ(cache.lookup(odr, mk_rpn(odr, Z_Query_type_1,
+                                              "@and a b"),
+                                  1, db, "default", &hits, &handle), 0);
+    }
+    {
+        RPN_Normalizer normalizer;
+        SearchCache cache;
+        cache.set_normalizer(&normalizer);
+        cache.add(mk_rpn(odr, Z_Query_type_1, "@and a b"), 1, db,
+                  "default", 4, 0);
+        YAZ_CHECK_EQ(cache.lookup(odr, mk_rpn(odr, Z_Query_type_1,
+                                              "@and b a"),
+                                  1, db, "default", &hits, &handle), 1);
+        YAZ_CHECK(hits == 4);
+    }
+    odr_destroy(odr);
+}
+
+int main(int argc, char **argv)
+{
+    YAZ_CHECK_INIT(argc, argv);
+    tst_lookup();
+    tst_ttl();
+    tst_canonical();
+    YAZ_CHECK_TERM;
+}
+
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
@@ -0,0 +1,772 @@
+/* This file is part of the yazpp toolkit.
+ * Copyright (C) Index Data 
+ * See the file LICENSE for details.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <yazpp/z-server.h>
+#include <yazpp/socket-manager.h>
+#include <yaz/thread_create.h>
+#include <yaz/mutex.h>
+#include <yaz/oid_db.h>
+#include <yaz/test.h>
+#include <yaz/log.h>
+
+using namespace yazpp_1;
+
+#define MAX_SENT 20
+
+// what a session has sent and whether it has been closed
+struct Wire {
+    ODR odr;
+    Z_APDU *sent[MAX_SENT];
+    int num_sent;
+    int closed;
+};
+
+/* Stands in for the network. Packages sent are decoded and kept in
+   wire; the socket manager is only used for waking up the session */
+class StubPDU : public IPDU_Observable {
+ public:
+    StubPDU(Wire *wire, ISocketObservable *mgr);
+    int send_PDU(const char *buf, int len);
+    int connect(IPDU_Observer *observer, const char *addr);
+    int listen(IPDU_Observer *observer, const char *addr);
+    void shutdown();
+    IPDU_Observable *clone();
+    void destroy();
+    void idleTime(int timeout);
+    const char *getpeername();
+    void close_session();
+    ISocketObservable *get_socket_observable();
+ private:
+    Wire *m_wire;
+    ISocketObservable *m_mgr;
+};
+
+StubPDU::StubPDU(Wire *wire, ISocketObservable *mgr)
+{
+    m_wire = wire;
+    m_mgr = mgr;
+}
+
+int StubPDU::send_PDU(const char *buf, int len)
+{
+    Z_GDU *gdu = 0;
+    char *copy = (char *) odr_malloc(m_wire->odr, len);
+    memcpy(copy, buf, len);
+    odr_setbuf(m_wire->odr, copy, len, 0);
+    if (m_wire->num_sent < MAX_SENT && z_GDU(m_wire->odr, &gdu, 0, 0)
+        && gdu->which == Z_GDU_Z3950)
+        m_wire->sent[m_wire->num_sent++] = gdu->u.z3950;
+    return 0;
+}
+
+int StubPDU::connect(IPDU_Observer *observer, const char *addr)
+{
+    return -1;
+}
+
+int StubPDU::listen(IPDU_Observer *observer, const char *addr)
+{
+    return -1;
+}
+
+void StubPDU::shutdown()
+{
+}
+
+IPDU_Observable *StubPDU::clone()
+{
+    return 0;
+}
+
+void StubPDU::destroy()
+{
+}
+
+void StubPDU::idleTime(int timeout)
+{
+}
+
+const char *StubPDU::getpeername()
+{
+    return "stub";
+}
+
+void StubPDU::close_session()
+{
+    m_wire->closed++;
+}
+
+ISocketObservable *StubPDU::get_socket_observable()
+{
+    return m_mgr;
+}
+
+class TestServer : public Z_Server {
+ public:
+    TestServer(IPDU_Observable *the_PDU_Observable);
+    IPDU_Observer *sessionNotify(IPDU_Observable *the_PDU_Observable,
+                                 int fd);
+    void failNotify();
+    void timeoutNotify();
+    void connectNotify();
+};
+
+TestServer::TestServer(IPDU_Observable *the_PDU_Observable)
+    : Z_Server(the_PDU_Observable)
+{
+}
+
+IPDU_Observer *TestServer::sessionNotify(
+    IPDU_Observable *the_PDU_Observable, int fd)
+{
+    return 0;
+}
+
+void TestServer::failNotify()
+{
+}
+
+void TestServer::timeoutNotify()
+{
+}
+
+void TestServer::connectNotify()
+{
+}
+
+// offered every type of APDU, takes none
+class AnyFacility : public IServer_Facility {
+ public:
+    AnyFacility();
+    int init(Z_Server *server, Z_InitRequest *initRequest,
+             Z_InitResponse *initResponse);
+    int recv(Z_Server *server, Z_APDU *apdu);
+    int num_recv;
+};
+
+AnyFacility::AnyFacility()
+{
+    num_recv = 0;
+}
+
+int AnyFacility::init(Z_Server *server, Z_InitRequest *initRequest,
+                      Z_InitResponse *initResponse)
+{
+    return 0;
+}
+
+int AnyFacility::recv(Z_Server *server, Z_APDU *apdu)
+{
+    num_recv++;
+    return 0;
+}
+
+// takes scan only and answers it at once
+class ScanFacility : public IServer_Facility {
+ public:
+    ScanFacility();
+    int init(Z_Server *server, Z_InitRequest *initRequest,
+             Z_InitResponse *initResponse);
+    int recv(Z_Server *server, Z_APDU *apdu);
+    const int *apdu_types();
+    int num_recv;
+};
+
+ScanFacility::ScanFacility()
+{
+    num_recv = 0;
+}
+
+int ScanFacility::init(Z_Server *server, Z_InitRequest *initRequest,
+                       Z_InitResponse *initResponse)
+{
+    return 0;
+}
+
+int ScanFacility::recv(Z_Server *server, Z_APDU *apdu)
+{
+    num_recv++;
+    Z_APDU *apdu_response = server->create_Z_PDU(Z_APDU_scanResponse);
+    server->transfer_referenceId(apdu, apdu_response);
+    server->send_Z_PDU(apdu_response, 0);
+    return 1;
+}
+
+const int *ScanFacility::apdu_types()
+{
+    static const int types[] = { Z_APDU_scanRequest, -1 };
+    return types;
+}
+
+/* Searches give hits and are completed later by the test, unless
+   complete_at_once is set. Presents complete at once with the default
+   sr_present_async */
+class MyRetrieval : public Yaz_Facility_Retrieval {
+ public:
+    MyRetrieval();
+    int sr_init(Z_InitRequest *initRequest, Z_InitResponse *initResponse);
+    void sr_search(Z_SearchRequest *searchRequest,
+                   Z_SearchResponse *searchResponse);
+    void sr_present(Z_PresentRequest *presentRequest,
+                    Z_PresentResponse *presentResponse);
+    void sr_record(const char *resultSetName, int position, Odr_oid *format,
+                   Z_RecordComposition *comp,
+                   Z_NamePlusRecord *namePlusRecord, Z_Records *diagnostics);
+    void sr_search_async(Z_SearchRequest *searchRequest,
+                         Z_ServerDeferred *deferred);
+    int hits;
+    bool complete_at_once;
+    Z_ServerDeferred *deferred;
+    int num_search;
+    int num_present;
+};
+
+MyRetrieval::MyRetrieval()
+{
+    hits = 0;
+    complete_at_once = false;
+    deferred = 0;
+    num_search = 0;
+    num_present = 0;
+}
+
+int MyRetrieval::sr_init(Z_InitRequest *initRequest,
+                         Z_InitResponse *initResponse)
+{
+    return 0;
+}
+
+void MyRetrieval::sr_search(Z_SearchRequest *searchRequest,
+                            Z_SearchResponse *searchResponse)
+{
+    num_search++;
+    *searchResponse->resultCount = hits;
+}
+
+void MyRetrieval::sr_present(Z_PresentRequest *presentRequest,
+                             Z_PresentResponse *presentResponse)
+{
+    num_present++;
+}
+
+void MyRetrieval::sr_record(const char *resultSetName, int position,
+                            Odr_oid *format, Z_RecordComposition *comp,
+                            Z_NamePlusRecord *namePlusRecord,
+                            Z_Records *diagnostics)
+{
+    create_databaseRecord(odr_encode(), namePlusRecord, 0,
+                          yaz_oid_recsyn_usmarc, "record", 6);
+}
+
+void MyRetrieval::sr_search_async(Z_SearchRequest *searchRequest,
+                                  Z_ServerDeferred *deferred)
+{
+    if (complete_at_once)
+    {
+        Yaz_Facility_Retrieval::sr_search_async(searchRequest, deferred);
+        return;
+    }
+    num_search++;
+    this->deferred = deferred;
+}
+
+// fetches records in batches; each record is RECORD_SIZE bytes
+#define RECORD_SIZE 1000
+
+class BatchRetrieval : public MyRetrieval {
+ public:
+    BatchRetrieval();
+    int sr_records(const char *resultSetName, int start, int count,
+                   Odr_oid *format, Z_RecordComposition *comp,
+                   Z_NamePlusRecord **namePlusRecords,
+                   Z_Records *diagnostics);
+    void sr_record(const char *resultSetName, int position, Odr_oid *format,
+                   Z_RecordComposition *comp,
+                   Z_NamePlusRecord *namePlusRecord, Z_Records *diagnostics);
+    bool batch;         // false: sr_records not implemented
+    int num_calls;
+    int num_asked;      // sum of count over calls
+};
+
+BatchRetrieval::BatchRetrieval()
+{
+    batch = true;
+    num_calls = 0;
+    num_asked = 0;
+}
+
+int BatchRetrieval::sr_records(const char *resultSetName, int start,
+                               int count, Odr_oid *format,
+                               Z_RecordComposition *comp,
+                               Z_NamePlusRecord **namePlusRecords,
+                               Z_Records *diagnostics)
+{
+    char buf[RECORD_SIZE];
+    int i;
+    if (!batch)
+        return -1;
+    num_calls++;
+    num_asked += count;
+    memset(buf, 'x', sizeof(buf));
+    for (i = 0; i < count && start + i <= hits; i++)
+        create_databaseRecord(odr_encode(), namePlusRecords[i], 0,
+                              yaz_oid_recsyn_usmarc, buf, sizeof(buf));
+    return i;
+}
+
+void BatchRetrieval::sr_record(const char *resultSetName, int position,
+                               Odr_oid *format, Z_RecordComposition *comp,
+                               Z_NamePlusRecord *namePlusRecord,
+                               Z_Records *diagnostics)
+{
+    char buf[RECORD_SIZE];
+    memset(buf, 'x', sizeof(buf));
+    if (position <= hits)
+        create_databaseRecord(odr_encode(), namePlusRecord, 0,
+                              yaz_oid_recsyn_usmarc, buf, sizeof(buf));
+}
+
+static Z_APDU *mk_request(Z_Server *s, ODR odr, int type, const char *id)
+{
+    Z_APDU *apdu = zget_APDU(odr, type);
+    Z_ReferenceId **idp = s->get_referenceIdP(apdu);
+    if (id && idp)
+        *idp = odr_create_Odr_oct(odr, id, strlen(id));
+    if (type == Z_APDU_presentRequest)
+        *apdu->u.presentRequest->numberOfRecordsRequested = 0;
+    return apdu;
+}
+
+static int has_id(Z_Server *s, Z_APDU *apdu, const char *id)
+{
+    Z_ReferenceId **idp = s->get_referenceIdP(apdu);
+    if (!idp || !*idp)
+        return id == 0;
+    return id && (*idp)->len == (int) strlen(id)
+        && !memcmp((*idp)->buf, id, (*idp)->len);
+}
+
+static void wire_init(Wire *wire)
+{
+    wire->odr = odr_createmem(ODR_DECODE);
+    wire->num_sent = 0;
+    wire->closed = 0;
+}
+
+static void tst_dispatch(void)
+{
+    Wire wire;
+    wire_init(&wire);
+    ODR odr = odr_createmem(ODR_ENCODE);
+    TestServer *s = new TestServer(new StubPDU(&wire, 0));
+    AnyFacility any;
+    ScanFacility scan;
+    s->facility_add(&any, "any");
+    s->facility_add(&scan, "scan");
+
+    // offered to the facilities that take its type, in order
+    s->recv_Z_PDU(mk_request(s, odr, Z_APDU_scanRequest, "scan1"), 0);
+    YAZ_CHECK_EQ(any.num_recv, 1);
+    YAZ_CHECK_EQ(scan.num_recv, 1);
+    YAZ_CHECK_EQ(wire.num_sent, 1);
+    if (wire.num_sent == 1)
+    {
+        YAZ_CHECK_EQ(wire.sent[0]->which, Z_APDU_scanResponse);
+        YAZ_CHECK(has_id(s, wire.sent[0], "scan1"));
+    }
+    YAZ_CHECK_EQ(wire.closed, 0);
+
+    // taken by nobody: answered with Close
+    s->recv_Z_PDU(mk_request(s, odr, Z_APDU_sortRequest, "sort1"), 0);
+    YAZ_CHECK_EQ(any.num_recv, 2);
+    YAZ_CHECK_EQ(scan.num_recv, 1);
+    YAZ_CHECK_EQ(wire.num_sent, 2);
+    if (wire.num_sent == 2)
+    {
+        Z_APDU *apdu = wire.sent[1];
+        YAZ_CHECK_EQ(apdu->which, Z_APDU_close);
+        if (apdu->which == Z_APDU_close)
+            YAZ_CHECK_EQ(*apdu->u.close->closeReason,
+                         Z_Close_protocolError);
+        YAZ_CHECK(has_id(s, apdu, "sort1"));
+    }
+    YAZ_CHECK_EQ(wire.closed, 1);
+
+    // Close from the client is answered in kind
+    s->recv_Z_PDU(mk_request(s, odr, Z_APDU_close, 0), 0);
+    YAZ_CHECK_EQ(wire.num_sent, 3);
+    if (wire.num_sent == 3)
+    {
+        Z_APDU *apdu = wire.sent[2];
+        YAZ_CHECK_EQ(apdu->which, Z_APDU_close);
+        if (apdu->which == Z_APDU_close)
+            YAZ_CHECK_EQ(*apdu->u.close->closeReason, Z_Close_finished);
+        YAZ_CHECK(has_id(s, apdu, 0));
+    }
+    YAZ_CHECK_EQ(wire.closed, 2);
+
+    delete s;
+    odr_destroy(odr);
+    odr_destroy(wire.odr);
+}
+
+static void tst_deferred(void)
+{
+    Wire wire;
+    wire_init(&wire);
+    ODR odr = odr_createmem(ODR_ENCODE);
+    TestServer *s = new TestServer(new StubPDU(&wire, 0));
+    MyRetrieval retrieval;
+    retrieval.set_async(true);
+    s->facility_add(&retrieval, "retrieval");
+
+    // completed by the handler itself
+    retrieval.complete_at_once = true;
+    retrieval.hits = 3;
+    s->recv_Z_PDU(mk_request(s, odr, Z_APDU_searchRequest, "s0"), 0);
+    YAZ_CHECK_EQ(wire.num_sent, 1);
+    if (wire.num_sent == 1)
+    {
+        YAZ_CHECK_EQ(wire.sent[0]->which, Z_APDU_searchResponse);
+        YAZ_CHECK(has_id(s, wire.sent[0], "s0"));
+    }
+
+    // completed later by the session's thread; the present that
+    // arrives meanwhile is held and answered after the search
+    retrieval.complete_at_once = false;
+    s->recv_Z_PDU(mk_request(s, odr, Z_APDU_searchRequest, "s1"), 0);
+    s->recv_Z_PDU(mk_request(s, odr, Z_APDU_presentRequest, "p1"), 0);
+    YAZ_CHECK_EQ(wire.num_sent, 1);
+    YAZ_CHECK_EQ(retrieval.num_present, 0);
+    YAZ_CHECK(retrieval.deferred);
+    if (retrieval.deferred)
+    {
+        // referenceId is in the response before the handler sees it
+        YAZ_CHECK(has_id(s, retrieval.deferred->get_response(), "s1"));
+        *retrieval.deferred->get_response()->u.searchResponse->resultCount
+            = 7;
+        retrieval.deferred->complete();
+        retrieval.deferred = 0;
+    }
+    // nothing wakes the session, so it sends once it is given a request
+    s->recv_Z_PDU(mk_request(s, odr, Z_APDU_scanRequest, "x"), 0);
+    YAZ_CHECK_EQ(retrieval.num_present, 1);
+    YAZ_CHECK_EQ(wire.num_sent, 4);
+    if (wire.num_sent == 4)
+    {
+        YAZ_CHECK_EQ(wire.sent[1]->which, Z_APDU_searchResponse);
+        YAZ_CHECK(has_id(s, wire.sent[1], "s1"));
+        if (wire.sent[1]->which == Z_APDU_searchResponse)
+            YAZ_CHECK_EQ(*wire.sent[1]->u.searchResponse->resultCount, 7);
+        YAZ_CHECK_EQ(wire.sent[2]->which, Z_APDU_presentResponse);
+        YAZ_CHECK(has_id(s, wire.sent[2], "p1"));
+        // scan is taken by nobody
+        YAZ_CHECK_EQ(wire.sent[3]->which, Z_APDU_close);
+        YAZ_CHECK(has_id(s, wire.sent[3], "x"));
+    }
+
+    delete s;
+    odr_destroy(odr);
+    odr_destroy(wire.odr);
+}
+
+static void init_session(Z_Server *s, ODR odr, int preferredMessageSize)
+{
+    Z_APDU *apdu = mk_request(s, odr, Z_APDU_initRequest, 0);
+    *apdu->u.initRequest->preferredMessageSize = preferredMessageSize;
+    *apdu->u.initRequest->maximumRecordSize = 100000;
+    s->recv_Z_PDU(apdu, 0);
+}
+
+static Z_PresentResponse *present(Z_Server *s, ODR odr, Wire *wire,
+                                  int start, int count)
+{
+    Z_APDU *apdu = mk_request(s, odr, Z_APDU_presentRequest, 0);
+    *apdu->u.presentRequest->resultSetStartPoint = start;
+    *apdu->u.presentRequest->numberOfRecordsRequested = count;
+    int num_sent = wire->num_sent;
+    s->recv_Z_PDU(apdu, 0);
+    if (wire->num_sent != num_sent + 1)
+        return 0;
+    apdu = wire->sent[num_sent];
+    if (apdu->which != Z_APDU_presentResponse)
+        return 0;
+    return apdu->u.presentResponse;
+}
+
+static void tst_batch(void)
+{
+    Wire wire;
+    wire_init(&wire);
+    ODR odr = odr_createmem(ODR_ENCODE);
+    TestServer *s = new TestServer(new StubPDU(&wire, 0));
+    BatchRetrieval retrieval;
+    s->facility_add(&retrieval, "retrieval");
+    retrieval.hits = 1000;
+
+    /* room for 9 records, or 8 with what each takes besides its
+       data; the client asks for all. Only what is likely to fit is
+       asked of the backend: a single record, then a batch sized from
+       it */
+    init_session(s, odr, 10 * RECORD_SIZE);
+    Z_PresentResponse *res = present(s, odr, &wire, 1, 1000);
+    int num_returned = 0;
+    YAZ_CHECK(res);
+    if (res)
+    {
+        num_returned = *res->numberOfRecordsReturned;
+        YAZ_CHECK_EQ(*res->presentStatus, Z_PresentStatus_partial_2);
+        YAZ_CHECK(num_returned >= 8 && num_returned <= 9);
+        YAZ_CHECK_EQ(*res->nextResultSetPosition, num_returned + 1);
+    }
+    YAZ_CHECK_EQ(retrieval.num_calls, 2);
+    YAZ_CHECK(retrieval.num_asked <= 10);
+
+    // records fetched one by one are measured the same way
+    retrieval.batch = false;
+    init_session(s, odr, 10 * RECORD_SIZE);
+    res = present(s, odr, &wire, 1, 1000);
+    YAZ_CHECK(res);
+    if (res)
+    {
+        YAZ_CHECK_EQ(*res->presentStatus, Z_PresentStatus_partial_2);
+        YAZ_CHECK_EQ(*res->numberOfRecordsReturned, num_returned);
+    }
+    retrieval.batch = true;
+
+    // fewer at the end of the result set, with no diagnostics
+    retrieval.hits = 10;
+    init_session(s, odr, 1000 * RECORD_SIZE);
+    res = present(s, odr, &wire, 8, 5);
+    YAZ_CHECK(res);
+    if (res)
+    {
+        YAZ_CHECK_EQ(*res->presentStatus, Z_PresentStatus_success);
+        YAZ_CHECK_EQ(*res->numberOfRecordsReturned, 3);
+        Z_Records *records = res->records;
+        YAZ_CHECK(records && records->which == Z_Records_DBOSD);
+        if (records && records->which == Z_Records_DBOSD)
+        {
+            Z_NamePlusRecordList *list = records->u.databaseOrSurDiagnostics;
+            int i;
+            YAZ_CHECK_EQ(list->num_records, 3);
+            for (i = 0; i < list->num_records; i++)
+                YAZ_CHECK_EQ(list->records[i]->which,
+                             Z_NamePlusRecord_databaseRecord);
+        }
+    }
+
+    delete s;
+    odr_destroy(odr);
+    odr_destroy(wire.odr);
+}
+
+#if YAZ_POSIX_THREADS
+static void *complete_search(void *p)
+{
+    Z_ServerDeferred *deferred = (Z_ServerDeferred *) p;
+    *deferred->get_response()->u.searchResponse->resultCount = 42;
+    deferred->complete();
+    return 0;
+}
+
+// completes in another thread and wakes the session's event loop
+static void tst_deferred_thread(void)
+{
+    Wire wire;
+    wire_init(&wire);
+    ODR odr = odr_createmem(ODR_ENCODE);
+    SocketManager mgr;
+    TestServer *s = new TestServer(new StubPDU(&wire, &mgr));
+    MyRetrieval retrieval;
+    retrieval.set_async(true);
+    s->facility_add(&retrieval, "retrieval");
+
+    s->recv_Z_PDU(mk_request(s, odr, Z_APDU_searchRequest, "s1"), 0);
+    s->recv_Z_PDU(mk_request(s, odr, Z_APDU_presentRequest, "p1"), 0);
+    s->recv_Z_PDU(mk_request(s, odr, Z_APDU_presentRequest, "p2"), 0);
+    YAZ_CHECK_EQ(wire.num_sent, 0);
+    YAZ_CHECK(retrieval.deferred);
+    if (retrieval.deferred)
+    {
+        yaz_thread_t t = yaz_thread_create(complete_search,
+                                           retrieval.deferred);
+        retrieval.deferred = 0;
+        yaz_thread_join(&t, 0);
+        int i;
+        for (i = 0; i < 10 && wire.num_sent < 3; i++)
+            mgr.processEvent();
+    }
+    YAZ_CHECK_EQ(wire.num_sent, 3);
+    if (wire.num_sent == 3)
+    {
+        YAZ_CHECK_EQ(wire.sent[0]->which, Z_APDU_searchResponse);
+        YAZ_CHECK(has_id(s, wire.sent[0], "s1"));
+        if (wire.sent[0]->which == Z_APDU_searchResponse)
+            YAZ_CHECK_EQ(*wire.sent[0]->u.searchResponse->resultCount, 42);
+        YAZ_CHECK_EQ(wire.sent[1]->which, Z_APDU_presentResponse);
+        YAZ_CHECK(has_id(s, wire.sent[1], "p1"));
+        YAZ_CHECK_EQ(wire.sent[2]->which, Z_APDU_presentResponse);
+        YAZ_CHECK(has_id(s, wire.sent[2], "p2"));
+    }
+
+    delete s;
+    odr_destroy(odr);
+    odr_destroy(wire.odr);
+}
+
+// searches in a worker wait until the test opens the gate
+class GateRetrieval : public MyRetrieval {
+ public:
+    GateRetrieval(bool *deleted);
+    ~GateRetrieval();
+    void sr_search(Z_SearchRequest *searchRequest,
+                   Z_SearchResponse *searchResponse);
+    void wait_started();
+    void set_open(bool open);
+ private:
+    YAZ_MUTEX m_mutex;
+    YAZ_COND m_cond;
+    bool m_started;
+    bool m_open;
+    bool *m_deleted;
+};
+
+GateRetrieval::GateRetrieval(bool *deleted)
+{
+    m_deleted = deleted;
+    m_mutex = 0;
+    yaz_mutex_create(&m_mutex);
+    m_cond = 0;
+    yaz_cond_create(&m_cond);
+    m_started = false;
+    m_open = true;
+}
+
+GateRetrieval::~GateRetrieval()
+{
+    *m_deleted = true;
+    yaz_cond_destroy(&m_cond);
+    yaz_mutex_destroy(&m_mutex);
+}
+
+void GateRetrieval::sr_search(Z_SearchRequest *searchRequest,
+                              Z_SearchResponse *searchResponse)
+{
+    yaz_mutex_enter(m_mutex);
+    m_started = true;
+    yaz_cond_broadcast(m_cond);
+    while (!m_open)
+        yaz_cond_wait(m_cond, m_mutex, 0);
+    yaz_mutex_leave(m_mutex);
+    MyRetrieval::sr_search(searchRequest, searchResponse);
+}
+
+void GateRetrieval::wait_started()
+{
+    yaz_mutex_enter(m_mutex);
+    while (!m_started)
+        yaz_cond_wait(m_cond, m_mutex, 0);
+    yaz_mutex_leave(m_mutex);
+}
+
+void GateRetrieval::set_open(bool open)
+{
+    yaz_mutex_enter(m_mutex);
+    m_open = open;
+    if (!open)
+        m_started = false;
+    yaz_cond_broadcast(m_cond);
+    yaz_mutex_leave(m_mutex);
+}
+
+static void tst_workers(void)
+{
+    Wire wire;
+    wire_init(&wire);
+    ODR odr = odr_createmem(ODR_ENCODE);
+    SocketManager mgr;
+    bool deleted = false;
+    GateRetrieval *retrieval = new GateRetrieval(&deleted);
+    Z_ServerWorkers *workers = new Z_ServerWorkers(2);
+    retrieval->hits = 5;
+
+    // no event loop to wake: handled in the session's thread
+    TestServer *s = new TestServer(new StubPDU(&wire, 0));
+    s->facility_add(retrieval, "retrieval");
+    s->set_workers(workers);
+    s->recv_Z_PDU(mk_request(s, odr, Z_APDU_searchRequest, "s0"), 0);
+    YAZ_CHECK_EQ(wire.num_sent, 1);
+    YAZ_CHECK_EQ(retrieval->num_search, 1);
+    delete s;
+
+    // handled in a worker that wakes the event loop
+    s = new TestServer(new StubPDU(&wire, &mgr));
+    s->facility_add(retrieval, "retrieval");
+    s->set_workers(workers);
+    s->recv_Z_PDU(mk_request(s, odr, Z_APDU_searchRequest, "s1"), 0);
+    s->recv_Z_PDU(mk_request(s, odr, Z_APDU_presentRequest, "p1"), 0);
+    int i;
+    for (i = 0; i < 10 && wire.num_sent < 3; i++)
+        mgr.processEvent();
+    YAZ_CHECK_EQ(wire.num_sent, 3);
+    if (wire.num_sent == 3)
+    {
+        YAZ_CHECK_EQ(wire.sent[1]->which, Z_APDU_searchResponse);
+        YAZ_CHECK(has_id(s, wire.sent[1], "s1"));
+        if (wire.sent[1]->which == Z_APDU_searchResponse)
+            YAZ_CHECK_EQ(*wire.sent[1]->u.searchResponse->resultCount, 5);
+        YAZ_CHECK_EQ(wire.sent[2]->which, Z_APDU_presentResponse);
+        YAZ_CHECK(has_id(s, wire.sent[2], "p1"));
+    }
+    YAZ_CHECK_EQ(retrieval->num_search, 2);
+    YAZ_CHECK_EQ(retrieval->num_present, 1);
+
+    /* session and facility go away while a search runs: neither is
+       waited for. The worker deletes the facility when the search
+       returns, and the response is dropped */
+    retrieval->set_open(false);
+    s->recv_Z_PDU(mk_request(s, odr, Z_APDU_searchRequest, "s2"), 0);
+    retrieval->wait_started();
+    delete s;
+    retrieval->destroy();
+    YAZ_CHECK(!deleted);
+    YAZ_CHECK_EQ(retrieval->num_search, 2);
+    retrieval->set_open(true);
+    delete workers;
+    YAZ_CHECK(deleted);
+    YAZ_CHECK_EQ(wire.num_sent, 3);
+
+    odr_destroy(odr);
+    odr_destroy(wire.odr);
+}
+#endif
+
+int main(int argc, char **argv)
+{
+    YAZ_CHECK_INIT(argc, argv);
+    tst_dispatch();
+    tst_deferred();
+    tst_batch();
+#if YAZ_POSIX_THREADS
+    tst_deferred_thread();
+    tst_workers();
+#endif
+    YAZ_CHECK_TERM;
+}
+
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
@@ -6,47 +6,466 @@
 #if HAVE_CONFIG_H
 #include <config.h>
 #endif
+#ifdef WIN32
+#include <windows.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#include <yaz/mutex.h>
+#include <yaz/thread_create.h>
+#include <yaz/gettimeofday.h>
 #include <yaz/log.h>
 #include <yaz/diagsrw.h>
 #include <yaz/pquery.h>
-#include <yaz/sortspec.h>
+#include <yaz/xmalloc.h>
 #include <yazpp/cql2rpn.h>
 #include <yaz/rpn2cql.h>
+#include "cache-table.h"
 
 using namespace yazpp_1;
 
+#ifdef WIN32
+#define atomic_add(p, v) InterlockedExchangeAdd((p), (v))
+typedef LONG atomic_int;
+#else
+#define atomic_add(p, v) __sync_fetch_and_add((p), (v))
+typedef int atomic_int;
+#endif
+#define atomic_read(p) atomic_add((p), 0)
+
+// number of worker lists and cache partitions; power of 2
+#define CQL2RPN_STRIPES 16
+
+/* Memoized translation. Entry, CQL string and result (BER encoded
+   RPN or, for failures, the addinfo) are allocated in one block */
+struct Yaz_cql2rpn_Entry : CacheNode {
+    char *cql;
+    int generation;               // of transform that made it
+    unsigned stamp;               // last use; for LRU across stripes
+    int error;                    // 0 = BER encoded RPN in buf
+    char *buf;                    // RPN or addinfo (0-terminated)
+    int len;
+};
+
+/* Compiled mapping. Never modified once installed; a reload installs
+   a new one and the old one is closed when the last worker using it
+   has let go of it */
+struct Yaz_cql2rpn_Transform {
+    cql_transform_t ct;
+    volatile atomic_int refcount;
+    int generation;
+};
+
+struct Yaz_cql2rpn_Stripe;
+
+/* Per-query state. Kept on a free list so that parsers are reused, but
+   never used by two threads at once. Holds a reference to the mapping
+   it last used so that queries need not take the global mutex */
+struct Yaz_cql2rpn_Worker {
+    CQL_parser parser;
+    YAZ_PQF_Parser pqf_parser;
+    ODR encode;
+    ODR decode;
+    Yaz_cql2rpn_Transform *t;
+    Yaz_cql2rpn_Stripe *stripe;   // free list it belongs to
+    Yaz_cql2rpn_Worker *next;
+};
+
+/* Threads spread over the stripes: workers round robin, translations
+   by hash of the CQL string. So queries running at the same time
+   rarely wait for the same mutex */
+struct Yaz_cql2rpn_Stripe {
+    YAZ_MUTEX mutex;              // protects everything below
+    Yaz_cql2rpn_Worker *workers;
+    CacheTable table;
+    long hits;
+    long misses;
+};
+
+class Yaz_cql2rpn::Rep {
+    friend class Yaz_cql2rpn;
+    YAZ_MUTEX mutex;              // protects transform, fname, mtime
+    YAZ_COND cond;                // wakes reload thread
+    yaz_thread_t thread;          // reload thread; 0 if none
+    int stop;
+    int interval;                 // seconds between reload checks
+    Yaz_cql2rpn_Transform *transform;
+    volatile atomic_int generation;  // of transform; 0 = none yet
+    char *fname;                  // file of current transform
+    long mtime;
+    Yaz_cql2rpn_Stripe stripes[CQL2RPN_STRIPES];
+    volatile atomic_int next_stripe;
+    volatile atomic_int num_entries;
+    volatile atomic_int max_entries;  // 0 = no cache
+    volatile atomic_int clock;        // source of Entry::stamp
+    Yaz_cql2rpn_Entry *find(Yaz_cql2rpn_Stripe *s, unsigned hash,
+                            const char *cql);
+    void remove(Yaz_cql2rpn_Stripe *s, Yaz_cql2rpn_Entry *entry);
+    void touch(Yaz_cql2rpn_Stripe *s, Yaz_cql2rpn_Entry *entry);
+    Yaz_cql2rpn_Entry *lru_tail(Yaz_cql2rpn_Stripe *s);
+    bool evict_oldest();
+    void clear(Yaz_cql2rpn_Stripe *s);
+    void release_transform(Yaz_cql2rpn_Transform *t);
+    bool install(const char *fname, bool replace);
+    int reload();
+    static void *reload_main(void *p);
+    void stop_reload();
+    Yaz_cql2rpn_Worker *get_worker();
+    void release_worker(Yaz_cql2rpn_Worker *w);
+    void destroy_worker(Yaz_cql2rpn_Worker *w);
+    int transform_query(Yaz_cql2rpn_Worker *w, const char *cql_query,
+                        Z_RPNQuery **rpnquery, ODR o, WRBUF addinfo);
+};
+
+static long file_mtime(const char *fname)
+{
+#if HAVE_SYS_STAT_H
+    struct stat st;
+    if (stat(fname, &st) == 0)
+        return (long) st.st_mtime;
+#endif
+    return -1;
+}
+
+Yaz_cql2rpn_Entry *Yaz_cql2rpn::Rep::find(Yaz_cql2rpn_Stripe *s,
+                                          unsigned hash, const char *cql)
+{
+    Yaz_cql2rpn_Entry *entry =
+        static_cast<Yaz_cql2rpn_Entry *>(s->table.chain(hash));
+    for (; entry; entry = static_cast<Yaz_cql2rpn_Entry *>(entry->next))
+        if (entry->hash == hash && !strcmp(entry->cql, cql))
+            break;
+    return entry;
+}
+
+void Yaz_cql2rpn::Rep::remove(Yaz_cql2rpn_Stripe *s,
+                              Yaz_cql2rpn_Entry *entry)
+{
+    s->table.remove(entry);
+    atomic_add(&num_entries, -1);
+    xfree(entry);
+}
+
+void Yaz_cql2rpn::Rep::touch(Yaz_cql2rpn_Stripe *s,
+                             Yaz_cql2rpn_Entry *entry)
+{
+    s->table.touch(entry);
+    entry->stamp = (unsigned) atomic_add(&clock, 1);
+}
+
+Yaz_cql2rpn_Entry *Yaz_cql2rpn::Rep::lru_tail(Yaz_cql2rpn_Stripe *s)
+{
+    return static_cast<Yaz_cql2rpn_Entry *>(s->table.lru_tail);
+}
+
+/* Removes the least recently used translation of all stripes. Only one
+   stripe is locked at a time, so the choice may be slightly off when
+   other threads use the cache meanwhile. Returns false if the cache
+   was empty */
+bool Yaz_cql2rpn::Rep::evict_oldest()
+{
+    int i, oldest = -1;
+    unsigned stamp = 0;
+    for (i = 0; i < CQL2RPN_STRIPES; i++)
+    {
+        Yaz_cql2rpn_Stripe *s = stripes + i;
+        yaz_mutex_enter(s->mutex);
+        Yaz_cql2rpn_Entry *entry = lru_tail(s);
+        if (entry && (oldest == -1 || (int) (entry->stamp - stamp) < 0))
+        {
+            oldest = i;
+            stamp = entry->stamp;
+        }
+        yaz_mutex_leave(s->mutex);
+    }
+    if (oldest == -1)
+        return false;
+    Yaz_cql2rpn_Stripe *s = stripes + oldest;
+    yaz_mutex_enter(s->mutex);
+    if (lru_tail(s))
+        remove(s, lru_tail(s));
+    yaz_mutex_leave(s->mutex);
+    return true;
+}
+
+void Yaz_cql2rpn::Rep::clear(Yaz_cql2rpn_Stripe *s)
+{
+    while (s->table.lru_tail)
+        remove(s, lru_tail(s));
+    s->table.destroy();
+}
+
+// references are only added under mutex while t is current
+void Yaz_cql2rpn::Rep::release_transform(Yaz_cql2rpn_Transform *t)
+{
+    if (t && atomic_add(&t->refcount, -1) == 1)
+    {
+        cql_transform_close(t->ct);
+        xfree(t);
+    }
+}
+
+/* Reads fname and makes it the current transform. The file is parsed
+   without holding the mutex so that queries keep running with the
+   previous transform meanwhile. Returns false (and keeps the previous
+   transform) if fname could not be read */
+bool Yaz_cql2rpn::Rep::install(const char *fname, bool replace)
+{
+    long new_mtime = file_mtime(fname);
+    cql_transform_t ct = cql_transform_open_fname(fname);
+    if (!ct)
+    {
+        yaz_log(YLOG_WARN, "cql2rpn: could not read %s", fname);
+        return false;
+    }
+    Yaz_cql2rpn_Transform *t = (Yaz_cql2rpn_Transform *)
+        xmalloc(sizeof(*t));
+    t->ct = ct;
+    t->refcount = 1;
+
+    yaz_mutex_enter(mutex);
+    Yaz_cql2rpn_Transform *old = transform;
+    if (old && !replace)
+        old = t;  // lost the race against another set_pqf_file
+    else
+    {
+        t->generation = atomic_add(&generation, 1) + 1;
+        transform = t;
+        if (fname != this->fname)
+        {
+            xfree(this->fname);
+            this->fname = xstrdup(fname);
+        }
+        mtime = new_mtime;
+    }
+    yaz_mutex_leave(mutex);
+    if (old == t)
+    {
+        release_transform(t);
+        return true;
+    }
+    int i;
+    for (i = 0; i < CQL2RPN_STRIPES; i++)
+    {
+        // translations of the old mapping and idle references to it
+        Yaz_cql2rpn_Stripe *s = stripes + i;
+        yaz_mutex_enter(s->mutex);
+        clear(s);
+        Yaz_cql2rpn_Worker *w;
+        for (w = s->workers; w; w = w->next)
+            if (w->t && w->t->generation != t->generation)
+            {
+                release_transform(w->t);
+                w->t = 0;
+            }
+        yaz_mutex_leave(s->mutex);
+    }
+    release_transform(old);
+    return true;
+}
+
+int Yaz_cql2rpn::Rep::reload()
+{
+    yaz_mutex_enter(mutex);
+    char *fname = this->fname ? xstrdup(this->fname) : 0;
+    long mtime = this->mtime;
+    yaz_mutex_leave(mutex);
+    int r = 0;
+    if (fname && (mtime == -1 || file_mtime(fname) != mtime))
+        r = install(fname, true) ? 1 : -1;
+    xfree(fname);
+    return r;
+}
+
+void *Yaz_cql2rpn::Rep::reload_main(void *p)
+{
+    Rep *rep = (Rep *) p;
+    yaz_mutex_enter(rep->mutex);
+    while (!rep->stop)
+    {
+        struct timeval abstime;
+        yaz_gettimeofday(&abstime);
+        abstime.tv_sec += rep->interval;
+        yaz_cond_wait(rep->cond, rep->mutex, &abstime);
+        if (!rep->stop)
+        {
+            yaz_mutex_leave(rep->mutex);
+            rep->reload();
+            yaz_mutex_enter(rep->mutex);
+        }
+    }
+    yaz_mutex_leave(rep->mutex);
+    return 0;
+}
+
+void Yaz_cql2rpn::Rep::stop_reload()
+{
+    if (thread)
+    {
+        yaz_mutex_enter(mutex);
+        stop = 1;
+        yaz_cond_signal(cond);
+        yaz_mutex_leave(mutex);
+        yaz_thread_join(&thread, 0);
+        thread = 0;
+    }
+}
+
+/* Worker whose t is the current transform (0 if none is loaded). Only
+   takes the global mutex if the mapping was replaced since the worker
+   was last used */
+Yaz_cql2rpn_Worker *Yaz_cql2rpn::Rep::get_worker()
+{
+    Yaz_cql2rpn_Stripe *s = stripes +
+        (atomic_add(&next_stripe, 1) & (CQL2RPN_STRIPES - 1));
+    yaz_mutex_enter(s->mutex);
+    Yaz_cql2rpn_Worker *w = s->workers;
+    if (w)
+        s->workers = w->next;
+    yaz_mutex_leave(s->mutex);
+    if (!w)
+    {
+        w = new Yaz_cql2rpn_Worker;
+        w->parser = cql_parser_create();
+        w->pqf_parser = yaz_pqf_create();
+        w->encode = odr_createmem(ODR_ENCODE);
+        w->decode = odr_createmem(ODR_DECODE);
+        w->t = 0;
+        w->stripe = s;
+    }
+    if (!w->t || w->t->generation != atomic_read(&generation))
+    {
+        yaz_mutex_enter(mutex);
+        Yaz_cql2rpn_Transform *t = transform;
+        if (t)
+            atomic_add(&t->refcount, 1);
+        yaz_mutex_leave(mutex);
+        release_transform(w->t);
+        w->t = t;
+    }
+    return w;
+}
+
+void Yaz_cql2rpn::Rep::release_worker(Yaz_cql2rpn_Worker *w)
+{
+    Yaz_cql2rpn_Stripe *s = w->stripe;
+    odr_reset(w->encode);
+    odr_reset(w->decode);
+    yaz_mutex_enter(s->mutex);
+    w->next = s->workers;
+    s->workers = w;
+    yaz_mutex_leave(s->mutex);
+}
+
+void Yaz_cql2rpn::Rep::destroy_worker(Yaz_cql2rpn_Worker *w)
+{
+    release_transform(w->t);
+    cql_parser_destroy(w->parser);
+    yaz_pqf_destroy(w->pqf_parser);
+    odr_destroy(w->encode);
+    odr_destroy(w->decode);
+    delete w;
+}
+
 Yaz_cql2rpn::Yaz_cql2rpn()
 {
-    m_transform = 0;
+    m_p = new Rep;
+    m_p->mutex = 0;
+    yaz_mutex_create(&m_p->mutex);
+    m_p->cond = 0;
+    yaz_cond_create(&m_p->cond);
+    m_p->thread = 0;
+    m_p->stop = 0;
+    m_p->interval = 0;
+    m_p->transform = 0;
+    m_p->generation = 0;
+    m_p->fname = 0;
+    m_p->mtime = -1;
+    int i;
+    for (i = 0; i < CQL2RPN_STRIPES; i++)
+    {
+        Yaz_cql2rpn_Stripe *s = m_p->stripes + i;
+        s->mutex = 0;
+        yaz_mutex_create(&s->mutex);
+        s->workers = 0;
+        s->table.init();
+        s->hits = 0;
+        s->misses = 0;
+    }
+    m_p->next_stripe = 0;
+    m_p->num_entries = 0;
+    m_p->max_entries = 0;
+    m_p->clock = 0;
 }
 
 Yaz_cql2rpn::~Yaz_cql2rpn()
 {
-    if (m_transform)
-        cql_transform_close(m_transform);
+    m_p->stop_reload();
+    int i;
+    for (i = 0; i < CQL2RPN_STRIPES; i++)
+    {
+        Yaz_cql2rpn_Stripe *s = m_p->stripes + i;
+        while (s->workers)
+        {
+            Yaz_cql2rpn_Worker *w = s->workers;
+            s->workers = w->next;
+            m_p->destroy_worker(w);
+        }
+        m_p->clear(s);
+        yaz_mutex_destroy(&s->mutex);
+    }
+    m_p->release_transform(m_p->transform);
+    xfree(m_p->fname);
+    yaz_cond_destroy(&m_p->cond);
+    yaz_mutex_destroy(&m_p->mutex);
+    delete m_p;
 }
 
 void Yaz_cql2rpn::set_pqf_file(const char *fname)
 {
-    if (!m_transform)
-        m_transform = cql_transform_open_fname(fname);
+    if (!atomic_read(&m_p->generation))
+        m_p->install(fname, false);
 }
 
-
 bool Yaz_cql2rpn::parse_spec_file(const char *fname, int *error)
 {
     *error = 0;
-    cql_transform_close(m_transform);
-    m_transform = cql_transform_open_fname(fname);
-    return m_transform ? true : false;
+    return m_p->install(fname, true);
+}
+
+int Yaz_cql2rpn::reload_if_modified()
+{
+    return m_p->reload();
+}
+
+void Yaz_cql2rpn::set_reload_interval(int seconds)
+{
+    m_p->stop_reload();
+    if (seconds > 0)
+    {
+        m_p->stop = 0;
+        m_p->interval = seconds;
+        m_p->thread = yaz_thread_create(Rep::reload_main, m_p);
+    }
 }
 
 int Yaz_cql2rpn::rpn2cql_transform(Z_RPNQuery *q, WRBUF cql, ODR o,
                                    char **addinfop)
 {
+    Yaz_cql2rpn_Worker *w = m_p->get_worker();
+    if (!w->t)
+    {
+        m_p->release_worker(w);
+        return -3;
+    }
     WRBUF addinfo = wrbuf_alloc();
-    int r = cql_transform_rpn2cql_stream_r(m_transform, addinfo,
+    int r = cql_transform_rpn2cql_stream_r(w->t->ct, addinfo,
                                            wrbuf_vp_puts, cql, q);
+    m_p->release_worker(w);
     if (r && wrbuf_len(addinfo))
         *addinfop = odr_strdup_null(o, wrbuf_cstr(addinfo));
     else
@@ -55,17 +474,165 @@ int Yaz_cql2rpn::rpn2cql_transform(Z_RPNQuery *q, WRBUF cql, ODR o,
     return r;
 }
 
-int Yaz_cql2rpn::query_transform(const char *cql_query,
-                                 Z_RPNQuery **rpnquery, ODR o,
-                                 char **addinfop)
+// sort direction from modifiers of a sort key; -1 if unsupported
+static int sort_relation(struct cql_node *mod)
 {
-    if (!m_transform)
-        return -3;
-    CQL_parser cp = cql_parser_create();
-    WRBUF addinfo = wrbuf_alloc();
+    int relation = 1;  // ascending
+    for (; mod; mod = mod->u.st.modifiers)
+    {
+        const char *name = mod->u.st.index;
+        if (!strncmp(name, "sort.", 5))
+            name += 5;
+        if (!strcmp(name, "ascending"))
+            relation = 1;
+        else if (!strcmp(name, "descending"))
+            relation = 2;
+        else if (strcmp(name, "ignoreCase") && strcmp(name, "respectCase")
+                 && strcmp(name, "missingOmit") && strcmp(name, "missingFail")
+                 && strcmp(name, "missingLow") && strcmp(name, "missingHigh"))
+            return -1;
+    }
+    return relation;
+}
+
+static Z_AttributeElement *mk_attr(ODR o, int type, int value,
+                                   const char *str)
+{
+    Z_AttributeElement *el = (Z_AttributeElement *)
+        odr_malloc(o, sizeof(*el));
+    el->attributeSet = 0;
+    el->attributeType = odr_intdup(o, type);
+    if (str)
+    {
+        Z_StringOrNumeric *s = (Z_StringOrNumeric *)
+            odr_malloc(o, sizeof(*s));
+        s->which = Z_StringOrNumeric_string;
+        s->u.string = odr_strdup(o, str);
+        el->which = Z_AttributeValue_complex;
+        el->value.complex = (Z_ComplexAttribute *)
+            odr_malloc(o, sizeof(*el->value.complex));
+        el->value.complex->num_list = 1;
+        el->value.complex->list = (Z_StringOrNumeric **)
+            odr_malloc(o, sizeof(*el->value.complex->list));
+        el->value.complex->list[0] = s;
+        el->value.complex->num_semanticAction = 0;
+        el->value.complex->semanticAction = 0;
+    }
+    else
+    {
+        el->which = Z_AttributeValue_numeric;
+        el->value.numeric = odr_intdup(o, value);
+    }
+    return el;
+}
+
+/* 1=index with a numeric value if index is a number, as PQF reads it */
+static Z_AttributeElement *mk_use_attr(ODR o, const char *index)
+{
+    const char *cp = index;
+    while (*cp >= '0' && *cp <= '9')
+        cp++;
+    if (cp != index && !*cp)
+        return mk_attr(o, 1, atoi(index), 0);
+    return mk_attr(o, 1, 0, index);
+}
+
+/* Adds the sort keys of sortby as type-7 operands, the same tree that
+   yaz_sort_spec_to_type7 gives in PQF: @or @or query key0 key1 .. where
+   key i is @attr 1=index @attr 7=relation i */
+static int add_sort_keys(ODR o, Z_RPNQuery *q, struct cql_node *cn)
+{
+    int i;
+    for (i = 0; cn && cn->which == CQL_NODE_SORT; cn = cn->u.sort.next, i++)
+    {
+        int relation = sort_relation(cn->u.sort.modifiers);
+        if (relation == -1)
+            return -1;
+        char num[20];
+        sprintf(num, "%d", i);
+
+        Z_AttributesPlusTerm *apt = (Z_AttributesPlusTerm *)
+            odr_malloc(o, sizeof(*apt));
+        apt->attributes = (Z_AttributeList *)
+            odr_malloc(o, sizeof(*apt->attributes));
+        apt->attributes->num_attributes = 2;
+        apt->attributes->attributes = (Z_AttributeElement **)
+            odr_malloc(o, 2 * sizeof(Z_AttributeElement *));
+        apt->attributes->attributes[0] = mk_use_attr(o, cn->u.sort.index);
+        apt->attributes->attributes[1] = mk_attr(o, 7, relation, 0);
+        apt->term = (Z_Term *) odr_malloc(o, sizeof(*apt->term));
+        apt->term->which = Z_Term_general;
+        apt->term->u.general = odr_create_Odr_oct(o, num, strlen(num));
+
+        Z_RPNStructure *key = (Z_RPNStructure *) odr_malloc(o, sizeof(*key));
+        key->which = Z_RPNStructure_simple;
+        key->u.simple = (Z_Operand *) odr_malloc(o, sizeof(Z_Operand));
+        key->u.simple->which = Z_Operand_APT;
+        key->u.simple->u.attributesPlusTerm = apt;
+
+        Z_RPNStructure *s = (Z_RPNStructure *) odr_malloc(o, sizeof(*s));
+        s->which = Z_RPNStructure_complex;
+        s->u.complex = (Z_Complex *) odr_malloc(o, sizeof(Z_Complex));
+        s->u.complex->s1 = q->RPNStructure;
+        s->u.complex->s2 = key;
+        s->u.complex->roperator = (Z_Operator *)
+            odr_malloc(o, sizeof(Z_Operator));
+        s->u.complex->roperator->which = Z_Operator_or;
+        s->u.complex->roperator->u.op_or = odr_nullval();
+        q->RPNStructure = s;
+    }
+    return 0;
+}
+
+void Yaz_cql2rpn::set_cache_size(int max_entries)
+{
+    m_p->max_entries = max_entries > 0 ? max_entries : 0;
+    while (atomic_read(&m_p->num_entries) > atomic_read(&m_p->max_entries))
+        if (!m_p->evict_oldest())
+            break;
+}
+
+int Yaz_cql2rpn::get_cache_entries()
+{
+    return atomic_read(&m_p->num_entries);
+}
+
+long Yaz_cql2rpn::get_cache_hits()
+{
+    long n = 0;
+    int i;
+    for (i = 0; i < CQL2RPN_STRIPES; i++)
+    {
+        yaz_mutex_enter(m_p->stripes[i].mutex);
+        n += m_p->stripes[i].hits;
+        yaz_mutex_leave(m_p->stripes[i].mutex);
+    }
+    return n;
+}
+
+long Yaz_cql2rpn::get_cache_misses()
+{
+    long n = 0;
+    int i;
+    for (i = 0; i < CQL2RPN_STRIPES; i++)
+    {
+        yaz_mutex_enter(m_p->stripes[i].mutex);
+        n += m_p->stripes[i].misses;
+        yaz_mutex_leave(m_p->stripes[i].mutex);
+    }
+    return n;
+}
+
+int Yaz_cql2rpn::Rep::transform_query(Yaz_cql2rpn_Worker *w,
+                                      const char *cql_query,
+                                      Z_RPNQuery **rpnquery, ODR o,
+                                      WRBUF addinfo)
+{
+    CQL_parser parser = w->parser;
+    YAZ_PQF_Parser pqf_parser = w->pqf_parser;
     const char *lead = "query_transform::query_transform";
 
-    int r = cql_parser_string(cp, cql_query);
+    int r = cql_parser_string(parser, cql_query);
     if (r)
     {
         wrbuf_printf(addinfo, "%s:cql_parser_string failed: %s",
@@ -74,53 +641,154 @@ int Yaz_cql2rpn::query_transform(const char *cql_query,
     }
     else
     {
+        struct cql_node *cn = cql_parser_result(parser);
+        /* YAZ gives the mapping of the properties file only as PQF
+           text, so the search clauses are rendered and parsed once;
+           the sort keys are built straight into the tree */
         WRBUF pqf = wrbuf_alloc();
-        r = cql_transform_r(m_transform, cql_parser_result(cp), addinfo,
-                            wrbuf_vp_puts, pqf);
+        r = cql_transform_r(w->t->ct, cn, addinfo, wrbuf_vp_puts, pqf);
         if (!r)
         {
-            WRBUF sortkeys = wrbuf_alloc();
-            WRBUF sortspec = wrbuf_alloc();
-            if (cql_sortby_to_sortkeys(cql_parser_result(cp),
-                                       wrbuf_vp_puts, sortkeys))
-            {
-                wrbuf_printf(addinfo, "%s: cql_parser_string failed: %s",
-                             lead, cql_query);
-                r = YAZ_SRW_UNSUPP_SORT_TYPE;
-            }
-            else
-            {
-                yaz_srw_sortkeys_to_sort_spec(wrbuf_cstr(sortkeys), sortspec);
-                Z_SortKeySpecList *sksl =
-                    yaz_sort_spec(o, wrbuf_cstr(sortspec));
-                if (sksl)
-                    yaz_sort_spec_to_type7(sksl, pqf);
-            }
-            wrbuf_destroy(sortspec);
-            wrbuf_destroy(sortkeys);
-
-            YAZ_PQF_Parser pp = yaz_pqf_create();
-
-            *rpnquery = yaz_pqf_parse(pp, o, wrbuf_cstr(pqf));
+            *rpnquery = yaz_pqf_parse(pqf_parser, o, wrbuf_cstr(pqf));
             if (!*rpnquery)
             {
                 size_t off;
                 const char *pqf_msg;
-                yaz_pqf_error(pp, &pqf_msg, &off);
+                yaz_pqf_error(pqf_parser, &pqf_msg, &off);
                 wrbuf_printf(addinfo, "%s: yaz_pqf_parse failed: %s",
                              lead, wrbuf_cstr(pqf));
                 r = YAZ_SRW_SYSTEM_TEMPORARILY_UNAVAILABLE;
             }
-            yaz_pqf_destroy(pp);
+            else if (add_sort_keys(o, *rpnquery, cn))
+            {
+                wrbuf_printf(addinfo, "%s: unsupported sort modifier: %s",
+                             lead, cql_query);
+                r = YAZ_SRW_UNSUPP_SORT_TYPE;
+            }
         }
         wrbuf_destroy(pqf);
     }
-    cql_parser_destroy(cp);
+    return r;
+}
+
+int Yaz_cql2rpn::query_transform(const char *cql_query,
+                                 Z_RPNQuery **rpnquery, ODR o,
+                                 char **addinfop)
+{
+    Yaz_cql2rpn_Worker *w = m_p->get_worker();
+    Yaz_cql2rpn_Transform *t = w->t;
+    if (!t)
+    {
+        m_p->release_worker(w);
+        return -3;
+    }
+    unsigned hash = cache_hash_bytes(CACHE_HASH_INIT, cql_query,
+                                     strlen(cql_query));
+    Yaz_cql2rpn_Stripe *s =
+        m_p->stripes + ((hash >> 16) & (CQL2RPN_STRIPES - 1));
+    int r = 0;
+    bool hit = false;
+
+    bool use_cache = atomic_read(&m_p->max_entries) > 0;
+    if (use_cache)
+    {
+        yaz_mutex_enter(s->mutex);
+        Yaz_cql2rpn_Entry *entry = m_p->find(s, hash, cql_query);
+        if (entry && entry->generation != t->generation)
+        {
+            m_p->remove(s, entry);  // made by a mapping now replaced
+            entry = 0;
+        }
+        if (entry)
+        {
+            // copy out; entry may be evicted once mutex is released
+            r = entry->error;
+            *addinfop = 0;
+            if (r)
+                *addinfop = entry->len ? odr_strdup(o, entry->buf) : 0;
+            else
+            {
+                char *buf = (char *) odr_malloc(w->decode, entry->len);
+                memcpy(buf, entry->buf, entry->len);
+                odr_setbuf(w->decode, buf, entry->len, 0);
+            }
+            m_p->touch(s, entry);
+            s->hits++;
+            hit = true;
+        }
+        else
+            s->misses++;
+        yaz_mutex_leave(s->mutex);
+    }
+
+    if (hit)
+    {
+        if (!r)
+        {
+            if (!z_RPNQuery(w->decode, rpnquery, 0, 0))
+                r = YAZ_SRW_SYSTEM_TEMPORARILY_UNAVAILABLE;
+            else
+                nmem_transfer(o->mem, w->decode->mem);
+        }
+        m_p->release_worker(w);
+        return r;
+    }
+
+    WRBUF addinfo = wrbuf_alloc();
+    r = m_p->transform_query(w, cql_query, rpnquery, o, addinfo);
     if (r && wrbuf_len(addinfo))
         *addinfop = odr_strdup_null(o, wrbuf_cstr(addinfo));
     else
         *addinfop = 0;
     wrbuf_destroy(addinfo);
+
+    if (use_cache)
+    {
+        char *buf = 0;
+        int len = 0;
+        if (r)
+        {
+            buf = *addinfop;
+            len = buf ? strlen(buf) + 1 : 0;
+        }
+        else if (z_RPNQuery(w->encode, rpnquery, 0, 0))
+            buf = odr_getbuf(w->encode, &len, 0);
+        if (buf || r)
+        {
+            int cql_len = strlen(cql_query) + 1;
+            Yaz_cql2rpn_Entry *entry = (Yaz_cql2rpn_Entry *)
+                xmalloc(sizeof(*entry) + cql_len + len);
+            entry->hash = hash;
+            entry->cql = (char *) (entry + 1);
+            memcpy(entry->cql, cql_query, cql_len);
+            entry->generation = t->generation;
+            entry->error = r;
+            entry->buf = entry->cql + cql_len;
+            entry->len = len;
+            if (len)
+                memcpy(entry->buf, buf, len);
+
+            // make room first; evict_oldest locks the stripes itself
+            while (atomic_read(&m_p->num_entries)
+                   >= atomic_read(&m_p->max_entries))
+                if (!m_p->evict_oldest())
+                    break;
+            yaz_mutex_enter(s->mutex);
+            // not if mapping was reloaded or another thread got there first
+            if (t->generation != atomic_read(&m_p->generation)
+                || !atomic_read(&m_p->max_entries)
+                || m_p->find(s, hash, cql_query))
+                xfree(entry);
+            else
+            {
+                s->table.insert(entry);
+                atomic_add(&m_p->num_entries, 1);
+                m_p->touch(s, entry);
+            }
+            yaz_mutex_leave(s->mutex);
+        }
+    }
+    m_p->release_worker(w);
     return r;
 }
 /*
@@ -131,4 +799,3 @@ int Yaz_cql2rpn::query_transform(const char *cql_query,
  * End:
  * vim: shiftwidth=4 tabstop=8 expandtab
  */
-
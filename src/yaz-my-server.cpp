@@ -49,6 +49,12 @@ public:
                     Z_RecordComposition *comp,
                     Z_NamePlusRecord *namePlusRecord,
                     Z_Records *records);
+    int sr_records (const char *resultSetName,
+                    int start, int count,
+                    Odr_oid *format,
+                    Z_RecordComposition *comp,
+                    Z_NamePlusRecord **namePlusRecords,
+                    Z_Records *records);
 };
 
 class MyServer : public Z_Server {
@@ -62,7 +68,7 @@ public:
     void connectNotify();
 
 private:
-    MyRetrieval m_retrieval;
+    MyRetrieval *m_retrieval;   // may outlive the session in a worker
     MyILL       m_ill;
     MyUpdate    m_update;
     int m_no;
@@ -140,8 +146,30 @@ void MyRetrieval::sr_record (const char *resultSetName,
                                     YAZ_BIB1_PRESENT_REQUEST_OUT_OF_RANGE, 0);
 }
 
+int MyRetrieval::sr_records (const char *resultSetName,
+                             int start, int count,
+                             Odr_oid *format,
+                             Z_RecordComposition *comp,
+                             Z_NamePlusRecord **namePlusRecords,
+                             Z_Records *records)
+{
+    yaz_log (YLOG_LOG, "MyServer::recv_Z_records %d+%d", start, count);
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        const char *rec = get_record(start + i);
+        if (!rec)
+            break;      // end of the sample records
+        create_databaseRecord(odr_encode(), namePlusRecords[i], 0,
+                              yaz_oid_recsyn_usmarc, rec, strlen(rec));
+    }
+    return i;
+}
+
 MyServer::~MyServer()
 {
+    facility_reset();
+    m_retrieval->destroy();
 }
 
 IPDU_Observer *MyServer::sessionNotify(
@@ -151,10 +179,12 @@ IPDU_Observer *MyServer::sessionNotify(
     m_no++;
     new_server = new MyServer(the_PDU_Observable);
     new_server->timeout(900);
-    new_server->facility_add(&new_server->m_retrieval, "my sr");
+    new_server->facility_add(new_server->m_retrieval, "my sr");
     new_server->facility_add(&new_server->m_ill, "my ill");
     new_server->facility_add(&new_server->m_update, "my update");
     new_server->set_APDU_log(get_APDU_log());
+    new_server->set_APDU_capture(get_APDU_capture());
+    new_server->set_workers(get_workers());
 
     return new_server;
 }
@@ -162,6 +192,7 @@ IPDU_Observer *MyServer::sessionNotify(
 MyServer::MyServer(IPDU_Observable *the_PDU_Observable) :
     Z_Server (the_PDU_Observable)
 {
+    m_retrieval = new MyRetrieval;
     m_no = 0;
 }
 
@@ -183,7 +214,8 @@ void MyServer::connectNotify()
 
 void usage(const char *prog)
 {
-    fprintf (stderr, "%s: [-a log] [-v level] [-T] @:port\n", prog);
+    fprintf (stderr, "%s: [-a log] [-c capture] [-v level] [-T] [-w threads] "
+             "@:port\n", prog);
     exit (1);
 }
 
@@ -195,6 +227,8 @@ int main(int argc, char **argv)
     const char *addr = "tcp:@:9999";
     const char *cert_fname = 0;
     char *apdu_log = 0;
+    char *apdu_capture = 0;
+    int num_workers = 0;
 
     SocketManager mySocketManager;
 
@@ -203,7 +237,7 @@ int main(int argc, char **argv)
     MyServer *z = 0;
     int ret;
 
-    while ((ret = options("a:C:v:T", argv, argc, &arg)) != -2)
+    while ((ret = options("a:c:C:v:Tw:", argv, argc, &arg)) != -2)
     {
         switch (ret)
         {
@@ -213,6 +247,9 @@ int main(int argc, char **argv)
         case 'a':
             apdu_log = xstrdup(arg);
             break;
+        case 'c':
+            apdu_capture = xstrdup(arg);
+            break;
         case 'C':
             cert_fname = xstrdup(arg);
             break;
@@ -222,6 +259,9 @@ int main(int argc, char **argv)
         case 'T':
             thread_flag = 1;
             break;
+        case 'w':
+            num_workers = atoi(arg);
+            break;
         default:
             usage(prog);
             return 1;
@@ -245,10 +285,23 @@ int main(int argc, char **argv)
         yaz_log (YLOG_LOG, "set_APDU_log %s", apdu_log);
         z->set_APDU_log(apdu_log);
     }
+    if (apdu_capture)
+    {
+        yaz_log (YLOG_LOG, "set_APDU_capture %s", apdu_capture);
+        z->set_APDU_capture(apdu_capture);
+    }
+    Z_ServerWorkers *workers = 0;
+    if (num_workers > 0)
+    {
+        yaz_log (YLOG_LOG, "%d worker threads", num_workers);
+        workers = new Z_ServerWorkers(num_workers);
+        z->set_workers(workers);
+    }
 
     while (mySocketManager.processEvent() > 0)
         ;
     delete z;
+    delete workers;
     return 0;
 }
 /*
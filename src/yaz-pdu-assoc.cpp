@@ -615,6 +615,11 @@ const char*PDU_Assoc::getpeername()
     return cs_addrstr(m_p->cs);
 }
 
+ISocketObservable *PDU_Assoc::get_socket_observable()
+{
+    return m_p->m_socketObservable;
+}
+
 void PDU_Assoc::set_cert_fname(const char *fname)
 {
     xfree(m_p->cert_fname);
@@ -0,0 +1,503 @@
+/* This file is part of the yazpp toolkit.
+ * Copyright (C) Index Data 
+ * See the file LICENSE for details.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#if HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <yaz/log.h>
+#include <yaz/options.h>
+#include <yaz/xmalloc.h>
+#include <yaz/gettimeofday.h>
+#include <yazpp/z-assoc.h>
+#include <yazpp/pdu-assoc.h>
+#include <yazpp/socket-manager.h>
+#include <yazpp/apdu-capture.h>
+#include <yazpp/pdu-peek.h>
+
+using namespace yazpp_1;
+
+#define SCRIPT_HASH 257
+
+struct ReplayPDU {
+    double offset;           // seconds since first package in capture
+    int type;                // Z_APDU_.. or -1 if not Z39.50
+    char *buf;
+    int len;
+    ReplayPDU *next;
+};
+
+struct ReplayScript {
+    unsigned id;
+    ReplayPDU *pdus;
+    ReplayPDU **last;
+    ReplayScript *hash_next;
+    ReplayScript *next;
+};
+
+class Replay;
+
+class ReplaySession : public Z_Assoc {
+public:
+    ReplaySession(PDU_Assoc *the_PDU_Assoc, Replay *replay,
+                  ReplayScript *script);
+    IPDU_Observer *sessionNotify(IPDU_Observable *the_PDU_Observable,
+                                 int fd);
+    void recv_GDU(Z_GDU *apdu, int len);
+    void connectNotify();
+    void failNotify();
+    void timeoutNotify();
+    double dispatch(double now, const char *target);
+    bool is_done();
+    ReplaySession *m_next;
+private:
+    enum { Idle, Connecting, Ready, Waiting, Closing, Done } m_state;
+    void finish(bool failed);
+    PDU_Assoc *m_PDU_Assoc;
+    Replay *m_replay;
+    ReplayPDU *m_cur;
+    double m_sent;
+};
+
+class Replay : public ISocketObserver {
+public:
+    Replay();
+    ~Replay();
+    int load(const char *fname, int direction);
+    int run(const char *target, int copies);
+    void socketNotify(int event);
+    double now();
+    void add_latency(double d);
+    void session_done(bool failed);
+    void report();
+    double m_speed;
+    int m_timeout;          // seconds to wait for connect or response
+private:
+    ReplayScript *m_hash[SCRIPT_HASH];
+    ReplayScript *m_scripts;
+    ReplayScript **m_scripts_last;
+    ReplaySession *m_sessions;
+    SocketManager m_mgr;
+    int m_pipe[2];
+    int m_active;
+    int m_failed;
+    int m_no_sessions;
+    double *m_latency;
+    int m_no_latency;
+    int m_max_latency;
+    struct timeval m_start;
+    double m_elapsed;
+};
+
+ReplaySession::ReplaySession(PDU_Assoc *the_PDU_Assoc, Replay *replay,
+                             ReplayScript *script) :
+    Z_Assoc(the_PDU_Assoc)
+{
+    m_next = 0;
+    m_state = Idle;
+    m_PDU_Assoc = the_PDU_Assoc;
+    m_replay = replay;
+    m_cur = script->pdus;
+    m_sent = 0.0;
+}
+
+IPDU_Observer *ReplaySession::sessionNotify(
+    IPDU_Observable *the_PDU_Observable, int fd)
+{
+    return 0;
+}
+
+bool ReplaySession::is_done()
+{
+    return m_state == Done;
+}
+
+void ReplaySession::finish(bool failed)
+{
+    if (m_state == Done)
+        return;
+    m_state = Done;
+    m_replay->session_done(failed);
+    close();
+}
+
+void ReplaySession::connectNotify()
+{
+    if (m_state == Connecting)
+    {
+        m_state = Ready;
+        timeout(-1);  // gaps between requests are paced by Replay
+    }
+}
+
+void ReplaySession::failNotify()
+{
+    // a close from the peer after our last request is a normal ending
+    finish(m_cur != 0 && m_state != Closing);
+}
+
+void ReplaySession::timeoutNotify()
+{
+    finish(m_state != Closing);
+}
+
+void ReplaySession::recv_GDU(Z_GDU *apdu, int len)
+{
+    if (m_state == Closing)
+    {
+        finish(false);
+        return;
+    }
+    if (m_state != Waiting)
+        return;   // unsolicited package
+    m_replay->add_latency(m_replay->now() - m_sent);
+    m_cur = m_cur->next;
+    if (!m_cur || (apdu->which == Z_GDU_Z3950 &&
+                   apdu->u.z3950->which == Z_APDU_close))
+        finish(false);
+    else
+    {
+        m_state = Ready;
+        timeout(-1);
+    }
+}
+
+/* Returns seconds until this session has something to do, 0 if it must
+   be served again right away and -1 if it is waiting on the network */
+double ReplaySession::dispatch(double now, const char *target)
+{
+    if (m_state == Done || m_state == Connecting || m_state == Waiting
+        || m_state == Closing)
+        return -1.0;
+    if (!m_cur)
+    {
+        finish(false);
+        return -1.0;
+    }
+    double due = m_replay->m_speed > 0.0 ?
+        m_cur->offset / m_replay->m_speed : 0.0;
+    if (due > now)
+        return due - now;
+    if (m_state == Idle)
+    {
+        m_state = Connecting;
+        if (client(target))
+            finish(true);
+        else
+            timeout(m_replay->m_timeout);
+        return -1.0;
+    }
+    m_sent = m_replay->now();
+    if (m_PDU_Assoc->send_PDU(m_cur->buf, m_cur->len) < 0)
+    {
+        finish(true);
+        return -1.0;
+    }
+    switch (m_cur->type)
+    {
+    case Z_APDU_triggerResourceControlRequest:
+    case Z_APDU_resourceControlResponse:
+    case Z_APDU_accessControlResponse:
+        // nothing comes back; on with the next package
+        m_cur = m_cur->next;
+        return 0.0;
+    case Z_APDU_close:
+        // the target may answer with a Close or just hang up
+        m_state = Closing;
+        break;
+    default:
+        m_state = Waiting;
+    }
+    timeout(m_replay->m_timeout);
+    return -1.0;
+}
+
+Replay::Replay()
+{
+    int i;
+    for (i = 0; i < SCRIPT_HASH; i++)
+        m_hash[i] = 0;
+    m_scripts = 0;
+    m_scripts_last = &m_scripts;
+    m_sessions = 0;
+    m_speed = 1.0;
+    m_timeout = 60;
+    m_active = 0;
+    m_failed = 0;
+    m_no_sessions = 0;
+    m_latency = 0;
+    m_no_latency = 0;
+    m_max_latency = 0;
+    m_elapsed = 0.0;
+    m_pipe[0] = m_pipe[1] = -1;
+    yaz_gettimeofday(&m_start);
+}
+
+Replay::~Replay()
+{
+    while (m_sessions)
+    {
+        ReplaySession *s = m_sessions;
+        m_sessions = s->m_next;
+        delete s;
+    }
+    while (m_scripts)
+    {
+        ReplayScript *sc = m_scripts;
+        m_scripts = sc->next;
+        while (sc->pdus)
+        {
+            ReplayPDU *p = sc->pdus;
+            sc->pdus = p->next;
+            xfree(p->buf);
+            delete p;
+        }
+        delete sc;
+    }
+    xfree(m_latency);
+    if (m_pipe[0] != -1)
+    {
+        m_mgr.deleteObserver(this);
+        ::close(m_pipe[0]);
+        ::close(m_pipe[1]);
+    }
+}
+
+double Replay::now()
+{
+    struct timeval tv;
+    yaz_gettimeofday(&tv);
+    return (tv.tv_sec - m_start.tv_sec) +
+        (tv.tv_usec - m_start.tv_usec) / 1e6;
+}
+
+void Replay::socketNotify(int event)
+{
+}
+
+void Replay::add_latency(double d)
+{
+    if (m_no_latency == m_max_latency)
+    {
+        m_max_latency = m_max_latency ? 2 * m_max_latency : 1024;
+        m_latency = (double *)
+            xrealloc(m_latency, m_max_latency * sizeof(*m_latency));
+    }
+    m_latency[m_no_latency++] = d;
+}
+
+void Replay::session_done(bool failed)
+{
+    m_active--;
+    if (failed)
+        m_failed++;
+}
+
+int Replay::load(const char *fname, int direction)
+{
+    APDUCapture cap;
+    unsigned id;
+    int dir, len, r;
+    struct timeval tv, first;
+    const char *buf;
+    bool have_first = false;
+    PDU_Peek peek;
+
+    if (cap.open_read(fname))
+        return -1;
+    while ((r = cap.read(&id, &dir, &tv, &buf, &len)) > 0)
+    {
+        if (dir != direction)
+            continue;
+        if (!have_first)
+        {
+            first = tv;
+            have_first = true;
+        }
+        ReplayScript **sp = &m_hash[id % SCRIPT_HASH];
+        for (; *sp; sp = &(*sp)->hash_next)
+            if ((*sp)->id == id)
+                break;
+        if (!*sp)
+        {
+            *sp = new ReplayScript;
+            (*sp)->id = id;
+            (*sp)->pdus = 0;
+            (*sp)->last = &(*sp)->pdus;
+            (*sp)->hash_next = 0;
+            (*sp)->next = 0;
+            *m_scripts_last = *sp;
+            m_scripts_last = &(*sp)->next;
+        }
+        ReplayPDU *p = new ReplayPDU;
+        p->offset = (tv.tv_sec - first.tv_sec) +
+            (tv.tv_usec - first.tv_usec) / 1e6;
+        p->type = peek.parse(buf, len) == 1 ? peek.get_type() : -1;
+        p->buf = (char *) xmalloc(len > 0 ? len : 1);
+        memcpy(p->buf, buf, len);
+        p->len = len;
+        p->next = 0;
+        *(*sp)->last = p;
+        (*sp)->last = &p->next;
+    }
+    if (r < 0)
+    {
+        yaz_log(YLOG_WARN, "%s: truncated capture", fname);
+        return -1;
+    }
+    return 0;
+}
+
+int Replay::run(const char *target, int copies)
+{
+    ReplayScript *sc;
+    ReplaySession **last = &m_sessions;
+    int i;
+
+    for (sc = m_scripts; sc; sc = sc->next)
+        for (i = 0; i < copies; i++)
+        {
+            *last = new ReplaySession(new PDU_Assoc(&m_mgr), this, sc);
+            last = &(*last)->m_next;
+            m_active++;
+            m_no_sessions++;
+        }
+    // pacer: an observer without events, used only for its timeout. The
+    // event loop sleeps until the next package is due
+    if (pipe(m_pipe))
+    {
+        yaz_log(YLOG_FATAL|YLOG_ERRNO, "pipe");
+        return -1;
+    }
+    m_mgr.addObserver(m_pipe[0], this);
+    m_mgr.maskObserver(this, 0);
+
+    yaz_gettimeofday(&m_start);
+    while (m_active > 0)
+    {
+        double t = now();
+        double next = -1.0;
+        ReplaySession *s;
+        for (s = m_sessions; s; s = s->m_next)
+        {
+            double d = s->dispatch(t, target);
+            if (d >= 0.0 && (next < 0.0 || d < next))
+                next = d;
+        }
+        if (m_active <= 0)
+            break;
+        if (next < 0.0)
+            m_mgr.timeoutObserverMs(this, -1);
+        else
+            m_mgr.timeoutObserverMs(this, next < 2000000.0 ?
+                                    (int) (next * 1000.0) : 2000000000);
+        if (m_mgr.processEvent() <= 0)
+            break;
+    }
+    m_elapsed = now();
+    return 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double d = *(const double *) a - *(const double *) b;
+    return d < 0.0 ? -1 : (d > 0.0 ? 1 : 0);
+}
+
+void Replay::report()
+{
+    printf("sessions %d failed %d requests %d elapsed %.3f s",
+           m_no_sessions, m_failed, m_no_latency, m_elapsed);
+    if (m_elapsed > 0.0)
+        printf(" rate %.1f/s", m_no_latency / m_elapsed);
+    printf("\n");
+    if (m_no_latency == 0)
+        return;
+    qsort(m_latency, m_no_latency, sizeof(*m_latency), cmp_double);
+    static const double pct[] = { 0.5, 0.9, 0.99, 0.999 };
+    printf("latency ms min %.3f", m_latency[0] * 1000.0);
+    for (size_t i = 0; i < sizeof(pct) / sizeof(*pct); i++)
+    {
+        int idx = (int) (pct[i] * m_no_latency);
+        if (idx >= m_no_latency)
+            idx = m_no_latency - 1;
+        printf(" p%g %.3f", pct[i] * 100.0, m_latency[idx] * 1000.0);
+    }
+    printf(" max %.3f\n", m_latency[m_no_latency - 1] * 1000.0);
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "%s: [-s speed] [-m copies] [-o] [-t timeout] "
+            "[-v level] capture target\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    char *arg;
+    char *prog = *argv;
+    const char *fname = 0;
+    const char *target = 0;
+    int direction = APDUCapture::RECV;
+    int copies = 1;
+    int ret;
+    Replay replay;
+
+    while ((ret = options("s:m:ot:v:", argv, argc, &arg)) != -2)
+    {
+        switch (ret)
+        {
+        case 0:
+            if (!fname)
+                fname = arg;
+            else if (!target)
+                target = arg;
+            else
+                usage(prog);
+            break;
+        case 's':
+            replay.m_speed = atof(arg);
+            break;
+        case 'm':
+            copies = atoi(arg);
+            break;
+        case 'o':
+            direction = APDUCapture::SEND;
+            break;
+        case 't':
+            replay.m_timeout = atoi(arg);
+            break;
+        case 'v':
+            yaz_log_init_level(yaz_log_mask_str(arg));
+            break;
+        default:
+            usage(prog);
+        }
+    }
+    if (!fname || !target || copies < 1 || replay.m_timeout < 1)
+        usage(prog);
+    if (replay.load(fname, direction))
+        exit(1);
+    if (replay.run(target, copies))
+        exit(1);
+    replay.report();
+    return 0;
+}
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
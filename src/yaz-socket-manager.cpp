@@ -23,6 +23,7 @@
 #include <time.h>
 
 #include <yaz/log.h>
+#include <yaz/gettimeofday.h>
 
 #include <yazpp/socket-manager.h>
 #include <yaz/poll.h>
@@ -33,9 +34,9 @@ struct SocketManager::SocketEntry {
     ISocketObserver *observer;
     int fd;
     unsigned mask;
-    int timeout;
+    int timeout;                // milliseconds; -1 for none
     int timeout_this;
-    time_t last_activity;
+    struct timeval last_activity;
     SocketEntry *next;
 };
 
@@ -52,6 +53,8 @@ struct SocketManager::Rep {
     void removeEvent(ISocketObserver *observer);
     void inspect_poll_result(int res, struct yaz_poll_fd *fds, int no_fds,
                              int timeout);
+    static long elapsed_ms(const struct timeval *from,
+                           const struct timeval *to);
     SocketEntry **lookupObserver(ISocketObserver *observer);
     SocketEntry *observers;       // all registered observers
     SocketEvent *queue_front;
@@ -93,7 +96,8 @@ void SocketManager::addObserver(int fd, ISocketObserver *observer)
     }
     se->fd = fd;
     se->mask = 0;
-    se->last_activity = 0;
+    se->last_activity.tv_sec = 0;
+    se->last_activity.tv_usec = 0;
     se->timeout = -1;
 }
 
@@ -143,7 +147,32 @@ void SocketManager::timeoutObserver(ISocketObserver *observer,
 
     se = *m_p->lookupObserver(observer);
     if (se)
+    {
+        if (timeout > 2147483)
+            timeout = 2147483;
+        se->timeout = timeout < 0 ? -1 : timeout * 1000;
+    }
+}
+
+void SocketManager::timeoutObserverMs(ISocketObserver *observer,
+                                      int timeout)
+{
+    SocketEntry *se;
+
+    se = *m_p->lookupObserver(observer);
+    if (se)
+    {
         se->timeout = timeout;
+        se->last_activity.tv_sec = 0;  // count from next processEvent
+        se->last_activity.tv_usec = 0;
+    }
+}
+
+long SocketManager::Rep::elapsed_ms(const struct timeval *from,
+                                    const struct timeval *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000L +
+        (to->tv_usec - from->tv_usec) / 1000L;
 }
 
 void SocketManager::Rep::inspect_poll_result(int res, struct yaz_poll_fd *fds,
@@ -151,7 +180,8 @@ void SocketManager::Rep::inspect_poll_result(int res, struct yaz_poll_fd *fds,
 
 {
     yaz_log(log, "yaz_poll returned res=%d", res);
-    time_t now = time(0);
+    struct timeval now;
+    yaz_gettimeofday(&now);
     int i;
     int no_put_events = 0;
     int no_lost_observers = 0;
@@ -194,10 +224,11 @@ void SocketManager::Rep::inspect_poll_result(int res, struct yaz_poll_fd *fds,
         else if (res == 0 && p->timeout_this == timeout)
         {
             SocketEvent *event = new SocketEvent;
-            assert(p->last_activity);
+            assert(p->last_activity.tv_sec);
             yaz_log(log, "putEvent timeout fd=%d, now = %ld "
                     "last_activity=%ld timeout=%d",
-                    p->fd, now, p->last_activity, p->timeout);
+                    p->fd, (long) now.tv_sec, (long) p->last_activity.tv_sec,
+                    p->timeout);
             p->last_activity = now;
             event->observer = p->observer;
             event->event = SOCKET_OBSERVE_TIMEOUT;
@@ -239,7 +270,8 @@ int SocketManager::processEvent()
     }
 
     int res;
-    time_t now = time(0);
+    struct timeval now;
+    yaz_gettimeofday(&now);
     int i;
     int no_fds = 0;
     for (p = m_p->observers; p; p = p->next)
@@ -261,18 +293,18 @@ int SocketManager::processEvent()
         if (p->timeout > 0 ||
             (p->timeout == 0 && (p->mask & SOCKET_OBSERVE_WRITE) == 0))
         {
-            int timeout_this;
+            long timeout_this;
             timeout_this = p->timeout;
-            if (p->last_activity)
-                timeout_this -= now - p->last_activity;
+            if (p->last_activity.tv_sec)
+                timeout_this -= Rep::elapsed_ms(&p->last_activity, &now);
             else
                 p->last_activity = now;
             if (timeout_this < 0 || timeout_this > 2147483646)
                 timeout_this = 0;
             if (timeout == -1 || timeout_this < timeout)
-                timeout = timeout_this;
-            p->timeout_this = timeout_this;
-            yaz_log(m_p->log, "SocketManager::select timeout_this=%d",
+                timeout = (int) timeout_this;
+            p->timeout_this = (int) timeout_this;
+            yaz_log(m_p->log, "SocketManager::select timeout_this=%d ms",
                     p->timeout_this);
         }
         else
@@ -281,7 +313,9 @@ int SocketManager::processEvent()
     }
 
     int pass = 0;
-    while ((res = yaz_poll(fds, no_fds, timeout, 0)) < 0 && pass < 10)
+    int sec = timeout < 0 ? -1 : timeout / 1000;
+    int nsec = timeout < 0 ? 0 : (timeout % 1000) * 1000000;
+    while ((res = yaz_poll(fds, no_fds, sec, nsec)) < 0 && pass < 10)
     {
         if (errno == EINTR)
         {
@@ -6,11 +6,15 @@
 #if HAVE_CONFIG_H
 #include <config.h>
 #endif
+#ifdef WIN32
+#include <windows.h>
+#endif
 #include <assert.h>
 #include <signal.h>
 
 #include <yaz/log.h>
 #include <yazpp/z-assoc.h>
+#include <yazpp/apdu-capture.h>
 #include <yaz/otherinfo.h>
 #include <yaz/oid_db.h>
 
@@ -24,6 +28,11 @@ namespace yazpp_1
         ~Z_Assoc_priv();
         static int yaz_init_flag;
         static int yaz_init_func();
+#ifdef WIN32
+        static LONG session_counter;
+#else
+        static unsigned session_counter;
+#endif
         IPDU_Observable *PDU_Observable;
         ODR odr_in;
         ODR odr_out;
@@ -33,6 +42,9 @@ namespace yazpp_1
         char *APDU_fname;
         char *hostname;
         int APDU_yazlog;
+        APDUCapture *capture;
+        unsigned session_id;
+        Z_GDU *decode(ODR odr, const char *buf, int len);
     };
 };
 
@@ -48,6 +60,12 @@ int Z_Assoc_priv::yaz_init_func()
 
 int Z_Assoc_priv::yaz_init_flag =  Z_Assoc_priv::yaz_init_func();
 
+#ifdef WIN32
+LONG Z_Assoc_priv::session_counter = 0;
+#else
+unsigned Z_Assoc_priv::session_counter = 0;
+#endif
+
 Z_Assoc_priv::Z_Assoc_priv(IPDU_Observable *the_PDU_Observable)
 {
     PDU_Observable = the_PDU_Observable;
@@ -59,6 +77,13 @@ Z_Assoc_priv::Z_Assoc_priv(IPDU_Observable *the_PDU_Observable)
     APDU_fname = 0;
     hostname = 0;
     APDU_yazlog = 0;
+    capture = 0;
+    // sessions may be created by several threads
+#ifdef WIN32
+    session_id = (unsigned) InterlockedIncrement(&session_counter);
+#else
+    session_id = __sync_add_and_fetch(&session_counter, 1);
+#endif
 }
 
 Z_Assoc_priv::~Z_Assoc_priv()
@@ -70,6 +95,7 @@ Z_Assoc_priv::~Z_Assoc_priv()
     odr_destroy(odr_in);
     delete [] APDU_fname;
     delete [] hostname;
+    delete capture;
 }
 
 Z_Assoc::Z_Assoc(IPDU_Observable *the_PDU_Observable)
@@ -113,14 +139,41 @@ int Z_Assoc::set_APDU_yazlog(int v)
     return old;
 }
 
+int Z_Assoc::get_APDU_yazlog()
+{
+    return m_p->APDU_yazlog;
+}
+
 const char *Z_Assoc::get_APDU_log()
 {
     return m_p->APDU_fname;
 }
 
+void Z_Assoc::set_APDU_capture(const char *fname)
+{
+    delete m_p->capture;
+    m_p->capture = 0;
+    if (fname && *fname)
+    {
+        m_p->capture = new APDUCapture;
+        if (m_p->capture->open_write(fname))
+        {
+            delete m_p->capture;
+            m_p->capture = 0;
+        }
+    }
+}
+
+const char *Z_Assoc::get_APDU_capture()
+{
+    return m_p->capture ? m_p->capture->get_fname() : 0;
+}
+
 void Z_Assoc::recv_PDU(const char *buf, int len)
 {
     yaz_log(m_p->log, "recv_PDU len=%d", len);
+    if (m_p->capture)
+        m_p->capture->write(m_p->session_id, APDUCapture::RECV, buf, len);
     Z_GDU *apdu = decode_GDU(buf, len);
     if (apdu)
     {
@@ -231,24 +284,32 @@ int Z_Assoc::send_GDU(Z_GDU *apdu, int *plen)
     {
         if (plen)
             *plen = len;
+        if (m_p->capture)
+            m_p->capture->write(m_p->session_id, APDUCapture::SEND, buf, len);
         return m_p->PDU_Observable->send_PDU(buf, len);
     }
     return -1;
 }
 
-Z_GDU *Z_Assoc::decode_GDU(const char *buf, int len)
+int Z_Assoc::send_PDU(const char *buf, int len)
+{
+    if (m_p->capture)
+        m_p->capture->write(m_p->session_id, APDUCapture::SEND, buf, len);
+    return m_p->PDU_Observable->send_PDU(buf, len);
+}
+
+Z_GDU *Z_Assoc_priv::decode(ODR odr, const char *buf, int len)
 {
     Z_GDU *apdu;
 
-    odr_reset(m_p->odr_in);
-    odr_setbuf(m_p->odr_in, (char*) buf, len, 0);
+    odr_setbuf(odr, (char*) buf, len, 0);
 
-    if (!z_GDU(m_p->odr_in, &apdu, 0, 0))
+    if (!z_GDU(odr, &apdu, 0, 0))
     {
-        const char *element = odr_getelement(m_p->odr_in);
+        const char *element = odr_getelement(odr);
         yaz_log(YLOG_LOG, "PDU decode failed '%s' near byte %ld. Element %s",
-                odr_errmsg(odr_geterror(m_p->odr_in)),
-                (long) odr_offset(m_p->odr_in),
+                odr_errmsg(odr_geterror(odr)),
+                (long) odr_offset(odr),
                 element && *element ? element : "unknown");
         yaz_log(YLOG_LOG, "Buffer length: %d", (int) len);
         if (len > 0)
@@ -264,24 +325,42 @@ Z_GDU *Z_Assoc::decode_GDU(const char *buf, int len)
     }
     else
     {
-        if (m_p->APDU_yazlog)
+        if (APDU_yazlog)
         {   // use YAZ log FILE
-            FILE *save = m_p->APDU_file;
+            FILE *save = APDU_file;
 
-            odr_setprint(m_p->odr_print, yaz_log_file());
-            z_GDU(m_p->odr_print, &apdu, 0, "decode");
-            m_p->APDU_file = save;
-            odr_setprint(m_p->odr_print, save);
+            odr_setprint(odr_print, yaz_log_file());
+            z_GDU(odr_print, &apdu, 0, "decode");
+            APDU_file = save;
+            odr_setprint(odr_print, save);
         }
-        if (m_p->APDU_file)
+        if (APDU_file)
         {
-            z_GDU(m_p->odr_print, &apdu, 0, "decode");
-            fflush(m_p->APDU_file);
+            z_GDU(odr_print, &apdu, 0, "decode");
+            fflush(APDU_file);
         }
         return apdu;
     }
 }
 
+Z_GDU *Z_Assoc::decode_GDU(const char *buf, int len)
+{
+    odr_reset(m_p->odr_in);
+    return m_p->decode(m_p->odr_in, buf, len);
+}
+
+GDU *Z_Assoc::decode_GDU_owned(const char *buf, int len)
+{
+    ODR odr = odr_createmem(ODR_DECODE);
+    Z_GDU *apdu = m_p->decode(odr, buf, len);
+    if (!apdu)
+    {
+        odr_destroy(odr);
+        return 0;
+    }
+    return new GDU(odr, apdu, len);
+}
+
 int Z_Assoc::encode_GDU(Z_GDU *apdu, char **buf, int *len)
 {
     const char *element = 0;
@@ -322,6 +401,11 @@ const char *Z_Assoc::get_hostname()
     return m_p->hostname;
 }
 
+ISocketObservable *Z_Assoc::get_socket_observable()
+{
+    return m_p->PDU_Observable->get_socket_observable();
+}
+
 int Z_Assoc::client(const char *addr)
 {
     delete [] m_p->hostname;
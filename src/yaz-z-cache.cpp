@@ -6,58 +6,289 @@
 #if HAVE_CONFIG_H
 #include <config.h>
 #endif
+#include <string.h>
+#include <time.h>
 #include <yaz/log.h>
+#include <yaz/xmalloc.h>
 #include <yaz/proto.h>
-#include <yaz/copy_types.h>
+#include <yaz/diagbib1.h>
 #include <yazpp/record-cache.h>
+#include "cache-table.h"
+#if HAVE_ZLIB
+#include <zlib.h>
+
+// records smaller than this are stored as they are
+#define COMPRESS_MIN 256
+#endif
+
+// seconds between sweeps for expired entries done by add
+#define SWEEP_INTERVAL 10
 
 using namespace yazpp_1;
 
 struct RecordCache::Rep {
-    NMEM nmem;
-    RecordCache_Entry *entries;
+    NMEM nmem;                    // for searchRequest, presentRequest
+    ODR encode;                   // for compositions
+    ODR record_encode;            // for records added
+    ODR record_decode;            // for records looked up
+    CacheTable table;             // hash on offset, syntax, composition
     Z_SearchRequest *searchRequest;
     Z_PresentRequest *presentRequest;
-    int match(RecordCache_Entry *entry, Odr_oid *syntax, int offset,
-              Z_RecordComposition *comp);
+    int prefetch_depth;           // windows to read ahead; 0 = off
+    int sequential;               // last present continued the previous
+    int prefetch_next;            // first position not yet prefetched
+    int ttl;                      // seconds records live; 0 = forever
+    int diag_ttl;                 // seconds diagnostics live; 0 = none
+    time_t next_sweep;
+    void insert(RecordCache_Entry *entry);
+    void remove(RecordCache_Entry *entry);
+    void touch(RecordCache_Entry *entry);
+    void clear_entries();
+    int sweep(time_t now);
+    RecordCache_Entry *lru_tail();
+    RecordCache_Entry *find(unsigned comp_hash, const char *comp_buf,
+                            int comp_len, Odr_oid *syntax, int offset);
+    int find_range(ODR o, int start, int num, Odr_oid *syntax,
+                   Z_RecordComposition *comp, RecordCache_Entry ***found);
+    Z_NamePlusRecord *get_record(ODR o, RecordCache_Entry *entry);
     size_t max_size;
+    size_t resident;
+    long hits;
+    long misses;
+    long evictions;
+    long expirations;
 };
 
-struct RecordCache::RecordCache_Entry {
+/* An entry is a single block: this struct followed by syntax,
+   composition and record, so that m_size is what it takes */
+struct RecordCache::RecordCache_Entry : CacheNode {
+    size_t m_size;
     int m_offset;
-    Z_NamePlusRecord *m_record;
-    Z_RecordComposition *m_comp;
-    RecordCache_Entry *m_next;
+    const char *m_buf;        // BER encoded record, maybe deflated
+    int m_len;
+    int m_raw_len;            // > 0 if m_buf is deflated; length before
+    Odr_oid *m_syntax;        // requested syntax for diagnostics
+    time_t m_expires;         // 0 = never
+    const char *m_comp_buf;   // BER encoded composition
+    int m_comp_len;
 };
 
+static unsigned hash_key(unsigned comp_hash, const Odr_oid *syntax,
+                         int offset)
+{
+    unsigned h = comp_hash;
+    for (; *syntax != -1; syntax++)
+        h = cache_hash_int(h, (unsigned) *syntax);
+    return cache_hash_int(h, (unsigned) offset);
+}
+
+#if HAVE_ZLIB
+// deflated copy of buf (xmalloc'ed) with its length in *len; 0 if not
+// worth it
+static char *compress_buf(const char *buf, int *len)
+{
+    if (*len < COMPRESS_MIN)
+        return 0;
+    uLongf c_len = compressBound(*len);
+    Bytef *c_buf = (Bytef *) xmalloc(c_len);
+    if (compress2(c_buf, &c_len, (const Bytef *) buf, *len,
+                  Z_BEST_SPEED) == Z_OK && c_len < (uLongf) *len)
+    {
+        *len = c_len;
+        return (char *) c_buf;
+    }
+    xfree(c_buf);
+    return 0;
+}
+#endif
+
+// encodes comp once so entries and lookups can compare bytes
+static unsigned encode_comp(ODR o, Z_RecordComposition *comp,
+                            char **buf, int *len)
+{
+    odr_reset(o);
+    *len = 0;
+    *buf = 0;
+    if (comp && z_RecordComposition(o, &comp, 1, 0))
+        *buf = odr_getbuf(o, len, 0);
+    return cache_hash_bytes(CACHE_HASH_INIT, *buf, *len);
+}
+
+void RecordCache::Rep::insert(RecordCache_Entry *entry)
+{
+    table.insert(entry);
+    resident += entry->m_size;
+}
+
+void RecordCache::Rep::remove(RecordCache_Entry *entry)
+{
+    table.remove(entry);
+    resident -= entry->m_size;
+    xfree(entry);
+}
+
+void RecordCache::Rep::touch(RecordCache_Entry *entry)
+{
+    table.touch(entry);
+}
+
+RecordCache::RecordCache_Entry *RecordCache::Rep::lru_tail()
+{
+    return static_cast<RecordCache_Entry *>(table.lru_tail);
+}
+
+void RecordCache::Rep::clear_entries()
+{
+    while (table.lru_head)
+        remove(static_cast<RecordCache_Entry *>(table.lru_head));
+    table.destroy();
+}
+
+RecordCache::RecordCache_Entry *RecordCache::Rep::find(
+    unsigned comp_hash, const char *comp_buf, int comp_len,
+    Odr_oid *syntax, int offset)
+{
+    unsigned h = hash_key(comp_hash, syntax, offset);
+    RecordCache_Entry *entry = static_cast<RecordCache_Entry *>(
+        table.chain(h));
+    for (; entry; entry = static_cast<RecordCache_Entry *>(entry->next))
+        if (entry->hash == h && entry->m_offset == offset &&
+            entry->m_comp_len == comp_len &&
+            (!comp_len || !memcmp(entry->m_comp_buf, comp_buf, comp_len)) &&
+            !oid_oidcmp(entry->m_syntax, syntax))
+            break;
+    if (entry && entry->m_expires && entry->m_expires <= time(0))
+    {
+        remove(entry);
+        expirations++;
+        return 0;
+    }
+    return entry;
+}
+
+int RecordCache::Rep::sweep(time_t now)
+{
+    int no = 0;
+    RecordCache_Entry *entry = static_cast<RecordCache_Entry *>(
+        table.lru_head);
+    while (entry)
+    {
+        RecordCache_Entry *entry_next =
+            static_cast<RecordCache_Entry *>(entry->lru_next);
+        if (entry->m_expires && entry->m_expires <= now)
+        {
+            remove(entry);
+            no++;
+        }
+        entry = entry_next;
+    }
+    expirations += no;
+    next_sweep = now + SWEEP_INTERVAL;
+    return no;
+}
+
 RecordCache::RecordCache ()
 {
     m_p = new Rep;
     m_p->nmem = nmem_create();
-    m_p->entries = 0;
+    m_p->encode = odr_createmem(ODR_ENCODE);
+    m_p->record_encode = odr_createmem(ODR_ENCODE);
+    m_p->record_decode = odr_createmem(ODR_DECODE);
+    m_p->table.init();
     m_p->presentRequest = 0;
     m_p->searchRequest = 0;
+    m_p->prefetch_depth = 0;
+    m_p->sequential = 0;
+    m_p->prefetch_next = 0;
+    m_p->ttl = 0;
+    m_p->diag_ttl = 30;
+    m_p->next_sweep = 0;
     m_p->max_size = 200000;
+    m_p->resident = 0;
+    m_p->hits = 0;
+    m_p->misses = 0;
+    m_p->evictions = 0;
+    m_p->expirations = 0;
 }
 
 RecordCache::~RecordCache ()
 {
+    m_p->clear_entries();
     nmem_destroy(m_p->nmem);
+    odr_destroy(m_p->encode);
+    odr_destroy(m_p->record_encode);
+    odr_destroy(m_p->record_decode);
     delete m_p;
 }
 
 void RecordCache::set_max_size(size_t sz)
 {
     m_p->max_size = sz;
+    while (m_p->resident > m_p->max_size)
+    {
+        m_p->remove(m_p->lru_tail());
+        m_p->evictions++;
+    }
 }
 
 void RecordCache::clear ()
 {
-    nmem_destroy(m_p->nmem);
-    m_p->nmem = nmem_create();
-    m_p->entries = 0;
+    m_p->clear_entries();
+    nmem_reset(m_p->nmem);
     m_p->presentRequest = 0;
     m_p->searchRequest = 0;
+    m_p->sequential = 0;
+    m_p->prefetch_next = 0;
+}
+
+void RecordCache::set_ttl(int seconds)
+{
+    m_p->ttl = seconds > 0 ? seconds : 0;
+}
+
+void RecordCache::set_diagnostic_ttl(int seconds)
+{
+    m_p->diag_ttl = seconds > 0 ? seconds : 0;
+}
+
+int RecordCache::sweep()
+{
+    return m_p->sweep(time(0));
+}
+
+void RecordCache::set_prefetch_depth(int windows)
+{
+    m_p->prefetch_depth = windows > 0 ? windows : 0;
+}
+
+size_t RecordCache::get_resident_bytes()
+{
+    return m_p->resident;
+}
+
+int RecordCache::get_num_entries()
+{
+    return m_p->table.num_entries;
+}
+
+long RecordCache::get_hits()
+{
+    return m_p->hits;
+}
+
+long RecordCache::get_misses()
+{
+    return m_p->misses;
+}
+
+long RecordCache::get_evictions()
+{
+    return m_p->evictions;
+}
+
+long RecordCache::get_expirations()
+{
+    return m_p->expirations;
 }
 
 void RecordCache::copy_searchRequest(Z_SearchRequest *sr)
@@ -65,8 +296,11 @@ void RecordCache::copy_searchRequest(Z_SearchRequest *sr)
     ODR encode = odr_createmem(ODR_ENCODE);
     ODR decode = odr_createmem(ODR_DECODE);
 
+    nmem_reset(m_p->nmem);
     m_p->searchRequest = 0;
     m_p->presentRequest = 0;
+    m_p->sequential = 0;
+    m_p->prefetch_next = 0;
     int v = z_SearchRequest (encode, &sr, 1, 0);
     if (v)
     {
@@ -85,6 +319,20 @@ void RecordCache::copy_presentRequest(Z_PresentRequest *pr)
     ODR encode = odr_createmem(ODR_ENCODE);
     ODR decode = odr_createmem(ODR_DECODE);
 
+    // does this request continue where the previous one ended?
+    Z_PresentRequest *prev = m_p->presentRequest;
+    if (prev && !strcmp(prev->resultSetId, pr->resultSetId) &&
+        *pr->resultSetStartPoint ==
+        *prev->resultSetStartPoint + *prev->numberOfRecordsRequested &&
+        pr->preferredRecordSyntax && prev->preferredRecordSyntax &&
+        !oid_oidcmp(pr->preferredRecordSyntax, prev->preferredRecordSyntax))
+        m_p->sequential = 1;
+    else
+    {
+        m_p->sequential = 0;
+        m_p->prefetch_next = 0;
+    }
+    nmem_reset(m_p->nmem);
     m_p->searchRequest = 0;
     m_p->presentRequest = 0;
     int v = z_PresentRequest (encode, &pr, 1, 0);
@@ -100,23 +348,146 @@ void RecordCache::copy_presentRequest(Z_PresentRequest *pr)
     odr_destroy(decode);
 }
 
+int RecordCache::get_prefetch(ODR o, Z_PresentRequest **pr)
+{
+    Z_PresentRequest *cur = m_p->presentRequest;
+    *pr = 0;
+    if (!m_p->prefetch_depth || !m_p->sequential || !cur ||
+        !cur->preferredRecordSyntax)
+        return 0;
+    int num = (int) *cur->numberOfRecordsRequested;
+    int start = (int) *cur->resultSetStartPoint + num;
+    int end = start + m_p->prefetch_depth * num;
+    if (m_p->prefetch_next > start)
+        start = m_p->prefetch_next;
+
+    char *comp_buf;
+    int comp_len;
+    unsigned comp_hash = encode_comp(m_p->encode, cur->recordComposition,
+                                     &comp_buf, &comp_len);
+    while (start < end && m_p->find(comp_hash, comp_buf, comp_len,
+                                    cur->preferredRecordSyntax, start))
+        start++;
+    if (num <= 0 || start >= end)
+        return 0;
+    if (num > end - start)
+        num = end - start;
+    // stop if the records would not fit without evicting others
+    if (m_p->table.num_entries &&
+        m_p->resident + (m_p->resident / m_p->table.num_entries) * num
+        > m_p->max_size)
+        return 0;
+
+    ODR encode = odr_createmem(ODR_ENCODE);
+    ODR decode = odr_createmem(ODR_DECODE);
+    if (z_PresentRequest(encode, &cur, 1, 0))
+    {
+        int len;
+        char *buf = odr_getbuf(encode, &len, 0);
+        odr_setbuf(decode, buf, len, 0);
+        if (z_PresentRequest(decode, pr, 1, 0))
+        {
+            nmem_transfer(o->mem, decode->mem);
+            (*pr)->resultSetStartPoint = odr_intdup(o, start);
+            (*pr)->numberOfRecordsRequested = odr_intdup(o, num);
+            m_p->prefetch_next = start + num;
+        }
+        else
+            *pr = 0;
+    }
+    odr_destroy(encode);
+    odr_destroy(decode);
+    yaz_log(YLOG_DEBUG, "cache prefetch start=%d num=%d",
+            start, *pr ? num : 0);
+    return *pr ? 1 : 0;
+}
+
 void RecordCache::add(ODR o, Z_NamePlusRecordList *npr, int start,
-                      Z_RecordComposition *comp)
+                      Z_RecordComposition *comp, Odr_oid *syntax)
 {
-    if (nmem_total(m_p->nmem) > m_p->max_size)
-        return;
+    char *comp_buf;
+    int comp_len;
+    unsigned comp_hash = encode_comp(m_p->encode, comp, &comp_buf, &comp_len);
+    time_t now = time(0);
+
+    if (now >= m_p->next_sweep)
+        m_p->sweep(now);
     // Insert individual records in cache
     int i;
     for (i = 0; i < npr->num_records; i++)
     {
-        RecordCache_Entry *entry = (RecordCache_Entry *)
-            nmem_malloc(m_p->nmem, sizeof(*entry));
-        entry->m_record =
-            yaz_clone_z_NamePlusRecord(npr->records[i], m_p->nmem);
-        entry->m_comp = yaz_clone_z_RecordComposition(comp, m_p->nmem);
+        // database records are looked up by their own syntax;
+        // diagnostics by the syntax that was asked for
+        Z_NamePlusRecord *rec = npr->records[i];
+        Odr_oid *rec_syntax;
+        int ttl;
+        if (rec->which == Z_NamePlusRecord_databaseRecord &&
+            rec->u.databaseRecord->direct_reference)
+        {
+            rec_syntax = rec->u.databaseRecord->direct_reference;
+            ttl = m_p->ttl;
+        }
+        else if (rec->which == Z_NamePlusRecord_surrogateDiagnostic &&
+                 syntax && m_p->diag_ttl)
+        {
+            rec_syntax = syntax;
+            ttl = m_p->diag_ttl;
+        }
+        else
+            continue;
+        RecordCache_Entry *entry =
+            m_p->find(comp_hash, comp_buf, comp_len, rec_syntax, i + start);
+        if (entry)
+            m_p->remove(entry);
+
+        int len;
+        odr_reset(m_p->record_encode);
+        if (!z_NamePlusRecord(m_p->record_encode, &rec, 0, 0))
+            continue;
+        const char *buf = odr_getbuf(m_p->record_encode, &len, 0);
+        int raw_len = 0;
+        char *c_buf = 0;
+#if HAVE_ZLIB
+        raw_len = len;
+        c_buf = compress_buf(buf, &len);
+        if (c_buf)
+            buf = c_buf;
+        else
+            raw_len = 0;
+#endif
+        size_t syntax_size = (oid_oidlen(rec_syntax) + 1) * sizeof(Odr_oid);
+        size_t size = sizeof(*entry) + syntax_size + comp_len + len;
+        if (size > m_p->max_size)
+        {
+            xfree(c_buf);
+            continue;
+        }
+        // make room by dropping least recently used
+        while (m_p->resident + size > m_p->max_size)
+        {
+            m_p->remove(m_p->lru_tail());
+            m_p->evictions++;
+        }
+        entry = (RecordCache_Entry *) xmalloc(size);
+        char *cp = (char *) (entry + 1);
+        entry->m_size = size;
+        entry->m_syntax = (Odr_oid *) cp;
+        memcpy(cp, rec_syntax, syntax_size);
+        cp += syntax_size;
+        entry->m_comp_buf = cp;
+        entry->m_comp_len = comp_len;
+        if (comp_len)
+            memcpy(cp, comp_buf, comp_len);
+        cp += comp_len;
+        entry->m_buf = cp;
+        entry->m_len = len;
+        entry->m_raw_len = raw_len;
+        memcpy(cp, buf, len);
+        xfree(c_buf);
+        entry->m_expires = ttl ? now + ttl : 0;
         entry->m_offset = i + start;
-        entry->m_next = m_p->entries;
-        m_p->entries = entry;
+        entry->hash = hash_key(comp_hash, rec_syntax, entry->m_offset);
+        m_p->insert(entry);
     }
 }
 
@@ -124,67 +495,83 @@ void RecordCache::add(ODR o, Z_NamePlusRecordList *npr, int start,
                       int hits)
 {
     // Build appropriate compspec for this response
-    Z_RecordComposition *comp = 0;
+    Z_RecordComposition *comp = 0, comp_simple;
+    Odr_oid *syntax = 0;
     if (hits == -1 && m_p->presentRequest)
+    {
         comp = m_p->presentRequest->recordComposition;
+        syntax = m_p->presentRequest->preferredRecordSyntax;
+    }
     else if (hits > 0 && m_p->searchRequest)
     {
+        syntax = m_p->searchRequest->preferredRecordSyntax;
         Z_ElementSetNames *esn;
 
         if (hits <= *m_p->searchRequest->smallSetUpperBound)
             esn = m_p->searchRequest->smallSetElementSetNames;
         else
             esn = m_p->searchRequest->mediumSetElementSetNames;
-        comp = (Z_RecordComposition *) nmem_malloc(m_p->nmem, sizeof(*comp));
+        comp = &comp_simple;
         comp->which = Z_RecordComp_simple;
         comp->u.simple = esn;
     }
-    add(o, npr, start, comp);
+    add(o, npr, start, comp, syntax);
 }
 
-int RecordCache::Rep::match(RecordCache_Entry *entry,
-                            Odr_oid *syntax, int offset,
-                            Z_RecordComposition *comp)
+int RecordCache::Rep::find_range(ODR o, int start, int num,
+                                 Odr_oid *syntax, Z_RecordComposition *comp,
+                                 RecordCache_Entry ***found)
 {
-    // See if our compspec match...
-    int match = 0;
-    ODR o1 = odr_createmem(ODR_ENCODE);
-    ODR o2 = odr_createmem(ODR_ENCODE);
-
-    z_RecordComposition(o1, &comp, 1, 0);
-    z_RecordComposition(o2, &entry->m_comp, 1, 0);
-
-    int len1 = -1;
-    char *buf1 = odr_getbuf(o1, &len1, 0);
-    int len2 = -1;
-    char *buf2 = odr_getbuf(o2, &len2, 0);
+    int i, no_missing = 0;
+    char *comp_buf;
+    int comp_len;
+    unsigned comp_hash = encode_comp(encode, comp, &comp_buf, &comp_len);
 
-    if (buf1 && buf2 && len1 && len1 == len2 && !memcmp(buf1, buf2, len1))
-        match = 1;
-    else if (!buf1 && !buf2 && !len1 && !len2)
-        match = 1;
+    *found = (RecordCache_Entry **) odr_malloc(o, num * sizeof(**found));
+    for (i = 0; i < num; i++)
+    {
+        (*found)[i] = syntax ?
+            find(comp_hash, comp_buf, comp_len, syntax, start + i) : 0;
+        if (!(*found)[i])
+            no_missing++;
+    }
+    return no_missing;
+}
 
-    odr_destroy(o1);
-    odr_destroy(o2);
-    if (!match)
-        return 0;
-    if (!syntax)
-        return 0;
-    // See if offset, OID match..
-    if (entry->m_offset == offset &&
-        entry->m_record->which == Z_NamePlusRecord_databaseRecord &&
-        !oid_oidcmp(entry->m_record->u.databaseRecord->direct_reference,
-                    syntax))
-        return 1;
-#if 0
-    char mstr1[100];
-    oid_to_dotstring(entry->m_record->u.databaseRecord->direct_reference, mstr1);
-    char mstr2[100];
-    oid_to_dotstring(syntax, mstr2);
-    yaz_log(YLOG_LOG, "match fail 3 d=%s s=%s", mstr1, mstr2);
+// record of entry decoded into o (inflated first if the entry is
+// compressed); touches entry
+Z_NamePlusRecord *RecordCache::Rep::get_record(ODR o,
+                                               RecordCache_Entry *entry)
+{
+    Z_NamePlusRecord *rec = 0;
+    const char *buf = entry->m_buf;
+    int len = entry->m_len;
+    char *raw_buf = 0;
+#if HAVE_ZLIB
+    if (entry->m_raw_len)
+    {
+        uLongf raw_len = entry->m_raw_len;
+        raw_buf = (char *) xmalloc(raw_len);
+        if (uncompress((Bytef *) raw_buf, &raw_len, (const Bytef *) buf,
+                       len) != Z_OK)
+            raw_len = 0;
+        buf = raw_buf;
+        len = raw_len;
+    }
 #endif
-
-    return 0;
+    odr_reset(record_decode);
+    odr_setbuf(record_decode, (char *) buf, len, 0);
+    if (z_NamePlusRecord(record_decode, &rec, 0, 0))
+        nmem_transfer(o->mem, record_decode->mem);
+    else
+    {
+        yaz_log(YLOG_WARN, "cache: decode of record failed");
+        rec = zget_surrogateDiagRec(o, 0, YAZ_BIB1_TEMPORARY_SYSTEM_ERROR,
+                                    "cache");
+    }
+    xfree(raw_buf);
+    touch(entry);
+    return rec;
 }
 
 int RecordCache::lookup(ODR o, Z_NamePlusRecordList **npr,
@@ -195,36 +582,69 @@ int RecordCache::lookup(ODR o, Z_NamePlusRecordList **npr,
     int i;
     yaz_log(YLOG_DEBUG, "cache lookup start=%d num=%d", start, num);
 
-    for (i = 0; i<num; i++)
+    if (!syntax || num <= 0)
+        return 0;
+    RecordCache_Entry **found;
+    int no_missing = m_p->find_range(o, start, num, syntax, comp, &found);
+    if (no_missing)
     {
-        RecordCache_Entry *entry = m_p->entries;
-        for(; entry; entry = entry->m_next)
-            if (m_p->match(entry, syntax, start+i, comp))
-                break;
-        if (!entry)
-            return 0;
+        m_p->misses += no_missing;
+        return 0;
     }
+    m_p->hits += num;
     *npr = (Z_NamePlusRecordList *) odr_malloc(o, sizeof(**npr));
     (*npr)->num_records = num;
     (*npr)->records = (Z_NamePlusRecord **)
         odr_malloc(o, num * sizeof(Z_NamePlusRecord *));
-    for (i = 0; i<num; i++)
-    {
-        RecordCache_Entry *entry = m_p->entries;
-        for(; entry; entry = entry->m_next)
-            if (m_p->match(entry, syntax, start+i, comp))
-                break;
-        if (!entry)
-            return 0;
-        (*npr)->records[i] = (Z_NamePlusRecord *)
-            odr_malloc(o, sizeof(Z_NamePlusRecord));
-        (*npr)->records[i]->databaseName = entry->m_record->databaseName;
-        (*npr)->records[i]->which = entry->m_record->which;
-        (*npr)->records[i]->u.databaseRecord =
-            entry->m_record->u.databaseRecord;
-    }
+    for (i = 0; i < num; i++)
+        (*npr)->records[i] = m_p->get_record(o, found[i]);
     return 1;
 }
+
+int RecordCache::lookup_partial(ODR o, Z_NamePlusRecordList **npr,
+                                int start, int num,
+                                Odr_oid *syntax,
+                                Z_RecordComposition *comp,
+                                int *num_missing, Range **missing)
+{
+    int i;
+    yaz_log(YLOG_DEBUG, "cache lookup_partial start=%d num=%d", start, num);
+
+    *npr = 0;
+    *num_missing = 0;
+    *missing = 0;
+    if (num <= 0)
+        return 0;
+    RecordCache_Entry **found;
+    int no_missing = m_p->find_range(o, start, num, syntax, comp, &found);
+    m_p->misses += no_missing;
+    m_p->hits += num - no_missing;
+
+    *npr = (Z_NamePlusRecordList *) odr_malloc(o, sizeof(**npr));
+    (*npr)->num_records = num;
+    (*npr)->records = (Z_NamePlusRecord **)
+        odr_malloc(o, num * sizeof(Z_NamePlusRecord *));
+    if (no_missing)  // at most this many ranges
+        *missing = (Range *) odr_malloc(o, no_missing * sizeof(Range));
+    for (i = 0; i < num; i++)
+    {
+        if (found[i])
+            (*npr)->records[i] = m_p->get_record(o, found[i]);
+        else
+        {
+            (*npr)->records[i] = 0;
+            if (i > 0 && !found[i - 1])
+                (*missing)[*num_missing - 1].number++;
+            else
+            {
+                (*missing)[*num_missing].start = start + i;
+                (*missing)[*num_missing].number = 1;
+                (*num_missing)++;
+            }
+        }
+    }
+    return num - no_missing;
+}
 /*
  * Local variables:
  * c-basic-offset: 4
@@ -8,6 +8,8 @@
 #endif
 #include <yaz/querytowrbuf.h>
 #include <yazpp/z-query.h>
+#include <yazpp/rpn-normalize.h>
+#include "cache-table.h"
 #include <yaz/pquery.h>
 #include <assert.h>
 
@@ -17,11 +19,70 @@ class Yaz_Z_Query::Rep {
     friend class Yaz_Z_Query;
     char *buf;
     int len;
+    Z_Query *query;      // decoded buf; 0 until asked for
+    char *canon_buf;     // canonical encoding; 0 until asked for
+    int canon_len;
+    unsigned long long hash;
     ODR odr_decode;
     ODR odr_encode;
     ODR odr_print;
+    ODR odr_canon;
+    void reset();
+    Z_Query *decode();
+    int canonical();
 };
 
+// drop everything derived from buf
+void Yaz_Z_Query::Rep::reset()
+{
+    query = 0;
+    canon_buf = 0;
+    canon_len = 0;
+    odr_reset(odr_decode);
+    odr_reset(odr_canon);
+}
+
+Z_Query *Yaz_Z_Query::Rep::decode()
+{
+    if (!query && buf)
+    {
+        odr_reset(odr_decode);
+        odr_setbuf(odr_decode, buf, len, 0);
+        if (!z_Query(odr_decode, &query, 0, 0))
+            query = 0;
+    }
+    return query;
+}
+
+/* The canonical form is our own encoding of the decoded query with
+   type-101 stored as type-1 (same RPN structure). Sets canon_buf and
+   hash; returns 0 if there is no (valid) query */
+int Yaz_Z_Query::Rep::canonical()
+{
+    if (canon_buf)
+        return 1;
+    Z_Query *q = decode();
+    if (!q)
+        return 0;
+    if (q->which == Z_Query_type_101)
+    {
+        Z_Query *q1 = (Z_Query *) odr_malloc(odr_canon, sizeof(*q1));
+        q1->which = Z_Query_type_1;
+        q1->u.type_1 = q->u.type_101;
+        if (!z_Query(odr_canon, &q1, 0, 0))
+            return 0;
+        canon_buf = odr_getbuf(odr_canon, &canon_len, 0);
+    }
+    else
+    {
+        // buf is always encoded by us, so already canonical
+        canon_buf = buf;
+        canon_len = len;
+    }
+    hash = cache_hash64(canon_buf, canon_len);
+    return 1;
+}
+
 
 Yaz_Z_Query::Yaz_Z_Query()
 {
@@ -29,8 +90,10 @@ Yaz_Z_Query::Yaz_Z_Query()
     m_p->odr_encode = odr_createmem(ODR_ENCODE);
     m_p->odr_decode = odr_createmem(ODR_DECODE);
     m_p->odr_print = odr_createmem(ODR_PRINT);
+    m_p->odr_canon = odr_createmem(ODR_ENCODE);
     m_p->len = 0;
     m_p->buf = 0;
+    m_p->reset();
 }
 
 
@@ -41,16 +104,23 @@ Yaz_Z_Query::Yaz_Z_Query(const Yaz_Z_Query &q)
     m_p->odr_encode = odr_createmem(ODR_ENCODE);
     m_p->odr_decode = odr_createmem(ODR_DECODE);
     m_p->odr_print = odr_createmem(ODR_PRINT);
+    m_p->odr_canon = odr_createmem(ODR_ENCODE);
+    m_p->reset();
 
     m_p->len = q.m_p->len;
-    m_p->buf = (char*) odr_malloc(m_p->odr_encode, m_p->len);
-    memcpy(m_p->buf, q.m_p->buf, m_p->len);
+    m_p->buf = 0;
+    if (q.m_p->buf)
+    {
+        m_p->buf = (char*) odr_malloc(m_p->odr_encode, m_p->len);
+        memcpy(m_p->buf, q.m_p->buf, m_p->len);
+    }
 }
 
 Yaz_Z_Query& Yaz_Z_Query::operator=(const Yaz_Z_Query &q)
 {
     if (this != &q)
     {
+        m_p->reset();
         odr_reset(m_p->odr_encode);
         if (!q.m_p->buf)
         {
@@ -76,6 +146,7 @@ Yaz_Z_Query& Yaz_Z_Query::operator=(const char *rpn)
 int Yaz_Z_Query::set_rpn(const char *rpn)
 {
     m_p->buf = 0;
+    m_p->reset();
     odr_reset(m_p->odr_encode);
     Z_Query *query = (Z_Query*) odr_malloc(m_p->odr_encode, sizeof(*query));
     query->which = Z_Query_type_1;
@@ -90,11 +161,19 @@ int Yaz_Z_Query::set_rpn(const char *rpn)
 
 void Yaz_Z_Query::set_Z_Query(Z_Query *z_query)
 {
+    // z_query may be our own decoded query (get_Z_Query), so encode it
+    // before buf and the decoded tree are released: into odr_canon,
+    // which then becomes odr_encode
+    m_p->canon_buf = 0;
+    odr_reset(m_p->odr_canon);
+    int r = z_Query(m_p->odr_canon, &z_query, 0, 0);
+    ODR odr = m_p->odr_canon;
+    m_p->odr_canon = m_p->odr_encode;
+    m_p->odr_encode = odr;
     m_p->buf = 0;
-    odr_reset(m_p->odr_encode);
-    if (!z_Query(m_p->odr_encode, &z_query, 0, 0))
-        return;
-    m_p->buf = odr_getbuf(m_p->odr_encode, &m_p->len, 0);
+    if (r)
+        m_p->buf = odr_getbuf(m_p->odr_encode, &m_p->len, 0);
+    m_p->reset();
 }
 
 Yaz_Z_Query::~Yaz_Z_Query()
@@ -102,29 +181,20 @@ Yaz_Z_Query::~Yaz_Z_Query()
     odr_destroy(m_p->odr_encode);
     odr_destroy(m_p->odr_decode);
     odr_destroy(m_p->odr_print);
+    odr_destroy(m_p->odr_canon);
     delete m_p;
 }
 
 Z_Query *Yaz_Z_Query::get_Z_Query()
 {
-    Z_Query *query;
-    if (!m_p->buf)
-        return 0;
-    odr_reset(m_p->odr_decode);
-    odr_setbuf(m_p->odr_decode, m_p->buf, m_p->len, 0);
-    if (!z_Query(m_p->odr_decode, &query, 0, 0))
-        return 0;
-    return query;
+    return m_p->decode();
 }
 
 void Yaz_Z_Query::print(char *str, size_t len)
 {
-    Z_Query *query;
     *str = 0;
-    if (!m_p->buf)
-        return;
-    odr_setbuf(m_p->odr_decode, m_p->buf, m_p->len, 0);
-    if (!z_Query(m_p->odr_decode, &query, 0, 0))
+    Z_Query *query = m_p->decode();
+    if (!query)
         return;
     WRBUF wbuf = wrbuf_alloc();
     yaz_query_to_wrbuf(wbuf, query);
@@ -136,20 +206,60 @@ void Yaz_Z_Query::print(char *str, size_t len)
     else
         strcpy(str, wrbuf_cstr(wbuf));
     wrbuf_destroy(wbuf);
-    odr_reset(m_p->odr_decode);
 }
 
 int Yaz_Z_Query::match(const Yaz_Z_Query *other)
 {
-    if (m_p->len != other->m_p->len)
+    if (!m_p->canonical() || !other->m_p->canonical())
+        return 0;
+    if (m_p->hash != other->m_p->hash)
         return 0;
-    if (!m_p->buf || !other->m_p->buf)
+    if (m_p->canon_len != other->m_p->canon_len)
         return 0;
-    if (memcmp(m_p->buf, other->m_p->buf, m_p->len))
+    if (memcmp(m_p->canon_buf, other->m_p->canon_buf, m_p->canon_len))
         return 0;
     return 1;
 }
 
+int Yaz_Z_Query::normalize(RPN_Normalizer *normalizer)
+{
+    Z_Query *query = m_p->decode();
+    if (!query)
+        return -1;
+    if (query->which == Z_Query_type_1)
+        normalizer->normalize(m_p->odr_decode, query->u.type_1);
+    else if (query->which == Z_Query_type_101)
+        normalizer->normalize(m_p->odr_decode, query->u.type_101);
+    else
+        return 0;
+    // the decoded tree does not refer to buf, so it may be reused
+    m_p->buf = 0;
+    odr_reset(m_p->odr_encode);
+    int r = z_Query(m_p->odr_encode, &query, 0, 0);
+    if (r)
+        m_p->buf = odr_getbuf(m_p->odr_encode, &m_p->len, 0);
+    m_p->reset();
+    return r ? 0 : -1;
+}
+
+unsigned long long Yaz_Z_Query::get_hash()
+{
+    if (!m_p->canonical())
+        return 0;
+    return m_p->hash;
+}
+
+const char *Yaz_Z_Query::get_canonical(int *len)
+{
+    if (!m_p->canonical())
+    {
+        *len = 0;
+        return 0;
+    }
+    *len = m_p->canon_len;
+    return m_p->canon_buf;
+}
+
 /*
  * Local variables:
  * c-basic-offset: 4
@@ -11,6 +11,61 @@
 
 using namespace yazpp_1;
 
+Yaz_Facility_Retrieval::Yaz_Facility_Retrieval()
+{
+    m_preferredMessageSize = 0;
+    m_maximumRecordSize = 0;
+    m_odr_encode = 0;
+    m_odr_decode = 0;
+    m_async = false;
+    m_running = 0;
+    m_destroy = false;
+    m_mutex = 0;
+    yaz_mutex_create(&m_mutex);
+}
+
+Yaz_Facility_Retrieval::~Yaz_Facility_Retrieval()
+{
+    if (m_running)
+        yaz_log(YLOG_WARN, "Yaz_Facility_Retrieval: deleted while in use "
+                "by a worker; use destroy");
+    yaz_mutex_destroy(&m_mutex);
+}
+
+void Yaz_Facility_Retrieval::destroy()
+{
+    yaz_mutex_enter(m_mutex);
+    bool running = m_running > 0;
+    if (running)
+        m_destroy = true;
+    yaz_mutex_leave(m_mutex);
+    if (!running)
+        delete this;
+}
+
+/* count of handlers running in workers; see Z_ServerWorkers::Rep.
+   The last worker to leave deletes the facility if destroy was called
+   meanwhile */
+void Yaz_Facility_Retrieval::running_add(int delta)
+{
+    yaz_mutex_enter(m_mutex);
+    m_running += delta;
+    bool destroy = m_running == 0 && m_destroy;
+    yaz_mutex_leave(m_mutex);
+    if (destroy)
+        delete this;
+}
+
+static Z_NamePlusRecord *new_record(ODR odr)
+{
+    Z_NamePlusRecord *rec =
+        (Z_NamePlusRecord *) odr_malloc (odr, sizeof(*rec));
+    rec->databaseName = 0;
+    rec->which = Z_NamePlusRecord_databaseRecord;
+    rec->u.databaseRecord = 0;
+    return rec;
+}
+
 Z_Records *Yaz_Facility_Retrieval::pack_records (Z_Server *s,
                                                  const char *resultSetName,
                                                  int start, int xnum,
@@ -19,6 +74,10 @@ Z_Records *Yaz_Facility_Retrieval::pack_records (Z_Server *s,
                                                  Odr_oid *format)
 {
     int recno, total_length = 0, toget = xnum, dumped_records = 0;
+    int i, batch_start = start, batch_count = 0, num_batch = 0;
+    int batch_length = 0;
+    bool use_batch = true;
+    Z_NamePlusRecord **batch = 0;
     Z_Records *records =
         (Z_Records *) odr_malloc (odr_encode(), sizeof(*records));
     Z_NamePlusRecordList *reclist =
@@ -35,34 +94,73 @@ Z_Records *Yaz_Facility_Retrieval::pack_records (Z_Server *s,
 
     for (recno = start; reclist->num_records < toget; recno++)
     {
-        Z_NamePlusRecord *this_rec =
-            (Z_NamePlusRecord *) odr_malloc (odr_encode(), sizeof(*this_rec));
-        this_rec->databaseName = 0;
-        this_rec->which = Z_NamePlusRecord_databaseRecord;
-        this_rec->u.databaseRecord = 0;
+        Z_NamePlusRecord *this_rec = 0;
 
+        /*
+         * the length of a record is what was allocated on the stream
+         * to fetch it; records of a batch share that of the batch
+         */
         int this_length = 0;
+        int before;
 
-        sr_record (resultSetName, recno, format, comp, this_rec, records);
+        if (use_batch && recno - batch_start == num_batch
+            && num_batch == batch_count)
+        {
+            /* next batch: one record to begin with, then as many as
+               are likely to fit in what is left of the preferred
+               message size, judged by the records so far */
+            batch_count = 1;
+            if (recno > start)
+            {
+                int avg = (total_length + dumped_records) / (recno - start);
+                batch_count = (m_preferredMessageSize - total_length) /
+                    (avg + 1) + 1;
+            }
+            if (batch_count > toget - reclist->num_records)
+                batch_count = toget - reclist->num_records;
+            if (batch_count < 1)
+                batch_count = 1;
+            batch = (Z_NamePlusRecord **)
+                odr_malloc (odr_encode(), sizeof(*batch) * batch_count);
+            before = odr_total(odr_encode());
+            for (i = 0; i < batch_count; i++)
+                batch[i] = new_record(odr_encode());
+            batch_start = recno;
+            num_batch = sr_records (resultSetName, recno, batch_count,
+                                    format, comp, batch, records);
+            if (num_batch > batch_count)
+                num_batch = batch_count;
+            if (num_batch < 0 && recno == start)
+                use_batch = false;  // not implemented; use sr_record
+            else if (num_batch > 0)
+                batch_length = (odr_total(odr_encode()) - before) / num_batch;
+        }
+        if (!use_batch)
+        {
+            before = odr_total(odr_encode());
+            this_rec = new_record(odr_encode());
+            sr_record (resultSetName, recno, format, comp, this_rec, records);
+            this_length = odr_total(odr_encode()) - before;
+        }
+        else if (recno - batch_start < num_batch)
+        {
+            this_rec = batch[recno - batch_start];
+            this_length = batch_length;
+        }
 
         if (records->which != Z_Records_DBOSD)
         {
             *pres = Z_PresentStatus_failure;
-            return records;
+            break;
         }
+        if (!this_rec)
+            break;      // end of result set
 
         if (this_rec->which == Z_NamePlusRecord_databaseRecord &&
             this_rec->u.databaseRecord == 0)
         {   // handler did not return a record..
             create_surrogateDiagnostics(odr_encode(), this_rec, 0, 14, 0);
         }
-        /*
-         * we get the number of bytes allocated on the stream before any
-         * allocation done by the backend - this should give us a reasonable
-         * idea of the total size of the data so far.
-         */
-        total_length = odr_total(odr_encode()) - dumped_records;
-        this_length = odr_total(odr_encode()) - total_length;
         if (this_length + total_length > m_preferredMessageSize)
         {
             /* record is small enough, really */
@@ -101,10 +199,21 @@ Z_Records *Yaz_Facility_Retrieval::pack_records (Z_Server *s,
         reclist->records[reclist->num_records] = this_rec;
         reclist->num_records++;
         *next = recno + 1;
+        total_length += this_length;
     }
     return records;
 }
 
+int Yaz_Facility_Retrieval::sr_records (const char *resultSetName,
+                                        int start, int count,
+                                        Odr_oid *format,
+                                        Z_RecordComposition *comp,
+                                        Z_NamePlusRecord **namePlusRecords,
+                                        Z_Records *diagnostics)
+{
+    return -1;
+}
+
 void Yaz_Facility_Retrieval::fetch_via_piggyback (Z_Server *s,
                                                   Z_SearchRequest *req,
                                                   Z_SearchResponse *res)
@@ -207,11 +316,121 @@ ODR Yaz_Facility_Retrieval::odr_decode()
     return m_odr_decode;
 }
 
+const int *Yaz_Facility_Retrieval::apdu_types()
+{
+    static const int types[] = {
+        Z_APDU_searchRequest, Z_APDU_presentRequest, -1
+    };
+    return types;
+}
+
+void Yaz_Facility_Retrieval::set_async(bool async)
+{
+    m_async = async;
+}
+
+void Yaz_Facility_Retrieval::sr_search_async(Z_SearchRequest *searchRequest,
+                                             Z_ServerDeferred *deferred)
+{
+    sr_search(searchRequest, deferred->get_response()->u.searchResponse);
+    deferred->complete();
+}
+
+void Yaz_Facility_Retrieval::sr_present_async(
+    Z_PresentRequest *presentRequest, Z_ServerDeferred *deferred)
+{
+    sr_present(presentRequest, deferred->get_response()->u.presentResponse);
+    deferred->complete();
+}
+
+// called by a thread of Z_ServerWorkers
+void Yaz_Facility_Retrieval::run_deferred(Z_Server *s,
+                                          Z_ServerDeferred *deferred)
+{
+    Z_APDU *apdu_request = deferred->get_request();
+    Z_APDU *apdu_response = deferred->get_response();
+    ODR odr_encode_s = m_odr_encode;
+    ODR odr_decode_s = m_odr_decode;
+    // the ODRs of the session belong to its thread
+    m_odr_encode = deferred->odr_encode();
+    m_odr_decode = deferred->odr_encode();
+    if (apdu_request->which == Z_APDU_searchRequest)
+    {
+        sr_search(apdu_request->u.searchRequest,
+                  apdu_response->u.searchResponse);
+        if (!apdu_response->u.searchResponse->records)
+            fetch_via_piggyback(s, apdu_request->u.searchRequest,
+                                apdu_response->u.searchResponse);
+    }
+    else
+    {
+        sr_present(apdu_request->u.presentRequest,
+                   apdu_response->u.presentResponse);
+        if (!apdu_response->u.presentResponse->records)
+            fetch_via_present(s, apdu_request->u.presentRequest,
+                              apdu_response->u.presentResponse);
+    }
+    deferred->encode();
+    m_odr_encode = odr_encode_s;
+    m_odr_decode = odr_decode_s;
+}
+
+// called by the session when deferred is complete, before sending it
+void Yaz_Facility_Retrieval::finish_deferred(Z_Server *s,
+                                             Z_ServerDeferred *deferred)
+{
+    Z_APDU *apdu_request = deferred->get_request();
+    Z_APDU *apdu_response = deferred->get_response();
+    m_odr_encode = deferred->odr_encode();
+    m_odr_decode = s->odr_decode();
+    if (apdu_response->which == Z_APDU_searchResponse)
+    {
+        if (!apdu_response->u.searchResponse->records)
+            fetch_via_piggyback(s, apdu_request->u.searchRequest,
+                                apdu_response->u.searchResponse);
+    }
+    else if (apdu_response->which == Z_APDU_presentResponse)
+    {
+        if (!apdu_response->u.presentResponse->records)
+            fetch_via_present(s, apdu_request->u.presentRequest,
+                              apdu_response->u.presentResponse);
+    }
+    m_odr_encode = s->odr_encode();
+}
+
 int Yaz_Facility_Retrieval::recv(Z_Server *s, Z_APDU *apdu_request)
 {
     Z_APDU *apdu_response;
     m_odr_encode = s->odr_encode();
     m_odr_decode = s->odr_decode();
+    Z_ServerWorkers *workers = m_async ? 0 : s->get_workers();
+    // a worker could not wake the session when done
+    if (workers && s->wakeup_fd() == -1)
+        workers = 0;
+    if ((m_async || workers) &&
+        (apdu_request->which == Z_APDU_searchRequest ||
+         apdu_request->which == Z_APDU_presentRequest))
+    {
+        Z_ServerDeferred *deferred = new Z_ServerDeferred(
+            s, apdu_request,
+            apdu_request->which == Z_APDU_searchRequest ?
+            Z_APDU_searchResponse : Z_APDU_presentResponse, this);
+        s->defer(deferred);
+        if (workers)
+        {
+            workers->submit(deferred);
+            return 1;
+        }
+        // default handlers allocate with odr_encode()
+        m_odr_encode = deferred->odr_encode();
+        apdu_request = deferred->get_request();
+        if (apdu_request->which == Z_APDU_searchRequest)
+            sr_search_async(apdu_request->u.searchRequest, deferred);
+        else
+            sr_present_async(apdu_request->u.presentRequest, deferred);
+        m_odr_encode = s->odr_encode();
+        return 1;
+    }
     switch (apdu_request->which)
     {
     case Z_APDU_searchRequest:
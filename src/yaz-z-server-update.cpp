@@ -22,6 +22,12 @@ int Yaz_Facility_Update::init(Z_Server *s, Z_InitRequest *initRequest,
     return 1;
 }
 
+const int *Yaz_Facility_Update::apdu_types()
+{
+    static const int types[] = { Z_APDU_extendedServicesRequest, -1 };
+    return types;
+}
+
 int Yaz_Facility_Update::recv(Z_Server *s, Z_APDU *apdu_request)
 {
     Z_APDU *apdu_response;
@@ -6,35 +6,469 @@
 #if HAVE_CONFIG_H
 #include <config.h>
 #endif
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 #include <yaz/log.h>
+#include <yaz/mutex.h>
+#include <yaz/thread_create.h>
+#include <yaz/xmalloc.h>
 #include <yazpp/z-server.h>
+#include <yazpp/gdu.h>
+#include <yazpp/gduqueue.h>
+#include <yazpp/socket-observer.h>
 #include <yaz/oid_db.h>
 
 using namespace yazpp_1;
 
+/* Shared by the session and the handler; the last one to let go
+   deletes it, so a handler may complete after the session is gone */
+class Z_ServerDeferred::Rep {
+    friend class Z_ServerDeferred;
+    friend class Z_Server;
+    friend class Z_ServerWorkers;
+    Z_Server *server;
+    GDU *request;
+    Z_APDU *response;
+    ODR odr;
+    Yaz_Facility_Retrieval *facility;
+    YAZ_MUTEX mutex;
+    int refcount;
+    bool complete;
+    int wakeup_fd;      // written to on completion; -1 for none
+    char *buf;          // response encoded by a worker; 0 for none
+    int len;
+    bool submitted;     // handled by Z_ServerWorkers
+    Z_ServerDeferred *next;     // guarded by the mutex of Z_ServerWorkers
+};
+
+Z_ServerDeferred::Z_ServerDeferred(Z_Server *s, Z_APDU *request,
+                                   int response_type,
+                                   Yaz_Facility_Retrieval *facility)
+{
+    m_p = new Rep;
+    m_p->server = s;
+    m_p->request = new GDU(request);
+    m_p->odr = odr_createmem(ODR_ENCODE);
+    m_p->response = zget_APDU(m_p->odr, response_type);
+    m_p->facility = facility;
+    m_p->mutex = 0;
+    yaz_mutex_create(&m_p->mutex);
+    m_p->refcount = 2;
+    m_p->complete = false;
+    m_p->wakeup_fd = -1;
+    m_p->buf = 0;
+    m_p->len = 0;
+    m_p->submitted = false;
+    m_p->next = 0;
+
+    Z_ReferenceId **id_from = s->get_referenceIdP(get_request());
+    Z_ReferenceId **id_to = s->get_referenceIdP(m_p->response);
+    if (id_to && id_from && *id_from)
+        *id_to = odr_create_Odr_oct(m_p->odr, (*id_from)->buf,
+                                    (*id_from)->len);
+}
+
+Z_ServerDeferred::~Z_ServerDeferred()
+{
+    yaz_mutex_destroy(&m_p->mutex);
+    odr_destroy(m_p->odr);
+    delete m_p->request;
+    delete m_p;
+}
+
+Z_APDU *Z_ServerDeferred::get_request()
+{
+    return m_p->request->get()->u.z3950;
+}
+
+Z_APDU *Z_ServerDeferred::get_response()
+{
+    return m_p->response;
+}
+
+ODR Z_ServerDeferred::odr_encode()
+{
+    return m_p->odr;
+}
+
+void Z_ServerDeferred::complete()
+{
+    yaz_mutex_enter(m_p->mutex);
+    m_p->complete = true;
+#if HAVE_UNISTD_H
+    if (m_p->wakeup_fd != -1 && write(m_p->wakeup_fd, "", 1) != 1)
+        yaz_log(YLOG_WARN|YLOG_ERRNO, "Z_ServerDeferred: write");
+#endif
+    int refcount = --m_p->refcount;
+    yaz_mutex_leave(m_p->mutex);
+    if (refcount == 0)
+        delete this;
+}
+
+bool Z_ServerDeferred::is_complete()
+{
+    yaz_mutex_enter(m_p->mutex);
+    bool complete = m_p->complete;
+    yaz_mutex_leave(m_p->mutex);
+    return complete;
+}
+
+// session is done with it
+void Z_ServerDeferred::release()
+{
+    yaz_mutex_enter(m_p->mutex);
+    m_p->wakeup_fd = -1;
+    int refcount = --m_p->refcount;
+    yaz_mutex_leave(m_p->mutex);
+    if (refcount == 0)
+        delete this;
+}
+
+// encode the response so that the session need only send it
+void Z_ServerDeferred::encode()
+{
+    Z_APDU *apdu = m_p->response;
+    if (z_APDU(m_p->odr, &apdu, 0, 0))
+        m_p->buf = odr_getbuf(m_p->odr, &m_p->len, 0);
+    else
+        yaz_log(YLOG_LOG, "Z_ServerDeferred: encode failed. Element %s",
+                odr_getelement(m_p->odr) ? odr_getelement(m_p->odr) :
+                "unknown");
+}
+
+/* Requests waiting for a thread, linked through Z_ServerDeferred::Rep
+   next, and the threads. A request taken off the queue is counted as
+   running by its facility before the mutex is let go, so once
+   withdraw has returned the facility knows of any use of it */
+class Z_ServerWorkers::Rep {
+    friend class Z_ServerWorkers;
+    YAZ_MUTEX mutex;
+    YAZ_COND cond;      // request queued or stop
+    Z_ServerDeferred *first;
+    Z_ServerDeferred **last;
+    int num_threads;
+    yaz_thread_t *threads;
+    bool stop;
+    static void *thread_main(void *p);
+};
+
+void *Z_ServerWorkers::Rep::thread_main(void *p)
+{
+    Rep *rep = (Rep *) p;
+    yaz_mutex_enter(rep->mutex);
+    while (1)
+    {
+        Z_ServerDeferred *deferred = rep->first;
+        if (!deferred)
+        {
+            if (rep->stop)
+                break;
+            yaz_cond_wait(rep->cond, rep->mutex, 0);
+            continue;
+        }
+        rep->first = deferred->m_p->next;
+        if (!rep->first)
+            rep->last = &rep->first;
+        Yaz_Facility_Retrieval *facility = deferred->m_p->facility;
+        facility->running_add(1);
+        yaz_mutex_leave(rep->mutex);
+
+        // the session may be gone by now; run_deferred does not use it
+        facility->run_deferred(deferred->m_p->server, deferred);
+        facility->running_add(-1);
+        deferred->complete();
+        yaz_mutex_enter(rep->mutex);
+    }
+    yaz_mutex_leave(rep->mutex);
+    return 0;
+}
+
+Z_ServerWorkers::Z_ServerWorkers(int num_threads)
+{
+    m_p = new Rep;
+    m_p->mutex = 0;
+    yaz_mutex_create(&m_p->mutex);
+    m_p->cond = 0;
+    yaz_cond_create(&m_p->cond);
+    m_p->first = 0;
+    m_p->last = &m_p->first;
+    m_p->stop = false;
+    m_p->num_threads = num_threads > 0 ? num_threads : 1;
+    m_p->threads = (yaz_thread_t *)
+        xmalloc(m_p->num_threads * sizeof(*m_p->threads));
+    int i;
+    for (i = 0; i < m_p->num_threads; i++)
+        m_p->threads[i] = yaz_thread_create(Rep::thread_main, m_p);
+}
+
+Z_ServerWorkers::~Z_ServerWorkers()
+{
+    yaz_mutex_enter(m_p->mutex);
+    m_p->stop = true;
+    yaz_cond_broadcast(m_p->cond);
+    yaz_mutex_leave(m_p->mutex);
+    int i;
+    for (i = 0; i < m_p->num_threads; i++)
+        yaz_thread_join(&m_p->threads[i], 0);
+    xfree(m_p->threads);
+    yaz_cond_destroy(&m_p->cond);
+    yaz_mutex_destroy(&m_p->mutex);
+    delete m_p;
+}
+
+void Z_ServerWorkers::submit(Z_ServerDeferred *deferred)
+{
+    deferred->m_p->submitted = true;
+    yaz_mutex_enter(m_p->mutex);
+    deferred->m_p->next = 0;
+    *m_p->last = deferred;
+    m_p->last = &deferred->m_p->next;
+    yaz_cond_signal(m_p->cond);
+    yaz_mutex_leave(m_p->mutex);
+}
+
+/* Take deferred out of the queue. One that is running is not waited
+   for: the session lets go of it, so it is deleted with its response
+   when the worker completes it */
+void Z_ServerWorkers::withdraw(Z_ServerDeferred *deferred)
+{
+    bool queued = false;
+    yaz_mutex_enter(m_p->mutex);
+    Z_ServerDeferred **dp = &m_p->first;
+    while (*dp && *dp != deferred)
+        dp = &(*dp)->m_p->next;
+    if (*dp)
+    {
+        *dp = deferred->m_p->next;
+        if (!*dp)
+            m_p->last = dp;
+        queued = true;
+    }
+    yaz_mutex_leave(m_p->mutex);
+    if (queued)
+        deferred->complete();
+}
+
+/* Facilities to offer an APDU to, indexed by APDU type. Each list is
+   0-terminated and in the order the facilities were added. Types with
+   no list get the facilities that take any type.
+
+   At most one deferred response is outstanding; requests that arrive
+   meanwhile are held. A handler completing in another thread wakes
+   the session's event loop through a pipe */
+class Z_Server::Rep : public ISocketObserver {
+    friend class Z_Server;
+    Z_Server *server;
+    int num_types;
+    IServer_Facility ***table;
+    IServer_Facility **any;
+    Z_ServerDeferred *pending;
+    Z_ServerWorkers *workers;
+    GDUQueue held;
+    int wakeup[2];
+    ISocketObservable *observable;
+    void socketNotify(int event);
+    void free_table();
+    void build_table(Z_Server_Facility_Info *facilities);
+    static int takes_type(Z_Server_Facility_Info *f, int type);
+    static IServer_Facility **facility_list(
+        Z_Server_Facility_Info *facilities, int type);
+};
+
+void Z_Server::Rep::free_table()
+{
+    int i;
+    for (i = 0; i < num_types; i++)
+        xfree(table[i]);
+    xfree(table);
+    xfree(any);
+    table = 0;
+    any = 0;
+    num_types = 0;
+}
+
+int Z_Server::Rep::takes_type(Z_Server_Facility_Info *f, int type)
+{
+    if (!f->m_apdu_types)
+        return 1;
+    int i;
+    for (i = 0; f->m_apdu_types[i] != -1; i++)
+        if (f->m_apdu_types[i] == type)
+            return 1;
+    return 0;
+}
+
+IServer_Facility **Z_Server::Rep::facility_list(
+    Z_Server_Facility_Info *facilities, int type)
+{
+    Z_Server_Facility_Info *f;
+    int n = 0;
+    for (f = facilities; f; f = f->m_next)
+        if (takes_type(f, type))
+            n++;
+    IServer_Facility **list = (IServer_Facility **)
+        xmalloc((n + 1) * sizeof(*list));
+    n = 0;
+    for (f = facilities; f; f = f->m_next)
+        if (takes_type(f, type))
+            list[n++] = f->m_facility;
+    list[n] = 0;
+    return list;
+}
+
+void Z_Server::Rep::build_table(Z_Server_Facility_Info *facilities)
+{
+    free_table();
+    Z_Server_Facility_Info *f;
+    int i;
+    for (f = facilities; f; f = f->m_next)
+        for (i = 0; f->m_apdu_types && f->m_apdu_types[i] != -1; i++)
+            if (f->m_apdu_types[i] >= num_types)
+                num_types = f->m_apdu_types[i] + 1;
+    if (num_types)
+        table = (IServer_Facility ***) xmalloc(num_types * sizeof(*table));
+    for (i = 0; i < num_types; i++)
+        table[i] = facility_list(facilities, i);
+    any = facility_list(facilities, -1);
+}
+
+void Z_Server::Rep::socketNotify(int event)
+{
+#if HAVE_UNISTD_H
+    if (event & SOCKET_OBSERVE_READ)
+    {
+        char buf[64];
+        if (read(wakeup[0], buf, sizeof(buf)) < 0)
+            yaz_log(YLOG_WARN|YLOG_ERRNO, "Z_Server: read");
+        server->flush_deferred();
+    }
+#endif
+}
+
 Z_Server::Z_Server(IPDU_Observable *the_PDU_Observable)
     : Z_Assoc(the_PDU_Observable)
 {
     m_facilities = 0;
+    m_p = new Rep;
+    m_p->server = this;
+    m_p->num_types = 0;
+    m_p->table = 0;
+    m_p->any = 0;
+    m_p->build_table(0);
+    m_p->pending = 0;
+    m_p->workers = 0;
+    m_p->wakeup[0] = m_p->wakeup[1] = -1;
+    m_p->observable = 0;
 }
 
 Z_Server::~Z_Server()
 {
     facility_reset();
+    m_p->held.clear();
+#if HAVE_UNISTD_H
+    if (m_p->wakeup[0] != -1)
+    {
+        m_p->observable->deleteObserver(m_p);
+        ::close(m_p->wakeup[0]);
+        ::close(m_p->wakeup[1]);
+    }
+#endif
+    m_p->free_table();
+    delete m_p;
+}
+
+// write end of the pipe that wakes the session, made on first use;
+// -1 if there is no event loop to wake
+int Z_Server::wakeup_fd()
+{
+#if HAVE_UNISTD_H
+    ISocketObservable *observable = get_socket_observable();
+    if (m_p->wakeup[0] == -1 && observable)
+    {
+        if (pipe(m_p->wakeup))
+        {
+            yaz_log(YLOG_WARN|YLOG_ERRNO, "Z_Server: pipe");
+            m_p->wakeup[0] = m_p->wakeup[1] = -1;
+        }
+        else
+        {
+            m_p->observable = observable;
+            observable->addObserver(m_p->wakeup[0], m_p);
+            observable->maskObserver(m_p, SOCKET_OBSERVE_READ);
+        }
+    }
+#endif
+    return m_p->wakeup[1];
+}
+
+void Z_Server::defer(Z_ServerDeferred *deferred)
+{
+    m_p->pending = deferred;
+    deferred->m_p->wakeup_fd = wakeup_fd();
+    if (deferred->m_p->wakeup_fd == -1)
+        yaz_log(YLOG_WARN, "Z_Server: no event loop to wake; deferred "
+                "responses must be completed by the session's thread");
+}
+
+/* Send completed responses and handle held requests in order until a
+   response is outstanding */
+void Z_Server::flush_deferred()
+{
+    while (1)
+    {
+        Z_ServerDeferred *deferred = m_p->pending;
+        if (deferred)
+        {
+            if (!deferred->is_complete())
+                break;
+            m_p->pending = 0;
+            if (!deferred->m_p->submitted)
+                deferred->m_p->facility->finish_deferred(this, deferred);
+            const char *apdu_log = get_APDU_log();
+            if (deferred->m_p->buf && !(apdu_log && *apdu_log)
+                && !get_APDU_yazlog())
+                send_PDU(deferred->m_p->buf, deferred->m_p->len);
+            else
+                send_Z_PDU(deferred->get_response(), 0);
+            deferred->release();
+            continue;
+        }
+        GDU *gdu = m_p->held.dequeue();
+        if (!gdu)
+            break;
+        int r = dispatch(gdu->get()->u.z3950);
+        delete gdu;
+        if (r)
+        {
+            close();
+            break;
+        }
+    }
 }
 
 void Z_Server::facility_reset ()
 {
+    if (m_p->pending)
+    {
+        if (m_p->workers)
+            m_p->workers->withdraw(m_p->pending);
+        yaz_log(YLOG_LOG, "Z_Server: outstanding response dropped");
+        m_p->pending->release();
+        m_p->pending = 0;
+    }
     Z_Server_Facility_Info *p = m_facilities;
     while (p)
     {
         Z_Server_Facility_Info *p_next = p->m_next;
 
         delete [] p->m_name;
+        delete [] p->m_apdu_types;
         delete p;
         p = p_next;
     }
     m_facilities = 0;
+    m_p->build_table(0);
 }
 
 void Z_Server::facility_add(IServer_Facility *facility,
@@ -50,6 +484,28 @@ void Z_Server::facility_add(IServer_Facility *facility,
     (*p)->m_name = new char [strlen(name)+1];
     strcpy ((*p)->m_name, name);
     (*p)->m_facility = facility;
+    (*p)->m_apdu_types = 0;
+
+    const int *types = facility->apdu_types();
+    if (types)
+    {
+        int n = 0;
+        while (types[n] != -1)
+            n++;
+        (*p)->m_apdu_types = new int [n+1];
+        memcpy((*p)->m_apdu_types, types, (n+1) * sizeof(int));
+    }
+    m_p->build_table(m_facilities);
+}
+
+void Z_Server::set_workers(Z_ServerWorkers *workers)
+{
+    m_p->workers = workers;
+}
+
+Z_ServerWorkers *Z_Server::get_workers()
+{
+    return m_p->workers;
 }
 
 void Z_Server::recv_GDU (Z_GDU *apdu, int len)
@@ -61,6 +517,23 @@ void Z_Server::recv_GDU (Z_GDU *apdu, int len)
 }
 
 void Z_Server::recv_Z_PDU (Z_APDU *apdu_request, int len)
+{
+    if (m_p->pending || m_p->held.size())
+    {
+        // sends what has completed since; the only chance to do so
+        // when there is no event loop to wake
+        m_p->held.enqueue(new GDU(apdu_request));
+        flush_deferred();
+        return;
+    }
+    if (dispatch(apdu_request))
+        close();
+    else
+        flush_deferred();
+}
+
+// returns -1 if the association should be closed
+int Z_Server::dispatch(Z_APDU *apdu_request)
 {
     Z_Server_Facility_Info *f = m_facilities;
 
@@ -93,21 +566,31 @@ void Z_Server::recv_Z_PDU (Z_APDU *apdu_request, int len)
     }
     else
     {
-        f = m_facilities;
-        int taken = 0;
-        while (f)
-        {
-            taken = f->m_facility->recv(this, apdu_request);
-            if (taken)
-                break;
-            f = f->m_next;
-        }
-        if (!taken)
+        int type = apdu_request->which;
+        IServer_Facility **fp = m_p->any;
+        if (type >= 0 && type < m_p->num_types)
+            fp = m_p->table[type];
+        for (; *fp; fp++)
+            if ((*fp)->recv(this, apdu_request))
+                return 0;
+        yaz_log (YLOG_WARN, "unhandled request = %d", type);
+
+        // answer with Close rather than just dropping the connection
+        Z_APDU *apdu_response = create_Z_PDU(Z_APDU_close);
+        Z_Close *cl = apdu_response->u.close;
+        if (type == Z_APDU_close)
+            *cl->closeReason = Z_Close_finished;
+        else
         {
-            yaz_log (YLOG_WARN, "unhandled request = %d", apdu_request->which);
-            delete this;
+            *cl->closeReason = Z_Close_protocolError;
+            cl->diagnosticInformation =
+                odr_strdup(odr_encode(), "unsupported request");
         }
+        transfer_referenceId(apdu_request, apdu_response);
+        send_Z_PDU(apdu_response, 0);
+        return -1;
     }
+    return 0;
 }
 
 /*
@@ -20,6 +20,11 @@ IServer_Facility::~IServer_Facility()
 
 }
 
+const int *IServer_Facility::apdu_types()
+{
+    return 0;
+}
+
 /*
  * Local variables:
  * c-basic-offset: 4